@@ -0,0 +1,355 @@
+// Generator of the synthetic inputs of the benchmarks:
+//   a coordinate-sorted and indexed BAM file of UMI-tagged paired-end reads and a bgzipped and indexed VCF file of sparse or dense variants.
+// The reference sequence is a deterministic function of the seed, so the REF alleles of the VCF match the reads of the BAM generated with the same seed.
+
+#include "htslib/bgzf.h"
+#include "htslib/khash.h"
+#include "htslib/sam.h"
+#include "htslib/tbx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <queue>
+#include <string>
+#include <vector>
+
+#define MAX(a, b) (((a)>(b)) ? (a) : (b))
+
+const int DEFAULT_NUM_CONTIGS = 1;
+const int64_t DEFAULT_CONTIG_LEN = 1000 * 1000;
+const double DEFAULT_DEPTH = 200.0;
+const int DEFAULT_FAMILY_SIZE = 4;
+const int DEFAULT_READ_LEN = 150;
+const int DEFAULT_UMI_LEN = 4;
+const double DEFAULT_DUPLEX_FRAC = 0.5;
+const int DEFAULT_INSERT_SIZE = 300;
+const uint32_t DEFAULT_SEED = 1;
+const int64_t DEFAULT_NUM_VARIANTS = 100;
+const double DEFAULT_INDEL_FRAC = 0.2;
+
+const char *ACGT = "ACGT";
+
+typedef struct {
+    int num_contigs;
+    int64_t contig_len;
+    uint32_t seed;
+} gen_genome_t;
+
+// The random number of the n-th draw from the stream identified by (seed, stream).
+static inline uint32_t gen_rand(uint32_t seed, uint32_t stream, uint64_t n) {
+    return __ac_Wang_hash(__ac_Wang_hash(__ac_Wang_hash(seed) ^ stream) ^ __ac_Wang_hash((uint32_t)n) ^ (uint32_t)(n >> 32));
+}
+
+static inline double gen_rand_prob(uint32_t seed, uint32_t stream, uint64_t n) {
+    return (double)(gen_rand(seed, stream, n) & 0xffffff) / 0x1000000;
+}
+
+std::string gen_contig_name(int tid) {
+    return std::string("chr") + std::to_string(tid + 1);
+}
+
+char gen_ref_base(const gen_genome_t &genome, int tid, int64_t pos) {
+    return ACGT[gen_rand(genome.seed, 1000 + tid, pos) % 4];
+}
+
+// A simplex UMI is a random sequence of umi_len bases, and a duplex UMI consists of two such sequences joined by '+'.
+std::string gen_umi(uint32_t seed, uint64_t family_idx, int umi_len, int half) {
+    std::string umi;
+    for (int i = 0; i < umi_len; i++) {
+        umi.push_back(ACGT[gen_rand(seed, 2 + half, family_idx * 64 + i) % 4]);
+    }
+    return umi;
+}
+
+typedef struct {
+    int64_t pos;
+    uint64_t serial;
+    std::string line;
+} gen_samline_t;
+
+struct gen_samline_cmp_t {
+    bool operator()(const gen_samline_t &a, const gen_samline_t &b) const {
+        return (a.pos > b.pos) || (a.pos == b.pos && a.serial > b.serial);
+    }
+};
+
+typedef struct {
+    samFile *fp;
+    sam_hdr_t *hdr;
+    bam1_t *rec;
+    kstring_t kstr;
+    uint64_t num_reads;
+} gen_bam_writer_t;
+
+void gen_bam_write(gen_bam_writer_t &writer, const std::string &line) {
+    writer.kstr.l = 0;
+    kputsn(line.c_str(), line.size(), &writer.kstr);
+    if (sam_parse1(&writer.kstr, writer.hdr, writer.rec) < 0) {
+        fprintf(stderr, "Failed to parse the generated SAM line %s\n", line.c_str());
+        abort();
+    }
+    if (sam_write1(writer.fp, writer.hdr, writer.rec) < 0) {
+        fprintf(stderr, "Failed to write the generated SAM line %s\n", line.c_str());
+        abort();
+    }
+    writer.num_reads++;
+}
+
+std::string gen_samline(const gen_genome_t &genome, int tid, int64_t pos, int read_len, const std::string &qname, int flag, int64_t mpos, int tlen, uint64_t read_idx) {
+    std::string seq;
+    std::string qual;
+    for (int i = 0; i < read_len; i++) {
+        const uint32_t r = gen_rand(genome.seed, 5, read_idx * 1024 + i);
+        // about one sequencing error per thousand bases
+        seq.push_back((r % 1000 == 0) ? ACGT[(r >> 10) % 4] : gen_ref_base(genome, tid, pos + i));
+        qual.push_back((char)(33 + 20 + (r >> 12) % 21));
+    }
+    const std::string tname = gen_contig_name(tid);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "\t%d\t%s\t%ld\t60\t%dM\t=\t%ld\t%d\t", flag, tname.c_str(), (long)(pos + 1), read_len, (long)(mpos + 1), tlen);
+    return qname + buf + seq + "\t" + qual;
+}
+
+void gen_bam_help(int argc, char **argv, int exit_code) {
+    fprintf(stderr, "Usage: %s bam [options] <OUT.bam>\n", argv[0]);
+    fprintf(stderr, "  -c number of contigs [default to %d].\n", DEFAULT_NUM_CONTIGS);
+    fprintf(stderr, "  -l length of each contig [default to %ld].\n", (long)DEFAULT_CONTIG_LEN);
+    fprintf(stderr, "  -d sequencing depth [default to %f].\n", DEFAULT_DEPTH);
+    fprintf(stderr, "  -f number of read pairs per UMI family [default to %d].\n", DEFAULT_FAMILY_SIZE);
+    fprintf(stderr, "  -r read length [default to %d].\n", DEFAULT_READ_LEN);
+    fprintf(stderr, "  -u UMI length, where 0 means no UMI [default to %d].\n", DEFAULT_UMI_LEN);
+    fprintf(stderr, "  -x fraction of the UMI families with duplex UMIs such as #AGTA+TGGT [default to %f].\n", DEFAULT_DUPLEX_FRAC);
+    fprintf(stderr, "  -i insert size [default to %d].\n", DEFAULT_INSERT_SIZE);
+    fprintf(stderr, "  -s random seed [default to %u].\n", DEFAULT_SEED);
+    fprintf(stderr, "The read name is <contig>:<family>:<copy>#<UMI>, and the beta strand of a duplex family has its UMI halves swapped and its mates flipped. \n");
+    exit(exit_code);
+}
+
+int gen_bam_main(int argc, char **argv) {
+    gen_genome_t genome = {DEFAULT_NUM_CONTIGS, DEFAULT_CONTIG_LEN, DEFAULT_SEED};
+    double depth = DEFAULT_DEPTH;
+    int family_size = DEFAULT_FAMILY_SIZE;
+    int read_len = DEFAULT_READ_LEN;
+    int umi_len = DEFAULT_UMI_LEN;
+    double duplex_frac = DEFAULT_DUPLEX_FRAC;
+    int insert_size = DEFAULT_INSERT_SIZE;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l:d:f:r:u:x:i:s:h")) != -1) {
+        switch (opt) {
+            case 'c': genome.num_contigs = atoi(optarg); break;
+            case 'l': genome.contig_len = atol(optarg); break;
+            case 'd': depth = atof(optarg); break;
+            case 'f': family_size = atoi(optarg); break;
+            case 'r': read_len = atoi(optarg); break;
+            case 'u': umi_len = atoi(optarg); break;
+            case 'x': duplex_frac = atof(optarg); break;
+            case 'i': insert_size = atoi(optarg); break;
+            case 's': genome.seed = (uint32_t)atol(optarg); break;
+            case 'h': gen_bam_help(argc, argv, 0); break;
+            default: gen_bam_help(argc, argv, -1);
+        }
+    }
+    if (optind + 1 != argc || family_size < 1 || read_len < 1 || umi_len < 0 || umi_len > 14 || insert_size < read_len + 20 || genome.contig_len <= insert_size + 20) {
+        gen_bam_help(argc, argv, -1);
+    }
+    const char *outbam = argv[optind];
+
+    std::string hdrtext = "@HD\tVN:1.6\tSO:coordinate\n";
+    for (int tid = 0; tid < genome.num_contigs; tid++) {
+        hdrtext += "@SQ\tSN:" + gen_contig_name(tid) + "\tLN:" + std::to_string(genome.contig_len) + "\n";
+    }
+    hdrtext += "@PG\tID:gen_bench_data\tPN:gen_bench_data\n";
+    gen_bam_writer_t writer;
+    writer.fp = sam_open(outbam, "wb");
+    if (NULL == writer.fp) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outbam);
+        exit(-1);
+    }
+    writer.hdr = sam_hdr_parse(hdrtext.size(), hdrtext.c_str());
+    writer.rec = bam_init1();
+    writer.kstr = KS_INITIALIZE;
+    writer.num_reads = 0;
+    if (sam_hdr_write(writer.fp, writer.hdr) < 0) {
+        fprintf(stderr, "Failed to write the header to the file %s\n", outbam);
+        abort();
+    }
+
+    // The families are generated in the order of their leftmost positions,
+    //   so the reads starting after the current family (the rightmost mates) wait in a heap until the sweep reaches them.
+    const int64_t num_families_per_contig = (int64_t)(depth * genome.contig_len / (2.0 * read_len * family_size));
+    uint64_t family_idx = 0;
+    uint64_t serial = 0;
+    for (int tid = 0; tid < genome.num_contigs; tid++) {
+        std::priority_queue<gen_samline_t, std::vector<gen_samline_t>, gen_samline_cmp_t> pending;
+        const std::string tname = gen_contig_name(tid);
+        const int64_t max_begpos = genome.contig_len - insert_size - 20;
+        for (int64_t i = 0; i < num_families_per_contig; i++, family_idx++) {
+            const int64_t begpos = (int64_t)((double)i * max_begpos / num_families_per_contig);
+            const int isize = insert_size - 20 + (int)(gen_rand(genome.seed, 6, family_idx) % 41);
+            const int64_t endpos = begpos + isize;
+            const bool is_duplex = (umi_len > 0 && gen_rand_prob(genome.seed, 7, family_idx) < duplex_frac);
+            const std::string alpha = gen_umi(genome.seed, family_idx, umi_len, 0);
+            const std::string beta = (is_duplex ? gen_umi(genome.seed, family_idx, umi_len, 1) : std::string());
+            while (!pending.empty() && pending.top().pos <= begpos) {
+                gen_bam_write(writer, pending.top().line);
+                pending.pop();
+            }
+            for (int copy = 0; copy < family_size; copy++) {
+                const bool is_beta = (is_duplex && copy % 2 == 1);
+                std::string qname = tname + ":" + std::to_string(family_idx) + ":" + std::to_string(copy);
+                if (umi_len > 0) {
+                    qname += "#" + (is_duplex ? (is_beta ? (beta + "+" + alpha) : (alpha + "+" + beta)) : alpha);
+                }
+                const uint64_t read_idx = family_idx * 2 * family_size + 2 * copy;
+                const int64_t rpos = endpos - read_len;
+                // the alpha strand has its R1 forward at begpos, and the beta strand has its R1 reverse at rpos
+                const int lflag = (is_beta ? (0x1 | 0x2 | 0x20 | 0x80) : (0x1 | 0x2 | 0x20 | 0x40));
+                const int rflag = (is_beta ? (0x1 | 0x2 | 0x10 | 0x40) : (0x1 | 0x2 | 0x10 | 0x80));
+                gen_bam_write(writer, gen_samline(genome, tid, begpos, read_len, qname, lflag, rpos, isize, read_idx));
+                pending.push({rpos, serial++, gen_samline(genome, tid, rpos, read_len, qname, rflag, begpos, -isize, read_idx + 1)});
+            }
+        }
+        while (!pending.empty()) {
+            gen_bam_write(writer, pending.top().line);
+            pending.pop();
+        }
+    }
+
+    free(writer.kstr.s);
+    bam_destroy1(writer.rec);
+    sam_hdr_destroy(writer.hdr);
+    if (sam_close(writer.fp) < 0) {
+        fprintf(stderr, "Failed to close the file %s\n", outbam);
+        abort();
+    }
+    if (sam_index_build(outbam, 0) < 0) {
+        fprintf(stderr, "Failed to index the file %s\n", outbam);
+        abort();
+    }
+    fprintf(stderr, "Generated %lu reads in %lu UMI families into the file %s\n", writer.num_reads, family_idx, outbam);
+    return 0;
+}
+
+void gen_vcf_help(int argc, char **argv, int exit_code) {
+    fprintf(stderr, "Usage: %s vcf [options] <OUT.vcf.gz>\n", argv[0]);
+    fprintf(stderr, "  -c number of contigs [default to %d].\n", DEFAULT_NUM_CONTIGS);
+    fprintf(stderr, "  -l length of each contig [default to %ld].\n", (long)DEFAULT_CONTIG_LEN);
+    fprintf(stderr, "  -n number of variants per contig, which are evenly spread over the contig [default to %ld].\n", (long)DEFAULT_NUM_VARIANTS);
+    fprintf(stderr, "  -g mean gap between consecutive variants, which overrides -n if positive (for example, -g 1 gives a variant at almost every position).\n");
+    fprintf(stderr, "  -p fraction of the variants that are indels, half of which are insertions [default to %f].\n", DEFAULT_INDEL_FRAC);
+    fprintf(stderr, "  -a if positive, then the INFO/FA of each variant is a random allele fraction between zero and this value [default to no INFO/FA].\n");
+    fprintf(stderr, "  -s random seed, which has to be the one used for generating the BAM file [default to %u].\n", DEFAULT_SEED);
+    exit(exit_code);
+}
+
+int gen_vcf_main(int argc, char **argv) {
+    gen_genome_t genome = {DEFAULT_NUM_CONTIGS, DEFAULT_CONTIG_LEN, DEFAULT_SEED};
+    int64_t num_variants = DEFAULT_NUM_VARIANTS;
+    double mean_gap = 0;
+    double indel_frac = DEFAULT_INDEL_FRAC;
+    double max_allelefrac = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l:n:g:p:a:s:h")) != -1) {
+        switch (opt) {
+            case 'c': genome.num_contigs = atoi(optarg); break;
+            case 'l': genome.contig_len = atol(optarg); break;
+            case 'n': num_variants = atol(optarg); break;
+            case 'g': mean_gap = atof(optarg); break;
+            case 'p': indel_frac = atof(optarg); break;
+            case 'a': max_allelefrac = atof(optarg); break;
+            case 's': genome.seed = (uint32_t)atol(optarg); break;
+            case 'h': gen_vcf_help(argc, argv, 0); break;
+            default: gen_vcf_help(argc, argv, -1);
+        }
+    }
+    if (optind + 1 != argc || num_variants < 1 || genome.contig_len < 100) {
+        gen_vcf_help(argc, argv, -1);
+    }
+    const char *outvcf = argv[optind];
+    const size_t outvcf_len = strlen(outvcf);
+    const bool is_bgzipped = (outvcf_len > 3 && !strcmp(outvcf + outvcf_len - 3, ".gz"));
+    BGZF *fp = bgzf_open(outvcf, (is_bgzipped ? "w" : "wu"));
+    if (NULL == fp) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outvcf);
+        exit(-1);
+    }
+    std::string text = "##fileformat=VCFv4.2\n";
+    for (int tid = 0; tid < genome.num_contigs; tid++) {
+        text += "##contig=<ID=" + gen_contig_name(tid) + ",length=" + std::to_string(genome.contig_len) + ">\n";
+    }
+    if (max_allelefrac > 0) {
+        text += "##INFO=<ID=FA,Number=A,Type=Float,Description=\"Allele fraction of the variant\">\n";
+    }
+    text += "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+
+    uint64_t num_written = 0;
+    uint64_t var_idx = 0;
+    const double gap = ((mean_gap > 0) ? mean_gap : (double)(genome.contig_len - 20) / num_variants);
+    for (int tid = 0; tid < genome.num_contigs; tid++) {
+        const std::string tname = gen_contig_name(tid);
+        int64_t pos = 10;
+        while (pos < genome.contig_len - 20) {
+            const double typeprob = gen_rand_prob(genome.seed, 8, var_idx);
+            const char refbase = gen_ref_base(genome, tid, pos);
+            std::string ref(1, refbase);
+            std::string alt(1, refbase);
+            if (typeprob < indel_frac / 2) {
+                const int inslen = 1 + gen_rand(genome.seed, 9, var_idx) % 5;
+                for (int i = 0; i < inslen; i++) { alt.push_back(ACGT[gen_rand(genome.seed, 10, var_idx * 8 + i) % 4]); }
+            } else if (typeprob < indel_frac) {
+                const int dellen = 1 + gen_rand(genome.seed, 9, var_idx) % 5;
+                for (int i = 1; i <= dellen; i++) { ref.push_back(gen_ref_base(genome, tid, pos + i)); }
+            } else {
+                alt[0] = ACGT[(strchr(ACGT, refbase) - ACGT + 1 + gen_rand(genome.seed, 9, var_idx) % 3) % 4];
+            }
+            text += tname + "\t" + std::to_string(pos + 1) + "\t.\t" + ref + "\t" + alt + "\t.\t.\t";
+            if (max_allelefrac > 0) {
+                char buf[64];
+                snprintf(buf, sizeof(buf), "FA=%.4f\n", max_allelefrac * gen_rand_prob(genome.seed, 11, var_idx));
+                text += buf;
+            } else {
+                text += ".\n";
+            }
+            num_written++;
+            var_idx++;
+            // the gaps are uniform between one and twice the mean gap, and the next variant never overlaps with the deleted bases
+            const int64_t step = (int64_t)(1 + gen_rand_prob(genome.seed, 12, var_idx) * (2 * gap - 1));
+            pos += MAX(step, (int64_t)ref.size());
+            if (text.size() > 1024 * 1024) {
+                bgzf_write(fp, text.c_str(), text.size());
+                text.clear();
+            }
+        }
+    }
+    if (bgzf_write(fp, text.c_str(), text.size()) < 0 || bgzf_close(fp) < 0) {
+        fprintf(stderr, "Failed to write to the file %s\n", outvcf);
+        abort();
+    }
+    if (is_bgzipped && tbx_index_build(outvcf, 0, &tbx_conf_vcf) < 0) {
+        fprintf(stderr, "Failed to index the file %s\n", outvcf);
+        abort();
+    }
+    fprintf(stderr, "Generated %lu variants into the file %s\n", num_written, outvcf);
+    return 0;
+}
+
+void help(int argc, char **argv, int exit_code) {
+    fprintf(stderr, "Usage: %s (bam|vcf) [options] <OUTFILE>\n", argv[0]);
+    fprintf(stderr, "  bam: generate a coordinate-sorted and indexed BAM file of UMI-tagged paired-end reads.\n");
+    fprintf(stderr, "  vcf: generate a VCF file of sparse or dense variants whose REF alleles match the reads generated with the same seed.\n");
+    fprintf(stderr, "Run %s bam -h or %s vcf -h to see the options of each command.\n", argv[0], argv[0]);
+    exit(exit_code);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp("bam", argv[1])) {
+        return gen_bam_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp("vcf", argv[1])) {
+        return gen_vcf_main(argc - 1, argv + 1);
+    }
+    help(argc, argv, ((argc > 1 && !strcmp("-h", argv[1])) ? 0 : -1));
+}
@@ -0,0 +1,280 @@
+// Micro benchmarks of the per-read kernels of safemut: UMI hashing, the CIGAR walk of bamrec_spike and FASTQ formatting.
+// safemut.cpp is compiled into this program so that the benchmarks call exactly the functions used by safemut.
+
+#define SAFESIM_NO_MAIN
+#include "../safemut.cpp"
+
+const size_t DEFAULT_NUM_READS = 1024 * 64;
+const int BENCH_READ_LEN = 150;
+const int BENCH_NUM_REPEATS = 5;
+
+// The vector-based hashing of the first releases of safemut, kept as the baseline of the hashing benchmarks
+//   and as the reference that the fixed-arity hashing has to match bit for bit.
+uint32_t legacy_hashes2hash(std::vector<uint32_t> hashes) {
+    uint32_t ret = 0;
+    for (uint32_t hash : hashes) {
+        ret = __ac_Wang_hash(hash ^ ret);
+    }
+    return ret;
+}
+
+double legacy_umistr2prob(uint32_t &umihash, uint32_t randseed, uint32_t begpos, uint32_t endpos, const char *str) {
+    const char *umistr1 = strchr(str, '#');
+    const char *umistr = (NULL == umistr1 ? str : (umistr1 + 1));
+    std::vector<uint32_t> hashes;
+    hashes.reserve(4 + 1);
+    hashes.push_back(randseed);
+    hashes.push_back(begpos);
+    hashes.push_back(endpos);
+    size_t umi_strlen = strlen(umistr);
+    if ((umi_strlen % 2 == 1) && (umistr[(umi_strlen - 1) / 2] == '+') && umi_strlen <= 16 * 2 - 3) {
+        char alpha[16] = {0};
+        char beta[16] = {0};
+        strncpy(alpha, umistr, (umi_strlen - 1) / 2);
+        strncpy(beta, umistr + (umi_strlen - 1) / 2 + 1, (umi_strlen - 1) / 2);
+        const char *abmin = ((strcmp(alpha, beta) <= 0) ? alpha : beta);
+        const char *abmax = ((strcmp(alpha, beta) >= 0) ? alpha : beta);
+        hashes.push_back(__ac_X31_hash_string(abmin));
+        hashes.push_back(__ac_X31_hash_string(abmax));
+    } else {
+        hashes.push_back(__ac_X31_hash_string(umistr));
+    }
+    uint32_t k = legacy_hashes2hash(hashes);
+    umihash = k;
+    return (double)(k&0xffffff) / 0x1000000;
+}
+
+double legacy_qnameqpos2prob(uint32_t &hash, uint32_t randseed, const char *qname, int qpos) {
+    std::vector<uint32_t> hashes;
+    hashes.reserve(3);
+    hashes.push_back(randseed);
+    hashes.push_back(__ac_X31_hash_string(qname));
+    hashes.push_back(qpos);
+    uint32_t k = legacy_hashes2hash(hashes);
+    hash = k;
+    return (double)(k&0xffffff) / 0x1000000;
+}
+
+// The result of each benchmark is added to this sink so that the compiler cannot remove the benchmarked code.
+volatile uint64_t bench_sink = 0;
+
+// Print the best time per operation over several repeats of the function, which performs num_ops operations per call.
+template <class F>
+void bench_run(const char *name, size_t num_ops, F func) {
+    bench_sink += func(); // warm-up
+    int64_t best_ns = INT64_MAX;
+    for (int i = 0; i < BENCH_NUM_REPEATS; i++) {
+        const int64_t beg_ns = clock_ns(CLOCK_MONOTONIC);
+        bench_sink += func();
+        best_ns = MIN(best_ns, clock_ns(CLOCK_MONOTONIC) - beg_ns);
+    }
+    fprintf(stdout, "%-44s\t%10lu\t%10.2f ns/op\t%10.3f Mop/s\n", name, num_ops, (double)best_ns / num_ops, num_ops * 1e3 / (double)MAX(best_ns, 1));
+    fflush(stdout);
+}
+
+uint32_t bench_rand(uint32_t stream, uint64_t n) {
+    return __ac_Wang_hash(__ac_Wang_hash(stream) ^ __ac_Wang_hash((uint32_t)n));
+}
+
+std::string bench_qname(size_t read_idx, bool is_duplex) {
+    std::string qname = "bench:" + std::to_string(read_idx / 8) + ":" + std::to_string(read_idx % 8) + "#";
+    for (int i = 0; i < 4; i++) { qname.push_back(ACGT[bench_rand(1, read_idx / 8 * 16 + i) % 4]); }
+    if (is_duplex) {
+        qname.push_back('+');
+        for (int i = 0; i < 4; i++) { qname.push_back(ACGT[bench_rand(2, read_idx / 8 * 16 + i) % 4]); }
+    }
+    return qname;
+}
+
+// Reads of BENCH_READ_LEN bases starting every stride positions, with a mix of CIGAR strings, orientations and duplex UMIs.
+std::vector<bam1_t*> bench_reads_make(sam_hdr_t *hdr, size_t num_reads, int stride) {
+    const char *CIGARS[] = {"150M", "5S140M5S", "70M2I78M", "60M3D90M"};
+    std::vector<bam1_t*> reads;
+    kstring_t kstr = KS_INITIALIZE;
+    for (size_t i = 0; i < num_reads; i++) {
+        std::string seq;
+        std::string qual;
+        for (int j = 0; j < BENCH_READ_LEN; j++) {
+            const uint32_t r = bench_rand(3, i * 1024 + j);
+            seq.push_back(ACGT[r % 4]);
+            qual.push_back((char)(33 + 20 + (r >> 8) % 21));
+        }
+        const long pos = (long)(i / 2 * stride);
+        char buf[256];
+        snprintf(buf, sizeof(buf), "\t%d\tchr1\t%ld\t60\t%s\t=\t%ld\t%d\t", ((i % 2) ? 147 : 99), pos + 1, CIGARS[i % 4], pos + 151, ((i % 2) ? -300 : 300));
+        const std::string line = bench_qname(i, (i % 16 < 8)) + buf + seq + "\t" + qual;
+        kstr.l = 0;
+        kputsn(line.c_str(), line.size(), &kstr);
+        bam1_t *aln = bam_init1();
+        if (sam_parse1(&kstr, hdr, aln) < 0) {
+            fprintf(stderr, "Failed to parse the benchmark read %s\n", line.c_str());
+            abort();
+        }
+        reads.push_back(aln);
+    }
+    free(kstr.s);
+    return reads;
+}
+
+// Variants every gap positions over [0, endpos), where every fifth variant is an indel if is_mixed and every variant is an SNV otherwise.
+std::vector<spike_variant_t> bench_variants_make(int64_t endpos, int gap, bool is_mixed) {
+    std::vector<spike_variant_t> variants;
+    for (int64_t pos = 0; pos < endpos; pos += gap) {
+        spike_variant_t variant;
+        variant.rid = 0;
+        variant.pos = pos;
+        const int kind = (is_mixed ? (int)(variants.size() % 5) : 0);
+        variant.altbuf = ((4 == kind) ? "ACG" : "A");
+        variant.reflen = ((3 == kind) ? 3 : 1);
+        variant.altlen = variant.altbuf.size();
+        variant.type = spike_variant_type(variant.reflen, variant.altlen);
+        variant.allelefracs.push_back({0.5, 0.5, 0.5, 0.5, 0.5, 0, 0});
+        variants.push_back(variant);
+    }
+    for (auto &variant : variants) { variant.alt = variant.altbuf.c_str(); }
+    return variants;
+}
+
+uint64_t bench_bamrec_spike(const std::vector<bam1_t*> &reads, const std::vector<const spike_variant_t*> &variants, const spike_args_t &args, spike_workspace_t &ws) {
+    spike_stats_t stats;
+    uint64_t ret = 0;
+    for (const bam1_t *aln : reads) {
+        const auto beg = std::lower_bound(variants.begin(), variants.end(), aln->core.pos, [](const spike_variant_t *v, int64_t pos) { return v->pos < pos; });
+        const auto end = std::lower_bound(beg, variants.end(), bam_endpos(aln), [](const spike_variant_t *v, int64_t pos) { return v->pos < pos; });
+        ret += bamrec_spike(aln, variants.data() + (beg - variants.begin()), variants.data() + (end - variants.begin()), args, stats, ws) + ws.newseq.size();
+    }
+    return ret;
+}
+
+// Abort if the two kernels selected by args1 and args2 spike any read differently. 
+void bench_kernels_check(const std::vector<bam1_t*> &reads, const std::vector<const spike_variant_t*> &variants, const spike_args_t &args1, const spike_args_t &args2) {
+    spike_workspace_t ws1, ws2;
+    spike_stats_t stats;
+    for (const bam1_t *aln : reads) {
+        const auto beg = std::lower_bound(variants.begin(), variants.end(), aln->core.pos, [](const spike_variant_t *v, int64_t pos) { return v->pos < pos; });
+        const auto end = std::lower_bound(beg, variants.end(), bam_endpos(aln), [](const spike_variant_t *v, int64_t pos) { return v->pos < pos; });
+        const auto *vcf_recs_beg = variants.data() + (beg - variants.begin());
+        const auto *vcf_recs_end = variants.data() + (end - variants.begin());
+        if (bamrec_spike(aln, vcf_recs_beg, vcf_recs_end, args1, stats, ws1) != bamrec_spike(aln, vcf_recs_beg, vcf_recs_end, args2, stats, ws2) 
+                || ws1.newseq != ws2.newseq || ws1.newqual != ws2.newqual) {
+            fprintf(stderr, "The kernels %d and %d spiked the read %s differently!\n", args1.kernel_idx, args2.kernel_idx, bam_get_qname(aln));
+            abort();
+        }
+    }
+    spike_workspace_destroy(ws1);
+    spike_workspace_destroy(ws2);
+}
+
+int main(int argc, char **argv) {
+    const size_t num_reads = ((argc > 1) ? (size_t)atol(argv[1]) : DEFAULT_NUM_READS);
+    log_sink.verbosity = LOG_LEVEL_WARN;
+    const std::string hdrtext = "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:100000000\n";
+    sam_hdr_t *hdr = sam_hdr_parse(hdrtext.size(), hdrtext.c_str());
+    const std::vector<bam1_t*> reads = bench_reads_make(hdr, num_reads, 10);
+    std::vector<std::string> qnames;
+    for (const bam1_t *aln : reads) { qnames.push_back(bam_get_qname(aln)); }
+    const uint32_t randseed = portable_int2randint(DEFAULT_RANDSEED, 1);
+
+    // the fixed-arity hashing has to give the same spiking decisions as the vector-based hashing
+    for (size_t i = 0; i < qnames.size(); i++) {
+        uint32_t h1 = 0, h2 = 0;
+        if (umistr2prob(h1, randseed, i, i + 300, qnames[i].c_str()) != legacy_umistr2prob(h2, randseed, i, i + 300, qnames[i].c_str()) || h1 != h2) {
+            fprintf(stderr, "The UMI hash of the read %s differs from the one of the vector-based hashing!\n", qnames[i].c_str());
+            abort();
+        }
+        if (qnameqpos2prob(h1, randseed, qnames[i].c_str(), i % 150) != legacy_qnameqpos2prob(h2, randseed, qnames[i].c_str(), i % 150) || h1 != h2) {
+            fprintf(stderr, "The base-call hash of the read %s differs from the one of the vector-based hashing!\n", qnames[i].c_str());
+            abort();
+        }
+    }
+    fprintf(stdout, "The fixed-arity hashes are bit-identical to the vector-based hashes for %lu reads\n", qnames.size());
+
+    bench_run("umistr2prob", qnames.size(), [&]() {
+        uint64_t ret = 0; uint32_t h = 0;
+        for (size_t i = 0; i < qnames.size(); i++) { ret += (uint64_t)(umistr2prob(h, randseed, i, i + 300, qnames[i].c_str()) * 1e9) + h; }
+        return ret;
+    });
+    bench_run("umistr2prob (vector-based)", qnames.size(), [&]() {
+        uint64_t ret = 0; uint32_t h = 0;
+        for (size_t i = 0; i < qnames.size(); i++) { ret += (uint64_t)(legacy_umistr2prob(h, randseed, i, i + 300, qnames[i].c_str()) * 1e9) + h; }
+        return ret;
+    });
+    bench_run("umistr2prob_cached", qnames.size(), [&]() {
+        spike_workspace_t ws; spike_stats_t stats;
+        uint64_t ret = 0; uint32_t h = 0;
+        for (size_t i = 0; i < qnames.size(); i++) { ret += (uint64_t)(umistr2prob_cached(h, randseed, i / 8, i / 8 + 300, qnames[i].c_str(), 0, i / 8, ws, stats) * 1e9) + h; }
+        return ret;
+    });
+    bench_run("qnameqpos2prob", qnames.size(), [&]() {
+        uint64_t ret = 0; uint32_t h = 0;
+        for (size_t i = 0; i < qnames.size(); i++) { ret += (uint64_t)(qnameqpos2prob(h, randseed, qnames[i].c_str(), i % 150) * 1e9) + h; }
+        return ret;
+    });
+    bench_run("qnameqpos2prob (vector-based)", qnames.size(), [&]() {
+        uint64_t ret = 0; uint32_t h = 0;
+        for (size_t i = 0; i < qnames.size(); i++) { ret += (uint64_t)(legacy_qnameqpos2prob(h, randseed, qnames[i].c_str(), i % 150) * 1e9) + h; }
+        return ret;
+    });
+    bench_run("allelefrac transforms", qnames.size(), [&]() {
+        double ret = 0;
+        for (size_t i = 0; i < qnames.size(); i++) {
+            ret += allelefrac_powlaw_transform(0.1, 0, i, 11, 13, 3.0) + allelefrac_lognormal_transform(0.1, 0, i, 11, 13, 0.4);
+        }
+        return (uint64_t)ret;
+    });
+
+    spike_args_t args = {};
+    args.snv_bq_phred = DEFAULT_SNV_BQ_PHRED;
+    args.ins_bq_phred = DEFAULT_INS_BQ_PHRED;
+    args.randseed = randseed;
+    args.randseed_basecall = portable_int2randint(DEFAULT_RANDSEED, 4);
+    spike_args_set_kernel(args);
+    spike_workspace_t ws;
+    const int64_t endpos = (int64_t)(num_reads / 2 * 10 + 2 * BENCH_READ_LEN);
+    // sparse: about one variant per read, dense: a variant at every base as in a saturation-mutagenesis VCF
+    const std::vector<spike_variant_t> sparse_variants = bench_variants_make(endpos, 137, true);
+    const std::vector<spike_variant_t> dense_variants = bench_variants_make(endpos, 1, false);
+    std::vector<const spike_variant_t*> sparse_ptrs, dense_ptrs;
+    for (const auto &variant : sparse_variants) { sparse_ptrs.push_back(&variant); }
+    for (const auto &variant : dense_variants) { dense_ptrs.push_back(&variant); }
+    bench_run("bamrec_spike (sparse variants)", reads.size(), [&]() { return bench_bamrec_spike(reads, sparse_ptrs, args, ws); });
+    bench_run("bamrec_spike (dense SNVs)", reads.size(), [&]() { return bench_bamrec_spike(reads, dense_ptrs, args, ws); });
+    // the kernel specialized for each -x mode against the generic kernel checking the options at each base, which have to spike the same reads
+    for (const int snv_bq_phred : {-1, -2, 30}) {
+        spike_args_t args1 = args;
+        args1.snv_bq_phred = snv_bq_phred;
+        spike_args_set_kernel(args1);
+        spike_args_t generic_args = args1;
+        generic_args.kernel_idx = 0;
+        bench_kernels_check(reads, dense_ptrs, args1, generic_args);
+        const std::string name = "bamrec_spike (dense SNVs, -x " + std::to_string(snv_bq_phred);
+        bench_run((name + ")").c_str(), reads.size(), [&]() { return bench_bamrec_spike(reads, dense_ptrs, args1, ws); });
+        bench_run((name + ", generic)").c_str(), reads.size(), [&]() { return bench_bamrec_spike(reads, dense_ptrs, generic_args, ws); });
+    }
+
+    std::string outstr;
+    bench_run((std::string("bamrec_write_fastq_raw (") + THE_SIMD_KERNELS.name + ")").c_str(), reads.size(), [&]() {
+        outstr.clear();
+        for (const bam1_t *aln : reads) { bamrec_write_fastq_raw(aln, outstr); }
+        return (uint64_t)outstr.size();
+    });
+    bench_run("bamrec_write_fastq (spiked)", reads.size(), [&]() {
+        spike_stats_t stats;
+        outstr.clear();
+        for (const bam1_t *aln : reads) {
+            bamrec_spike(aln, sparse_ptrs.data(), sparse_ptrs.data() + sparse_ptrs.size(), args, stats, ws);
+            bamrec_write_fastq(aln, ws.newseq, ws.newqual, outstr);
+        }
+        return (uint64_t)outstr.size();
+    });
+    bench_run("fastq_compress (bgzf level 1)", reads.size(), [&]() {
+        std::string dst;
+        fastq_compress(dst, outstr, FASTQ_FORMAT_BGZF, 1, ws);
+        return (uint64_t)dst.size();
+    });
+
+    spike_workspace_destroy(ws);
+    for (bam1_t *aln : reads) { bam_destroy1(aln); }
+    sam_hdr_destroy(hdr);
+    return (0 == bench_sink ? 1 : 0);
+}
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+# Macro benchmarks of safemut and safemix on synthetic data followed by the micro benchmarks of the per-read kernels.
+# Usage: bench/run_bench.sh [<BENCH-DIR>], where the binaries are expected in the current directory (as built by "make bench").
+# The size of the synthetic data can be changed with the environment variables below, for example: BENCH_DEPTH=1000 make bench
+set -euo pipefail
+
+BENCH_DIR="${1:-bench/data}"
+BENCH_CONTIGS="${BENCH_CONTIGS:-2}"
+BENCH_CONTIG_LEN="${BENCH_CONTIG_LEN:-500000}"
+BENCH_DEPTH="${BENCH_DEPTH:-200}"
+BENCH_FAMILY_SIZE="${BENCH_FAMILY_SIZE:-4}"
+BENCH_READ_LEN="${BENCH_READ_LEN:-150}"
+BENCH_NTHREADS="${BENCH_NTHREADS:-4}"
+BENCH_MICRO_READS="${BENCH_MICRO_READS:-65536}"
+
+SAFEMUT=./safemut
+SAFEMIX=./safemix
+GEN=bench/gen_bench_data
+MICRO=bench/micro_bench
+
+mkdir -p "${BENCH_DIR}"
+D="${BENCH_DIR}"
+GENOME="-c ${BENCH_CONTIGS} -l ${BENCH_CONTIG_LEN}"
+
+# The data are regenerated only if the parameters changed, because generating them can take longer than the benchmarks.
+PARAMS="${BENCH_CONTIGS} ${BENCH_CONTIG_LEN} ${BENCH_DEPTH} ${BENCH_FAMILY_SIZE} ${BENCH_READ_LEN}"
+if [ ! -f "${D}/params.txt" ] || [ "$(cat "${D}/params.txt")" != "${PARAMS}" ]; then
+    ${GEN} bam ${GENOME} -d "${BENCH_DEPTH}" -f "${BENCH_FAMILY_SIZE}" -r "${BENCH_READ_LEN}" -x 0.5 -s 1 "${D}/tumor.bam"
+    ${GEN} bam ${GENOME} -d "${BENCH_DEPTH}" -f "${BENCH_FAMILY_SIZE}" -r "${BENCH_READ_LEN}" -x 0.5 -s 2 "${D}/normal.bam"
+    # sparse: a panel of one variant per 1000 bases, dense: a variant at every base as in saturation mutagenesis
+    ${GEN} vcf ${GENOME} -g 1000 -a 0.2 -s 1 "${D}/sparse.vcf.gz"
+    ${GEN} vcf ${GENOME} -g 1 -p 0.1 -s 1 "${D}/dense.vcf.gz"
+    echo "${PARAMS}" > "${D}/params.txt"
+fi
+${SAFEMUT} compile-vcf -v "${D}/sparse.vcf.gz" -o "${D}/sparse.plan" 2> /dev/null
+
+json_field() {
+    sed -n "s/^  \"$2\": \\([0-9.]*\\),*$/\\1/p" "$1"
+}
+
+printf "%-40s\t%10s\t%14s\t%12s\n" "benchmark" "wall_sec" "reads_per_sec" "peak_rss_kb"
+bench_safemut() {
+    local name="$1"
+    shift
+    rm -f "${D}"/out.*
+    ${SAFEMUT} -b "${D}/tumor.bam" -1 "${D}/out.R1.fastq.gz" -2 "${D}/out.R2.fastq.gz" -0 "${D}/out.R0.fastq.gz" -J "${D}/out.json" "$@" 2> /dev/null
+    printf "%-40s\t%10s\t%14s\t%12s\n" "${name}" "$(json_field "${D}/out.json" wall_sec)" "$(json_field "${D}/out.json" reads_per_sec)" \
+        "$(json_field "${D}/out.json" peak_rss_kb)"
+}
+bench_safemut "safemut sparse"                        -v "${D}/sparse.vcf.gz"
+bench_safemut "safemut sparse -t ${BENCH_NTHREADS}"   -v "${D}/sparse.vcf.gz" -t "${BENCH_NTHREADS}"
+bench_safemut "safemut sparse -g 100000 -t ${BENCH_NTHREADS}" -v "${D}/sparse.vcf.gz" -g 100000 -t "${BENCH_NTHREADS}"
+bench_safemut "safemut sparse spike-plan"             -v "${D}/sparse.plan"
+bench_safemut "safemut sparse -O plain"               -v "${D}/sparse.vcf.gz" -O plain
+bench_safemut "safemut sparse -o BAM"                 -v "${D}/sparse.vcf.gz" -o "${D}/out.bam"
+bench_safemut "safemut sparse -P 64"                  -v "${D}/sparse.vcf.gz" -P 64
+bench_safemut "safemut dense"                         -v "${D}/dense.vcf.gz"
+bench_safemut "safemut dense -t ${BENCH_NTHREADS}"    -v "${D}/dense.vcf.gz" -t "${BENCH_NTHREADS}"
+
+bench_safemix() {
+    local name="$1"
+    shift
+    rm -f "${D}"/mix.*
+    ${SAFEMIX} -a "${D}/tumor.bam" -b "${D}/normal.bam" -o "${D}/mix" -J "${D}/mix.json" "$@" 2> /dev/null
+    printf "%-40s\t%10s\t%14s\t%12s\n" "${name}" "$(json_field "${D}/mix.json" wall_sec)" "$(json_field "${D}/mix.json" reads_per_sec)" \
+        "$(json_field "${D}/mix.json" peak_rss_kb)"
+}
+bench_safemix "safemix"
+bench_safemix "safemix -f 0.01,0.05,0.2"              -f 0.01,0.05,0.2
+bench_safemix "safemix -m"                            -m
+
+echo
+${MICRO} "${BENCH_MICRO_READS}"
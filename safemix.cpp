@@ -1,27 +1,41 @@
 #include "portable_rand.h"
+#include "safesim.h"
+#include "target_regions.h"
 #include "version.h"
 
+#include "htslib/bgzf.h"
 #include "htslib/khash.h"
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 #include "htslib/vcf.h"
 #include "zlib.h"
 
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #if defined(__cplusplus) && (__cplusplus >= 201103L)
-const char *GIT_DIFF_FULL =
+static const char *GIT_DIFF_FULL =
 #include "gitdiff.txt"
 ;
 #else
-const char *GIT_DIFF_FULL = "NotAvailable";
+static const char *GIT_DIFF_FULL = "NotAvailable";
 #endif
 
 #define MIN(a, b) (((a)<(b)) ? (a) : (b))
 #define MAX(a, b) (((a)>(b)) ? (a) : (b))
 
-bool ispowerof2(int n) {
+static inline bool ispowerof2(int n) {
     return 0 == (n & (n-1));
 }
 
@@ -52,10 +66,19 @@ typedef struct {
     const double j = 10.0;
     const uint32_t r = 13;
     const uint32_t s = 23;
+    const int nthreads_hts = 0;
+    const int progress_interval = 0;
 } arg_default_vals_t;
 
 const arg_default_vals_t arg_default_vals;
+const char *STDOUT_SAMPLE_NAME = "mixed";
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+const bool IS_LITTLE_ENDIAN = true;
+#else
+const bool IS_LITTLE_ENDIAN = false;
+#endif
 
+#ifndef SAFESIM_NO_MAIN
 void help(int argc, char **argv, int exit_code) {
     fprintf(stdout, "Program %s version %s (%s)\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH);
     fprintf(stdout, "  This program mixes two bam files and is aware of the molecular-barcodes (also known as unique molecular identifiers (UMIs))\n");
@@ -64,19 +87,40 @@ void help(int argc, char **argv, int exit_code) {
     fprintf(stdout, "Optional parameters:\n");
     fprintf(stdout, "  -d <tumor-umi-size> average number of reads in a UMI family in the <TUMOR-INPUT-BAM> file [default to %f]\n", arg_default_vals.d); 
     fprintf(stdout, "  -e <normal-umi-size> average number of reads in a UMI family in the <NORMAL-INPUT-BAM> file [default to %f]\n", arg_default_vals.e);
-    fprintf(stdout, "  -f <tumor-fraction> the fraction of DNA that comes from tumor [default to %f]\n", arg_default_vals.f); 
+    fprintf(stdout, "  -f <tumor-fraction> the fraction of DNA that comes from tumor, or a comma-separated list of such fractions (e.g., 0.001,0.002,0.005) to simulate a dilution series in one pass [default to %f]\n", arg_default_vals.f); 
     fprintf(stdout, "  -i <tumor-initial-quantity> initial quantity of DNA in ng sequenced in the <TUMOR-INPUT-BAM> file [default to %f]\n", arg_default_vals.i);
     fprintf(stdout, "  -j <normal-initial-quantity> initial quantity of DNA in ng sequenced in the <NORMAL-INPUT-BAM> file [default to %f]\n",  arg_default_vals.j);
     fprintf(stdout, "  -r <random-seed-for-initial-quantity> random seed used to select the UMI from the initial quantity of DNA [default to %d]\n", arg_default_vals.r);
     fprintf(stdout, "  -s <random-seed-for-umi-size>\n random seed used to select the reads in each UMI [default to %d]\n",  arg_default_vals.s);
+    fprintf(stdout, "  -m <merge> set the program to merge the tumor and normal reads into one coordinate-sorted BAM file named <OUTPUT-PREFIX>.bam, "
+            "where the tumor and normal reads are tagged with the read groups (RG) tumor and normal, respectively, and the sample name (SM) of both read groups is the filename of <OUTPUT-PREFIX> [default to unset]\n");
+    fprintf(stdout, "  -x <index-format> the format of the index (either bai or csi) written together with the merged BAM file if -m is set, where NULL pointer means no index [default to NULL pointer]\n");
+    fprintf(stdout, "  -O <output-format> the format of the output files, which is either bam or cram, where the output filenames end with .cram instead of .bam for cram [default to bam]\n");
+    fprintf(stdout, "  -T <reference> the reference FASTA file used for decoding the input CRAM files and for encoding the output CRAM files [default to NULL pointer]\n");
+    fprintf(stdout, "  -u <uncompressed> set the program to write the output BAM files with compression level 0, so that the output can be piped into the next tool without any compression round-trip [default to unset]\n");
+    fprintf(stdout, "  -I <progress-interval> the interval in seconds between the progress reports with the reads per second, the current positions, and the ETA, "
+            "which are estimated from the compressed offsets in the input BAM files, where zero means no progress report [default to %d]\n", arg_default_vals.progress_interval);
+    fprintf(stdout, "  -J <run-report> the run report in the JSON format with the wall times of the read, select, and write stages, the reads and bytes per second, the peak memory, "
+            "and the tumor and normal reads written for each tumor fraction [default to NULL pointer]\n");
+    fprintf(stdout, "  -R <target-regions> the BED file of the target regions (for example, the capture panel), where only the reads overlapping the targets and their mates outside the targets are mixed using the BAM indexes, "
+            "so that the pairs are never broken and the output BAM files are still sorted by coordinate [default to NULL pointer]\n");
     fprintf(stdout, "  -U <use-only-umi>\n set the program to use only UMIs for identifying read families (discard read start and end positions) [default to unset]\n");
+    fprintf(stdout, "  -@ <threads> number of threads in the pool shared by BAM decompression and compression, where zero means that (de)compression is done by the calling thread [default to %d]\n", arg_default_vals.nthreads_hts);
     
     fprintf(stdout, "Note:\n");
     fprintf(stdout, "<tumor-INPUT-BAM> and <normal-INPUT-BAM> both have to be sorted and indexed.\n");
     fprintf(stdout, "To detect UMI, this prgram first checks for the MI tag in each alignment record in <tumor-INPUT-BAM> and <normal-INPUT-BAM>. If the MI tag is absent, then the program checks for the string after the number-hash-pound sign (#) in the read name (QNAME).\n");
     fprintf(stdout, "<OUTPUT-PREFIX> is appended by the string literals \".tumor.bam\" and \".normal.bam\" (without the double quotes) to generate the tumor and normal simulated BAM filenames, respectively. The tumor and normal bam files have to be merged (e.g., by samtools merge) to simulate the sequenced sample. \n");
+    fprintf(stdout, "If multiple tumor fractions are specified, then <OUTPUT-PREFIX> is appended by \".f<tumor-fraction>.tumor.bam\" and \".f<tumor-fraction>.normal.bam\" (or by \".f<tumor-fraction>.bam\" if -m is set) for each tumor fraction, where <tumor-fraction> is the one specified on the command line.\n");
+    fprintf(stdout, "If -m is set, then <tumor-INPUT-BAM> and <normal-INPUT-BAM> must have the same reference sequences in their headers, and their own read groups are replaced by the tumor and normal read groups.\n");
+    fprintf(stdout, "<tumor-INPUT-BAM> and <normal-INPUT-BAM> are read concurrently, and each of them is read only once for all tumor fractions.\n");
+    fprintf(stdout, "Either <tumor-INPUT-BAM> or <normal-INPUT-BAM> can be - for the standard input. "
+            "<OUTPUT-PREFIX> can be - for writing the merged BAM file to the standard output if -m is set with only one tumor fraction and without -x, "
+            "in which case the sample name (SM) of both read groups is %s "
+            "(for example: samtools view -u tumor.bam | %s -a - -b normal.bam -m -u -o - | safemut -b - ...).\n", STDOUT_SAMPLE_NAME, argv[0]);
     exit(exit_code);
 }
+#endif
 
 typedef struct {
     char *filename;
@@ -85,6 +129,617 @@ typedef struct {
     double read_fam_frac;
 } subsample_info_t;
 
+// The stages of subsampling timed in the profiling mode
+enum subsample_stage_t {
+    SUBSAMPLE_STAGE_READ,
+    SUBSAMPLE_STAGE_SELECT,
+    SUBSAMPLE_STAGE_WRITE,
+    SUBSAMPLE_STAGE_NUM,
+};
+const char *SUBSAMPLE_STAGE_NAMES[] = {"read", "select", "write"};
+
+static inline int64_t clock_ns(clockid_t clock_id) {
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct {
+    int64_t num_input_reads = 0;
+    int64_t num_rescued_mates = 0;
+    std::vector<int64_t> num_output_reads; // one per tumor fraction
+    int64_t stage_wall_ns[SUBSAMPLE_STAGE_NUM] = {0};
+} subsample_stats_t;
+
+// One input BAM file is subsampled into one output BAM file per tumor fraction. 
+// The output BAM files share the same read-family probability but have different UMI-draw probabilities. 
+typedef struct {
+    const char *filename;
+    std::vector<std::string> outbams;
+    std::vector<double> umi_draw_probs;
+    double read_draw_given_umi_prob;
+    uint32_t randseed1;
+    uint32_t randseed2;
+    int use_only_umi;
+    const char *outbam_mode; // wb or wc followed by 0 if uncompressed
+    const char *reference; // for CRAM
+    htsThreadPool *tpool;
+    bool is_profiling; // if true, then the time spent in each stage is measured for the run report
+    const char *target_bed = NULL; // if not NULL, then only the reads overlapping the target regions and their mates are visited using the BAM index
+    target_regions_t targets;
+    target_mates_t target_mates;
+    hts_idx_t *bam_idx = NULL;
+    hts_itr_t *bam_itr = NULL;
+    subsample_stats_t stats;
+    // the progress published by the thread reading this task for the progress thread
+    std::atomic<int64_t> progress_reads{0};
+    std::atomic<int64_t> progress_offset{-1}; // the compressed offset, or -1 if the input is not BGZF-compressed
+    std::atomic<int32_t> progress_tid{-1};
+    std::atomic<int64_t> progress_pos{-1};
+} subsample_task_t;
+
+// Publish the progress of the task with a few relaxed stores, so that the progress thread can report it without any per-record check. 
+static inline void subsample_publish(subsample_task_t *task, samFile *bam_fp, const bam1_t *bam_rec) {
+    task->progress_reads.store(task->stats.num_input_reads, std::memory_order_relaxed);
+    task->progress_tid.store(bam_rec->core.tid, std::memory_order_relaxed);
+    task->progress_pos.store(bam_rec->core.pos, std::memory_order_relaxed);
+    if (bam_fp->is_bgzf) {
+        task->progress_offset.store(bgzf_tell(bam_fp->fp.bgzf) >> 16, std::memory_order_relaxed);
+    }
+}
+
+// Add the wall time since last_ns to the stage of the task and move last_ns to now, so that consecutive stages need only one clock reading each. 
+static inline void subsample_lap(subsample_task_t *task, subsample_stage_t stage, int64_t &last_ns) {
+    if (!task->is_profiling) { return; }
+    const int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+    task->stats.stage_wall_ns[stage] += now_ns - last_ns;
+    last_ns = now_ns;
+}
+
+// Return the UMI probability of the record, or a value above any UMI-draw probability if the record is never drawn. 
+double subsample_umi_prob(const subsample_task_t *task, const bam1_t *bam_rec) {
+    if (0 != (bam_rec->core.flag & 0x900)) { return 2.0; }
+    const double prob2 = qname2prob(bam_get_qname(bam_rec), task->randseed2);
+    if (prob2 >= task->read_draw_given_umi_prob) { return 2.0; }
+    const auto *bam_aux_data = bam_aux_get(bam_rec, "MI"); // this tag is reserved (https://samtools.github.io/hts-specs/SAMtags.pdf)
+    const char *umistr = ((bam_aux_data != NULL) ? bam_aux2Z(bam_aux_data) : bam_get_qname(bam_rec));
+    const auto abegin = (task->use_only_umi ? (0) : MIN(bam_rec->core.pos, bam_rec->core.mpos));
+    const auto aisize = (task->use_only_umi ? (0) : abs(bam_rec->core.isize));
+    return umistr2prob(umistr, abegin, aisize, task->randseed1);
+}
+
+samFile *subsample_open_input(const subsample_task_t *task, sam_hdr_t **bam_hdr) {
+    samFile *bam_fp = sam_open(task->filename, "r");
+    if (NULL == bam_fp) {
+        fprintf(stderr, "Failed to open the file %s for reading\n", task->filename);
+        abort();
+    }
+    if (task->tpool->pool != NULL) {
+        hts_set_opt(bam_fp, HTS_OPT_THREAD_POOL, task->tpool);
+    }
+    if (task->reference != NULL && hts_set_opt(bam_fp, CRAM_OPT_REFERENCE, task->reference) != 0) {
+        fprintf(stderr, "Failed to set the reference %s for the file %s\n", task->reference, task->filename);
+        abort();
+    }
+    *bam_hdr = sam_hdr_read(bam_fp);
+    if (NULL == *bam_hdr) {
+        fprintf(stderr, "Failed to read the SAM header from the file %s\n", task->filename);
+        abort();
+    }
+    return bam_fp;
+}
+
+// Return the region list of the intervals (indexed by tid) for sam_itr_regions, which takes the ownership of the list. 
+hts_reglist_t *subsample_reglist(const std::vector<std::vector<std::pair<hts_pos_t, hts_pos_t>>> &intervals, const sam_hdr_t *bam_hdr, int &n_regs) {
+    hts_reglist_t *reglist = (hts_reglist_t*)calloc(intervals.size() + 1, sizeof(hts_reglist_t));
+    n_regs = 0;
+    for (size_t tid = 0; tid < intervals.size(); tid++) {
+        if (0 == intervals[tid].size()) { continue; }
+        hts_reglist_t &reg = reglist[n_regs++];
+        reg.reg = sam_hdr_tid2name(bam_hdr, tid);
+        reg.tid = tid;
+        reg.count = intervals[tid].size();
+        reg.intervals = (hts_pair_pos_t*)malloc(reg.count * sizeof(hts_pair_pos_t));
+        for (uint32_t j = 0; j < reg.count; j++) {
+            reg.intervals[j].beg = intervals[tid][j].first;
+            reg.intervals[j].end = intervals[tid][j].second;
+        }
+        reg.min_beg = reg.intervals[0].beg;
+        reg.max_end = reg.intervals[reg.count - 1].end;
+    }
+    return reglist;
+}
+
+hts_itr_t *subsample_itr_regions(const subsample_task_t *task, sam_hdr_t *bam_hdr, const std::vector<std::vector<std::pair<hts_pos_t, hts_pos_t>>> &intervals) {
+    int n_regs = 0;
+    hts_reglist_t *reglist = subsample_reglist(intervals, bam_hdr, n_regs);
+    hts_itr_t *bam_itr = sam_itr_regions(task->bam_idx, bam_hdr, reglist, n_regs);
+    if (NULL == bam_itr) {
+        fprintf(stderr, "Failed to query the target regions in the file %s\n", task->filename);
+        abort();
+    }
+    return bam_itr;
+}
+
+// Open the iterator over the reads overlapping the targets and the mates outside the targets of these reads. 
+// The targets are read twice: first only for the positions of the mates outside the targets, 
+//   then together with these mates, so that the reads are still visited in the coordinate order. 
+void subsample_open_targets(subsample_task_t *task, samFile *bam_fp, sam_hdr_t *bam_hdr) {
+    target_regions_load(task->targets, task->target_bed, bam_hdr);
+    task->bam_idx = sam_index_load(bam_fp, task->filename);
+    if (NULL == task->bam_idx) {
+        fprintf(stderr, "Failed to load the index of the file %s\n", task->filename);
+        abort();
+    }
+    hts_itr_t *target_itr = subsample_itr_regions(task, bam_hdr, task->targets.intervals);
+    bam1_t *bam_rec = bam_init1();
+    int read_ret = 0;
+    while ((read_ret = sam_itr_next(bam_fp, target_itr, bam_rec)) >= 0) {
+        target_mates_add(task->target_mates, task->targets, bam_rec);
+    }
+    if (read_ret < -1) {
+        fprintf(stderr, "Failed to read the target regions in the file %s (error code %d)\n", task->filename, read_ret);
+        abort();
+    }
+    bam_destroy1(bam_rec);
+    hts_itr_destroy(target_itr);
+    auto intervals = target_mates_intervals(task->target_mates, task->targets.intervals.size(), TARGET_MATES_MAX_GAP);
+    for (size_t tid = 0; tid < intervals.size(); tid++) {
+        intervals[tid].insert(intervals[tid].end(), task->targets.intervals[tid].begin(), task->targets.intervals[tid].end());
+        target_intervals_merge(intervals[tid]);
+    }
+    task->bam_itr = subsample_itr_regions(task, bam_hdr, intervals);
+}
+
+// Read the next record of the task, which skips the rest of the reads around the mates if the targets are set. 
+static inline int subsample_read1(subsample_task_t *task, samFile *bam_fp, sam_hdr_t *bam_hdr, bam1_t *bam_rec) {
+    if (NULL == task->bam_itr) { return sam_read1(bam_fp, bam_hdr, bam_rec); }
+    int read_ret = 0;
+    while ((read_ret = sam_itr_next(bam_fp, task->bam_itr, bam_rec)) >= 0) {
+        if (target_regions_overlap_read(task->targets, bam_rec)) { break; }
+        if (target_mates_is_rescued(task->target_mates, task->targets, bam_rec)) {
+            task->stats.num_rescued_mates++;
+            break;
+        }
+    }
+    return read_ret;
+}
+
+void subsample_close_targets(subsample_task_t *task) {
+    if (task->bam_itr != NULL) { hts_itr_destroy(task->bam_itr); }
+    if (task->bam_idx != NULL) { hts_idx_destroy(task->bam_idx); }
+    task->bam_itr = NULL;
+    task->bam_idx = NULL;
+}
+
+samFile *subsample_open_output(const subsample_task_t *task, const std::string &outbam, const sam_hdr_t *bam_hdr) {
+    samFile *outbam_fp = sam_open(outbam.c_str(), task->outbam_mode);
+    if (NULL == outbam_fp) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outbam.c_str());
+        abort();
+    }
+    if (task->tpool->pool != NULL) {
+        hts_set_opt(outbam_fp, HTS_OPT_THREAD_POOL, task->tpool);
+    }
+    if (task->reference != NULL && hts_set_opt(outbam_fp, CRAM_OPT_REFERENCE, task->reference) != 0) {
+        fprintf(stderr, "Failed to set the reference %s for the file %s\n", task->reference, outbam.c_str());
+        abort();
+    }
+    int write_ret = sam_hdr_write(outbam_fp, bam_hdr);
+    if (write_ret < 0) {
+        fprintf(stderr, "Failed to write the SAM header to the file %s\n", outbam.c_str());
+        abort();
+    }
+    return outbam_fp;
+}
+
+// Read the next record of the BAM file as raw bytes into buf (including the leading block_size), 
+//   and set bam_view to a read-only view of the record in buf without decoding the record. 
+// The view has only the core fields, the QNAME and the aux tags usable, and the view does not own its data. 
+// Return the block size, -1 at the end of the file, or less than -1 on error. 
+int subsample_read_raw(BGZF *bgzf, std::vector<uint8_t> &buf, bam1_t *bam_view) {
+    int32_t block_size = 0;
+    const ssize_t ret = bgzf_read(bgzf, &block_size, 4);
+    if (0 == ret) { return -1; }
+    if (4 != ret || block_size < 32) { return -2; }
+    buf.resize(4 + block_size);
+    memcpy(buf.data(), &block_size, 4);
+    if (bgzf_read(bgzf, buf.data() + 4, block_size) != block_size) { return -3; }
+    const uint8_t *x = buf.data() + 4;
+    int32_t i32 = 0;
+    uint16_t u16 = 0;
+    bam1_core_t &core = bam_view->core;
+    memcpy(&i32, x +  0, 4); core.tid = i32;
+    memcpy(&i32, x +  4, 4); core.pos = i32;
+    core.l_qname = x[8];
+    core.qual = x[9];
+    memcpy(&u16, x + 10, 2); core.bin = u16;
+    memcpy(&u16, x + 12, 2); core.n_cigar = u16;
+    memcpy(&u16, x + 14, 2); core.flag = u16;
+    memcpy(&i32, x + 16, 4); core.l_qseq = i32;
+    memcpy(&i32, x + 20, 4); core.mtid = i32;
+    memcpy(&i32, x + 24, 4); core.mpos = i32;
+    memcpy(&i32, x + 28, 4); core.isize = i32;
+    core.l_extranul = 0;
+    bam_view->data = (uint8_t*)(x + 32);
+    bam_view->l_data = block_size - 32;
+    bam_view->m_data = 0;
+    if (core.l_qname < 1 || core.l_qseq < 0 
+            || (int64_t)core.l_qname + core.n_cigar * 4 + (core.l_qseq + 1) / 2 + core.l_qseq > bam_view->l_data 
+            || bam_view->data[core.l_qname - 1] != '\0') {
+        return -4;
+    }
+    return block_size;
+}
+
+// If both the input and the outputs are BAM, then each record is only viewed for the keep/drop decision 
+//   and each kept record is copied as raw bytes, so no record is ever decoded into or encoded from a bam1_t. 
+// This raw path assumes the little-endian byte order of BAM. 
+void subsample_run_raw(subsample_task_t *task, samFile *bam_fp, const std::vector<samFile*> &outbam_fps) {
+    std::vector<uint8_t> buf;
+    bam1_t bam_view;
+    memset(&bam_view, 0, sizeof(bam_view));
+    int read_ret = 0;
+    int64_t lap_ns = clock_ns(CLOCK_MONOTONIC);
+    while ((read_ret = subsample_read_raw(bam_fp->fp.bgzf, buf, &bam_view)) >= 0) {
+        subsample_lap(task, SUBSAMPLE_STAGE_READ, lap_ns);
+        task->stats.num_input_reads++;
+        subsample_publish(task, bam_fp, &bam_view);
+        const double prob1 = subsample_umi_prob(task, &bam_view);
+        subsample_lap(task, SUBSAMPLE_STAGE_SELECT, lap_ns);
+        for (size_t i = 0; i < outbam_fps.size(); i++) {
+            if (prob1 < task->umi_draw_probs[i]) {
+                task->stats.num_output_reads[i]++;
+                BGZF *outbgzf = outbam_fps[i]->fp.bgzf;
+                if (bgzf_flush_try(outbgzf, buf.size()) < 0 || bgzf_write(outbgzf, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+                    fprintf(stderr, "Failed to write the read %s at tid %d pos %ld to the file %s\n", bam_get_qname(&bam_view), bam_view.core.tid, bam_view.core.pos, task->outbams[i].c_str());
+                    abort();
+                }
+            }
+        }
+        subsample_lap(task, SUBSAMPLE_STAGE_WRITE, lap_ns);
+    }
+    if (read_ret < -1) {
+        fprintf(stderr, "Failed to read the record after the read %s in the file %s (error code %d)\n", 
+                ((buf.size() > 36) ? bam_get_qname(&bam_view) : "NA"), task->filename, read_ret);
+        abort();
+    }
+}
+
+void subsample_run(subsample_task_t *task) {
+    sam_hdr_t *bam_hdr = NULL;
+    samFile *bam_fp = subsample_open_input(task, &bam_hdr);
+    bam1_t *bam_rec = bam_init1();
+    
+    std::vector<samFile*> outbam_fps;
+    bool is_raw = (bam == hts_get_format(bam_fp)->format && IS_LITTLE_ENDIAN && NULL == task->target_bed);
+    for (const auto & outbam : task->outbams) {
+        outbam_fps.push_back(subsample_open_output(task, outbam, bam_hdr));
+        is_raw = (is_raw && bam == hts_get_format(outbam_fps.back())->format);
+    }
+    
+    if (task->target_bed != NULL) { subsample_open_targets(task, bam_fp, bam_hdr); }
+    if (is_raw) { 
+        subsample_run_raw(task, bam_fp, outbam_fps); 
+    } else {
+        int64_t lap_ns = clock_ns(CLOCK_MONOTONIC);
+        while (subsample_read1(task, bam_fp, bam_hdr, bam_rec) >= 0) {
+            subsample_lap(task, SUBSAMPLE_STAGE_READ, lap_ns);
+            task->stats.num_input_reads++;
+            subsample_publish(task, bam_fp, bam_rec);
+            const double prob1 = subsample_umi_prob(task, bam_rec);
+            subsample_lap(task, SUBSAMPLE_STAGE_SELECT, lap_ns);
+            for (size_t i = 0; i < outbam_fps.size(); i++) {
+                if (prob1 < task->umi_draw_probs[i]) {
+                    task->stats.num_output_reads[i]++;
+                    int write_ret = sam_write1(outbam_fps[i], bam_hdr, bam_rec);
+                    if (write_ret < 0) {
+                        fprintf(stderr, "Failed to write the read %s at tid %d pos %ld to the file %s\n", bam_get_qname(bam_rec), bam_rec->core.tid, bam_rec->core.pos, task->outbams[i].c_str());
+                        abort();
+                    }
+                }
+            }
+            subsample_lap(task, SUBSAMPLE_STAGE_WRITE, lap_ns);
+        }
+    }
+    for (size_t i = 0; i < outbam_fps.size(); i++) {
+        if (sam_close(outbam_fps[i]) != 0) {
+            fprintf(stderr, "Failed to close the file %s\n", task->outbams[i].c_str());
+            abort();
+        }
+    }
+    subsample_close_targets(task);
+    bam_destroy1(bam_rec);
+    bam_hdr_destroy(bam_hdr);
+    sam_close(bam_fp);
+}
+
+// The unmapped reads without coordinate are sorted after all other reads. 
+bool subsample_is_before(const bam1_t *rec1, const bam1_t *rec2) {
+    const uint32_t tid1 = (uint32_t)rec1->core.tid;
+    const uint32_t tid2 = (uint32_t)rec2->core.tid;
+    return (tid1 < tid2 || (tid1 == tid2 && rec1->core.pos < rec2->core.pos));
+}
+
+// Merge the tumor (tasks[0]) and normal (tasks[1]) reads that are drawn into one coordinate-sorted BAM file per tumor fraction. 
+// index_min_shift is 0 for BAI, 14 for CSI, and negative for no index. 
+// Both read groups have the same sample name because the merged BAM file simulates one sequenced sample. 
+void subsample_merge_run(subsample_task_t *tasks, const std::vector<std::string> &outbams, const char *sample, int index_min_shift) {
+    const char *RG_IDS[2] = {"tumor", "normal"};
+    sam_hdr_t *bam_hdrs[2] = {NULL, NULL};
+    samFile *bam_fps[2] = {NULL, NULL};
+    bam1_t *bam_recs[2] = {NULL, NULL};
+    bam1_t *prev_recs[2] = {NULL, NULL};
+    int read_rets[2] = {-1, -1};
+    for (int i = 0; i < 2; i++) {
+        bam_fps[i] = subsample_open_input(&tasks[i], &bam_hdrs[i]);
+        bam_recs[i] = bam_init1();
+        prev_recs[i] = bam_init1();
+        if (tasks[i].target_bed != NULL) { subsample_open_targets(&tasks[i], bam_fps[i], bam_hdrs[i]); }
+    }
+    bool is_hdr_consistent = (bam_hdrs[0]->n_targets == bam_hdrs[1]->n_targets);
+    for (int tid = 0; is_hdr_consistent && tid < bam_hdrs[0]->n_targets; tid++) {
+        is_hdr_consistent = (!strcmp(bam_hdrs[0]->target_name[tid], bam_hdrs[1]->target_name[tid]) 
+                && bam_hdrs[0]->target_len[tid] == bam_hdrs[1]->target_len[tid]);
+    }
+    if (!is_hdr_consistent) {
+        fprintf(stderr, "The files %s and %s do not have the same reference sequences in their headers\n", tasks[0].filename, tasks[1].filename);
+        exit(-1);
+    }
+    sam_hdr_t *outbam_hdr = sam_hdr_dup(bam_hdrs[0]);
+    sam_hdr_remove_lines(outbam_hdr, "RG", NULL, NULL);
+    for (int i = 0; i < 2; i++) {
+        if (sam_hdr_add_line(outbam_hdr, "RG", "ID", RG_IDS[i], "SM", sample, NULL) != 0) {
+            fprintf(stderr, "Failed to add the read group %s to the SAM header\n", RG_IDS[i]);
+            abort();
+        }
+    }
+    std::vector<samFile*> outbam_fps;
+    std::vector<std::string> outidxs;
+    for (const auto & outbam : outbams) {
+        outidxs.push_back(outbam + ((0 == index_min_shift) ? ".bai" : ".csi"));
+    }
+    for (size_t j = 0; j < outbams.size(); j++) {
+        samFile *outbam_fp = subsample_open_output(&tasks[0], outbams[j], outbam_hdr);
+        if (index_min_shift >= 0 && sam_idx_init(outbam_fp, outbam_hdr, index_min_shift, outidxs[j].c_str()) != 0) {
+            fprintf(stderr, "Failed to initialize the index %s\n", outidxs[j].c_str());
+            abort();
+        }
+        outbam_fps.push_back(outbam_fp);
+    }
+    
+    int64_t lap_ns = clock_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < 2; i++) {
+        read_rets[i] = subsample_read1(&tasks[i], bam_fps[i], bam_hdrs[i], bam_recs[i]);
+        subsample_lap(&tasks[i], SUBSAMPLE_STAGE_READ, lap_ns);
+    }
+    while (read_rets[0] >= 0 || read_rets[1] >= 0) {
+        // the tumor read goes first if both reads are at the same position
+        const int i = ((read_rets[1] < 0 || (read_rets[0] >= 0 && !subsample_is_before(bam_recs[1], bam_recs[0]))) ? 0 : 1);
+        bam1_t *bam_rec = bam_recs[i];
+        if (subsample_is_before(bam_rec, prev_recs[i])) {
+            fprintf(stderr, "The read %s at tid %d pos %ld in the file %s is not sorted by coordinate\n", 
+                    bam_get_qname(bam_rec), bam_rec->core.tid, bam_rec->core.pos, tasks[i].filename);
+            exit(-1);
+        }
+        tasks[i].stats.num_input_reads++;
+        subsample_publish(&tasks[i], bam_fps[i], bam_rec);
+        const double prob1 = subsample_umi_prob(&tasks[i], bam_rec);
+        subsample_lap(&tasks[i], SUBSAMPLE_STAGE_SELECT, lap_ns);
+        bool is_rg_updated = false;
+        for (size_t j = 0; j < outbam_fps.size(); j++) {
+            if (prob1 >= tasks[i].umi_draw_probs[j]) { continue; }
+            tasks[i].stats.num_output_reads[j]++;
+            if (!is_rg_updated) {
+                if (bam_aux_update_str(bam_rec, "RG", strlen(RG_IDS[i]) + 1, RG_IDS[i]) != 0) {
+                    fprintf(stderr, "Failed to update the RG tag of the read %s\n", bam_get_qname(bam_rec));
+                    abort();
+                }
+                is_rg_updated = true;
+            }
+            int write_ret = sam_write1(outbam_fps[j], outbam_hdr, bam_rec);
+            if (write_ret < 0) {
+                fprintf(stderr, "Failed to write the read %s at tid %d pos %ld to the file %s\n", bam_get_qname(bam_rec), bam_rec->core.tid, bam_rec->core.pos, outbams[j].c_str());
+                abort();
+            }
+        }
+        subsample_lap(&tasks[i], SUBSAMPLE_STAGE_WRITE, lap_ns);
+        std::swap(bam_recs[i], prev_recs[i]);
+        read_rets[i] = subsample_read1(&tasks[i], bam_fps[i], bam_hdrs[i], bam_recs[i]);
+        subsample_lap(&tasks[i], SUBSAMPLE_STAGE_READ, lap_ns);
+    }
+    for (size_t j = 0; j < outbam_fps.size(); j++) {
+        if (index_min_shift >= 0 && sam_idx_save(outbam_fps[j]) != 0) {
+            fprintf(stderr, "Failed to save the index %s\n", outidxs[j].c_str());
+            abort();
+        }
+        if (sam_close(outbam_fps[j]) != 0) {
+            fprintf(stderr, "Failed to close the file %s\n", outbams[j].c_str());
+            abort();
+        }
+    }
+    bam_hdr_destroy(outbam_hdr);
+    for (int i = 0; i < 2; i++) {
+        subsample_close_targets(&tasks[i]);
+        bam_destroy1(bam_recs[i]);
+        bam_destroy1(prev_recs[i]);
+        bam_hdr_destroy(bam_hdrs[i]);
+        sam_close(bam_fps[i]);
+    }
+}
+
+static int64_t file_size(const char *fname) {
+    struct stat st;
+    if (NULL == fname || !strcmp("-", fname) || stat(fname, &st) != 0) { return 0; }
+    return (int64_t)st.st_size;
+}
+
+// The progress thread prints the progress of both tasks every interval_sec seconds, 
+//   where the fraction done is estimated from the compressed offsets in the input BAM files. 
+typedef struct {
+    const subsample_task_t *tasks;
+    int interval_sec;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool is_stopping = false;
+    std::thread thread;
+} subsample_progress_t;
+
+void subsample_progress_print(const subsample_task_t *tasks, double elapsed_sec) {
+    const char *NAMES[2] = {"tumor", "normal"};
+    int64_t total_offset = 0;
+    int64_t total_size = 0;
+    std::string msg;
+    for (int i = 0; i < 2; i++) {
+        const int64_t num_reads = tasks[i].progress_reads.load(std::memory_order_relaxed);
+        const int64_t offset = tasks[i].progress_offset.load(std::memory_order_relaxed);
+        const int64_t size = file_size(tasks[i].filename);
+        total_offset = ((offset >= 0 && total_offset >= 0) ? (total_offset + offset) : -1);
+        total_size = ((size > 0 && total_size >= 0) ? (total_size + size) : -1);
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s %ld reads (%.0f reads per second) at tid %d pos %ld%s", NAMES[i], num_reads, num_reads / elapsed_sec, 
+                tasks[i].progress_tid.load(std::memory_order_relaxed), tasks[i].progress_pos.load(std::memory_order_relaxed) + 1, (0 == i ? ", " : ""));
+        msg += buf;
+    }
+    if (total_offset > 0 && total_size > 0) {
+        const double frac = MIN(1.0, (double)total_offset / total_size);
+        fprintf(stderr, "Progress: %s in %.0f seconds, %.2f%% done, ETA %.0f seconds\n", msg.c_str(), elapsed_sec, frac * 100, elapsed_sec * (1 - frac) / frac);
+    } else {
+        fprintf(stderr, "Progress: %s in %.0f seconds, ETA unknown\n", msg.c_str(), elapsed_sec);
+    }
+}
+
+void subsample_progress_run(subsample_progress_t *progress) {
+    const int64_t beg_ns = clock_ns(CLOCK_MONOTONIC);
+    std::unique_lock<std::mutex> lock(progress->mutex);
+    while (!progress->cond.wait_for(lock, std::chrono::seconds(progress->interval_sec), [&] { return progress->is_stopping; })) {
+        subsample_progress_print(progress->tasks, MAX(clock_ns(CLOCK_MONOTONIC) - beg_ns, (int64_t)1) / 1e9);
+    }
+}
+
+// The run report is a JSON object for catching regressions in throughput and in the realized tumor fractions automatically, 
+//   where the wall time of each stage is summed over the tumor and normal inputs. 
+void subsample_report_write(const char *fname, const subsample_task_t *tasks, const std::vector<std::string> &fractokens, 
+        const std::vector<std::string> &merged_outbams, bool is_merged, int64_t wall_ns) {
+    FILE *file = fopen(fname, "w");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the run report %s for writing\n", fname);
+        abort();
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const double wall_sec = MAX(wall_ns, (int64_t)1) / 1e9;
+    const int64_t num_input_reads = tasks[0].stats.num_input_reads + tasks[1].stats.num_input_reads;
+    const int64_t input_bytes = file_size(tasks[0].filename) + file_size(tasks[1].filename);
+    int64_t output_bytes = 0;
+    for (size_t j = 0; j < fractokens.size(); j++) {
+        if (is_merged) {
+            output_bytes += file_size(merged_outbams[j].c_str());
+        } else {
+            output_bytes += file_size(tasks[0].outbams[j].c_str()) + file_size(tasks[1].outbams[j].c_str());
+        }
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"program\": \"safemix\",\n");
+    fprintf(file, "  \"version\": \"%s\",\n", FULL_VERSION);
+    fprintf(file, "  \"wall_sec\": %.6f,\n", wall_sec);
+    fprintf(file, "  \"user_cpu_sec\": %.6f,\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+    fprintf(file, "  \"sys_cpu_sec\": %.6f,\n", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss);
+    fprintf(file, "  \"num_input_reads\": %ld,\n", num_input_reads);
+    fprintf(file, "  \"reads_per_sec\": %.3f,\n", num_input_reads / wall_sec);
+    fprintf(file, "  \"input_bytes\": %ld,\n", input_bytes);
+    fprintf(file, "  \"input_bytes_per_sec\": %.3f,\n", input_bytes / wall_sec);
+    fprintf(file, "  \"output_bytes\": %ld,\n", output_bytes);
+    fprintf(file, "  \"output_bytes_per_sec\": %.3f,\n", output_bytes / wall_sec);
+    fprintf(file, "  \"stages\": {\n");
+    for (int stage = 0; stage < SUBSAMPLE_STAGE_NUM; stage++) {
+        fprintf(file, "    \"%s\": {\"wall_sec\": %.6f}%s\n", SUBSAMPLE_STAGE_NAMES[stage], 
+                (tasks[0].stats.stage_wall_ns[stage] + tasks[1].stats.stage_wall_ns[stage]) / 1e9, (stage + 1 < SUBSAMPLE_STAGE_NUM ? "," : ""));
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"num_tumor_input_reads\": %ld,\n", tasks[0].stats.num_input_reads);
+    fprintf(file, "  \"num_normal_input_reads\": %ld,\n", tasks[1].stats.num_input_reads);
+    fprintf(file, "  \"num_tumor_rescued_mates\": %ld,\n", tasks[0].stats.num_rescued_mates);
+    fprintf(file, "  \"num_normal_rescued_mates\": %ld,\n", tasks[1].stats.num_rescued_mates);
+    fprintf(file, "  \"fractions\": [\n");
+    for (size_t j = 0; j < fractokens.size(); j++) {
+        const int64_t n_tumor = tasks[0].stats.num_output_reads[j];
+        const int64_t n_normal = tasks[1].stats.num_output_reads[j];
+        fprintf(file, "    {\"tumor_fraction\": %g, \"num_tumor_reads\": %ld, \"num_normal_reads\": %ld, \"tumor_read_fraction\": %.6f}%s\n", 
+                atof(fractokens[j].c_str()), n_tumor, n_normal, (double)n_tumor / MAX(n_tumor + n_normal, (int64_t)1), (j + 1 < fractokens.size() ? "," : ""));
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to close the run report %s\n", fname);
+        abort();
+    }
+}
+
+uint32_t subsample_randseed(uint32_t randseed) {
+    if (0 == randseed) { return 0; }
+    portable_srand(randseed);
+    return (uint32_t)portable_rand();
+}
+
+// Set the probabilities for drawing the reads of the tumor (tasks[0]) and normal (tasks[1]) tasks for each tumor fraction. 
+void subsample_tasks_init(subsample_task_t *tasks, const mix_selector_opts_t &opts) {
+    double tiqfrac = opts.normal_quantity / opts.tumor_quantity;
+    double tosdfrac = opts.normal_umi_size / opts.tumor_umi_size;
+    for (int i = 0; i < 2; i++) {
+        tasks[i].read_draw_given_umi_prob = capped((0 == i) ? tosdfrac : (1.0/tosdfrac));
+        tasks[i].randseed1 = subsample_randseed(opts.randseed1);
+        tasks[i].randseed2 = subsample_randseed(opts.randseed2);
+        tasks[i].use_only_umi = (opts.is_umi_only ? 1 : 0);
+    }
+    for (const double defallelefrac : opts.tumor_fractions) {
+        subsample_info_t t_subsample_info = { NULL, defallelefrac,           tiqfrac,     tosdfrac };
+        subsample_info_t n_subsample_info = { NULL, 1.0 - defallelefrac, 1.0/tiqfrac, 1.0/tosdfrac };
+        
+        const double t_umi_draw_prob = capped(t_subsample_info.allele_frac) * capped(t_subsample_info.init_qty_frac);
+        const double n_umi_draw_prob = capped(n_subsample_info.allele_frac) * capped(n_subsample_info.init_qty_frac);
+        const double umi_draw_prob_mult = 1.0 / MIN(1.0, MAX(t_umi_draw_prob, n_umi_draw_prob));
+        
+        tasks[0].umi_draw_probs.push_back(umi_draw_prob_mult * t_umi_draw_prob);
+        tasks[1].umi_draw_probs.push_back(umi_draw_prob_mult * n_umi_draw_prob);
+        tasks[0].stats.num_output_reads.push_back(0);
+        tasks[1].stats.num_output_reads.push_back(0);
+    }
+}
+
+// The selector of the library API holds the tumor and normal tasks only for their draw probabilities. 
+struct mix_selector_t {
+    subsample_task_t tasks[2];
+};
+
+void mix_selector_opts_init(mix_selector_opts_t &opts) {
+    opts.tumor_umi_size = arg_default_vals.d;
+    opts.normal_umi_size = arg_default_vals.e;
+    opts.tumor_fractions = std::vector<double>(1, arg_default_vals.f);
+    opts.tumor_quantity = arg_default_vals.i;
+    opts.normal_quantity = arg_default_vals.j;
+    opts.randseed1 = arg_default_vals.r;
+    opts.randseed2 = arg_default_vals.s;
+    opts.is_umi_only = false;
+}
+
+mix_selector_t *mix_selector_init(const mix_selector_opts_t &opts) {
+    mix_selector_t *selector = new mix_selector_t();
+    subsample_tasks_init(selector->tasks, opts);
+    return selector;
+}
+
+bool mix_selector_keep(const mix_selector_t *selector, mix_sample_t sample, size_t frac_idx, const bam1_t *aln) {
+    const subsample_task_t *task = &selector->tasks[(MIX_SAMPLE_TUMOR == sample) ? 0 : 1];
+    return subsample_umi_prob(task, aln) < task->umi_draw_probs[frac_idx];
+}
+
+void mix_selector_destroy(mix_selector_t *selector) {
+    delete selector;
+}
+
+#ifndef SAFESIM_NO_MAIN
 int 
 main(int argc, char **argv) {
     int flags, opt, option_index;
@@ -95,93 +750,163 @@ main(int argc, char **argv) {
     double nosd = arg_default_vals.e; // normal-over-sequencing-depth
     double tiq = arg_default_vals.i; // tumor-initial-quantity of DNA
     double niq = arg_default_vals.j; // normal-initial-quantity of DNA
-    double defallelefrac = arg_default_vals.f;
+    const char *defallelefracs = NULL;
     uint32_t randseed1 = arg_default_vals.r;
     uint32_t randseed2 = arg_default_vals.s;
     int use_only_umi = 0;
+    int is_merged = 0;
+    int is_uncompressed = 0;
+    int is_cram = 0;
+    const char *reference = NULL;
+    int index_min_shift = -1;
+    int nthreads_hts = arg_default_vals.nthreads_hts;
+    const char *run_report = NULL;
+    const char *target_bed = NULL;
+    int progress_interval = arg_default_vals.progress_interval;
     
-    while ((opt = getopt(argc, argv, "ha:b:d:e:f:i:j:o:r:s:U")) != -1) {
+    while ((opt = getopt(argc, argv, "ha:b:d:e:f:i:j:mo:r:s:ux:I:J:O:R:T:U@:")) != -1) {
         switch (opt) {
             case 'h': help(argc, argv, 0);
             case 'a': tbam = optarg; break;
             case 'b': nbam = optarg; break;
             case 'd': tosd = atof(optarg); break;
             case 'e': nosd = atof(optarg); break;
-            case 'f': defallelefrac = atof(optarg); break;
+            case 'f': defallelefracs = optarg; break;
             case 'i': tiq = atof(optarg); break;
             case 'j': niq = atof(optarg); break;
+            case 'm': is_merged = 1; break;
             case 'o': outpref = optarg; break;
             case 'r': randseed1 = atoi(optarg); break;
             case 's': randseed2 = atoi(optarg); break;
+            case 'x': 
+                if (!strcmp("bai", optarg)) { index_min_shift = 0; }
+                else if (!strcmp("csi", optarg)) { index_min_shift = 14; }
+                else { fprintf(stderr, "The index format %s is neither bai nor csi\n", optarg); help(argc, argv, -1); }
+                break;
+            case 'u': is_uncompressed = 1; break;
+            case 'I': progress_interval = atoi(optarg); break;
+            case 'J': run_report = optarg; break;
+            case 'O': 
+                if (!strcmp("bam", optarg)) { is_cram = 0; }
+                else if (!strcmp("cram", optarg)) { is_cram = 1; }
+                else { fprintf(stderr, "The output format %s is neither bam nor cram\n", optarg); help(argc, argv, -1); }
+                break;
+            case 'R': target_bed = optarg; break;
+            case 'T': reference = optarg; break;
             case 'U': use_only_umi = 1; break;
+            case '@': nthreads_hts = atoi(optarg); break;
             default: help(argc, argv, -1);
         }
     }
     if (NULL == tbam || NULL == nbam || NULL == outpref) {
         help(argc, argv, -1);
     }
-    if (0 != randseed1) {
-        portable_srand(randseed1);
-        randseed1 = (uint32_t)portable_rand();
+    if (index_min_shift >= 0 && !is_merged) {
+        fprintf(stderr, "The index can be written only together with the merged BAM file (-m)\n");
+        help(argc, argv, -1);
+    }
+    if (index_min_shift >= 0 && is_cram) {
+        fprintf(stderr, "The index can be written only together with the BAM output format\n");
+        help(argc, argv, -1);
+    }
+    if (!strcmp("-", tbam) && !strcmp("-", nbam)) {
+        fprintf(stderr, "The tumor and normal input BAM files cannot both be the standard input\n");
+        help(argc, argv, -1);
     }
-    if (0 != randseed2) {
-        portable_srand(randseed2);
-        randseed2 = (uint32_t)portable_rand();
+    if (target_bed != NULL && (!strcmp("-", tbam) || !strcmp("-", nbam))) {
+        fprintf(stderr, "The target regions (-R) are read using the BAM indexes, so the input BAM files cannot be the standard input\n");
+        help(argc, argv, -1);
+    }
+    const bool is_stdout = !strcmp("-", outpref);
+    if (is_stdout && (!is_merged || index_min_shift >= 0 || (defallelefracs != NULL && strchr(defallelefracs, ',') != NULL))) {
+        fprintf(stderr, "The standard output can be written only with -m, only one tumor fraction, and no -x\n");
+        help(argc, argv, -1);
     }
     
-    double tiqfrac = niq / tiq;
-    double tosdfrac = nosd / tosd;
-    
-    fprintf(stderr, "%s\n=== version ===\n%s\n%s\n%s\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH, GIT_DIFF_FULL);
+    std::vector<std::string> fractokens;
+    if (NULL == defallelefracs) {
+        fractokens.push_back(std::to_string(arg_default_vals.f));
+    } else {
+        const char *token = defallelefracs;
+        while (true) {
+            const char *token_end = strchr(token, ',');
+            fractokens.push_back((NULL == token_end) ? std::string(token) : std::string(token, token_end - token));
+            if (NULL == token_end) { break; }
+            token = token_end + 1;
+        }
+    }
     
-    subsample_info_t t_subsample_info = { tbam, defallelefrac,           tiqfrac,     tosdfrac };
-    subsample_info_t n_subsample_info = { nbam, 1.0 - defallelefrac, 1.0/tiqfrac, 1.0/tosdfrac };
+    mix_selector_opts_t opts;
+    opts.tumor_umi_size = tosd;
+    opts.normal_umi_size = nosd;
+    for (const auto & fractoken : fractokens) {
+        opts.tumor_fractions.push_back(atof(fractoken.c_str()));
+    }
+    opts.tumor_quantity = tiq;
+    opts.normal_quantity = niq;
+    opts.randseed1 = randseed1;
+    opts.randseed2 = randseed2;
+    opts.is_umi_only = (0 != use_only_umi);
     
-    const double t_umi_draw_prob = capped(t_subsample_info.allele_frac) * capped(t_subsample_info.init_qty_frac);
-    const double n_umi_draw_prob = capped(n_subsample_info.allele_frac) * capped(n_subsample_info.init_qty_frac);
-    const double umi_draw_prob_mult = 1.0 / MIN(1.0, MAX(t_umi_draw_prob, n_umi_draw_prob));
+    fprintf(stderr, "%s\n=== version ===\n%s\n%s\n%s\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH, GIT_DIFF_FULL);
+    const int64_t run_beg_ns = clock_ns(CLOCK_MONOTONIC);
     
-    char *outbam = (char*)malloc(strlen(outpref) + 13);
-    for (int i = 0; i < 2; i++) {
-        strcpy(outbam, outpref);
-        strcat(outbam, ((0 == i) ? ".tumor.bam" : ".normal.bam"));
-        samFile *outbam_fp = sam_open(outbam, "wb");
-        
-        subsample_info_t subsample_info = ((0 == i) ? t_subsample_info : n_subsample_info);
-        samFile *bam_fp = sam_open(subsample_info.filename, "r");
-        sam_hdr_t *bam_hdr = sam_hdr_read(bam_fp);
-        bam1_t *bam_rec = bam_init1();
-        
-        int write_ret = sam_hdr_write(outbam_fp, bam_hdr);
-        if (write_ret < 0) {
-            fprintf(stderr, "Failed to write the SAM header to the file %s\n", outbam);
+    htsThreadPool tpool = {NULL, 0};
+    if (nthreads_hts > 0) {
+        tpool.pool = hts_tpool_init(nthreads_hts);
+        if (NULL == tpool.pool) {
+            fprintf(stderr, "Failed to create a pool of %d threads for compression and decompression\n", nthreads_hts);
             abort();
         }
-        
-        const double umi_draw_prob = umi_draw_prob_mult * ((0 == i) ? t_umi_draw_prob : n_umi_draw_prob);
-        const double read_draw_given_umi_prob = capped(subsample_info.read_fam_frac);
-        
-        while (sam_read1(bam_fp, bam_hdr, bam_rec) >= 0) {
-            if (0 != (bam_rec->core.flag & 0x900)) { continue; }
-            const auto *bam_aux_data = bam_aux_get(bam_rec, "MI"); // this tag is reserved (https://samtools.github.io/hts-specs/SAMtags.pdf)
-            const char *umistr = ((bam_aux_data != NULL) ? bam_aux2Z(bam_aux_data) : bam_get_qname(bam_rec));
-            const auto abegin = (use_only_umi ? (0) : MIN(bam_rec->core.pos, bam_rec->core.mpos));
-            const auto aisize = (use_only_umi ? (0) : abs(bam_rec->core.isize));
-            const double prob1 = umistr2prob(umistr, abegin, aisize, randseed1);
-            const double prob2 = qname2prob(bam_get_qname(bam_rec), randseed2);
-            if (prob1 < umi_draw_prob && prob2 < read_draw_given_umi_prob) {
-                int write_ret = sam_write1(outbam_fp, bam_hdr, bam_rec);
-                if (write_ret < 0) {
-                    fprintf(stderr, "Failed to write the read %s at tid %d pos %ld to the file %s\n", bam_get_qname(bam_rec), bam_rec->core.tid, bam_rec->core.pos, outbam);
-                    abort();
-                }
-            }
+    }
+    
+    subsample_task_t tasks[2];
+    subsample_tasks_init(tasks, opts);
+    for (int i = 0; i < 2; i++) {
+        tasks[i].filename = ((0 == i) ? tbam : nbam);
+        tasks[i].outbam_mode = (is_cram ? (is_uncompressed ? "wc0" : "wc") : (is_uncompressed ? "wb0" : "wb"));
+        tasks[i].reference = reference;
+        tasks[i].tpool = &tpool;
+        tasks[i].is_profiling = (run_report != NULL);
+        tasks[i].target_bed = target_bed;
+    }
+    std::vector<std::string> merged_outbams;
+    for (const auto & fractoken : fractokens) {
+        const std::string outbam_prefix = std::string(outpref) + ((1 == fractokens.size()) ? std::string("") : (".f" + fractoken));
+        const std::string outbam_ext = (is_cram ? ".cram" : ".bam");
+        tasks[0].outbams.push_back(outbam_prefix + ".tumor" + outbam_ext);
+        tasks[1].outbams.push_back(outbam_prefix + ".normal" + outbam_ext);
+        merged_outbams.push_back(is_stdout ? std::string("-") : (outbam_prefix + outbam_ext));
+    }
+    
+    subsample_progress_t progress;
+    if (progress_interval > 0) {
+        progress.tasks = tasks;
+        progress.interval_sec = progress_interval;
+        progress.thread = std::thread(subsample_progress_run, &progress);
+    }
+    if (is_merged) {
+        const char *sample = strrchr(outpref, '/');
+        sample = (is_stdout ? STDOUT_SAMPLE_NAME : ((NULL == sample) ? outpref : (sample + 1)));
+        subsample_merge_run(tasks, merged_outbams, sample, index_min_shift);
+    } else {
+        std::thread normal_thread(subsample_run, &tasks[1]);
+        subsample_run(&tasks[0]);
+        normal_thread.join();
+    }
+    if (progress_interval > 0) {
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            progress.is_stopping = true;
         }
-        bam_destroy1(bam_rec);
-        bam_hdr_destroy(bam_hdr);
-        sam_close(bam_fp);
-        sam_close(outbam_fp);
+        progress.cond.notify_all();
+        progress.thread.join();
+    }
+    if (tpool.pool != NULL) {
+        hts_tpool_destroy(tpool.pool);
+    }
+    if (run_report != NULL) {
+        subsample_report_write(run_report, tasks, fractokens, merged_outbams, is_merged, clock_ns(CLOCK_MONOTONIC) - run_beg_ns);
     }
-    free(outbam);
 }
-
+#endif
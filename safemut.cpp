@@ -1,18 +1,47 @@
 #include "portable_rand.h"
+#include "safesim.h"
+#include "target_regions.h"
 #include "version.h"
 
+#include "htslib/bgzf.h"
 #include "htslib/khash.h"
 #include "htslib/sam.h"
+#include "htslib/tbx.h"
+#include "htslib/thread_pool.h"
 #include "htslib/vcf.h"
 #include "zlib.h"
 
+#ifdef USE_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <map>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /**
 >>> This is the pseudocode for the simulator
@@ -50,6 +79,38 @@ const uint32_t DEFAULT_RANDSEED = 13;
 const uint32_t DEFAULT_NITERS1 = 50;
 const uint32_t DEFAULT_NITERS2 = 500;
 
+const int DEFAULT_NTHREADS = 1;
+const int DEFAULT_NTHREADS_HTS = 0;
+const int DEFAULT_FASTQ_LEVEL = 1;
+const int DEFAULT_MATE_PAIRING_MEM_MB = 0;
+const int DEFAULT_PROGRESS_INTERVAL = 0;
+const int DEFAULT_CHECKPOINT_INTERVAL = 600;
+const int64_t DEFAULT_PLAN_WINDOW_SIZE = 1024 * 1024;
+
+enum log_level_t {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG, // one message per variant
+    LOG_LEVEL_TRACE, // one message per read
+};
+const char *LOG_LEVEL_NAMES[] = {"error", "warn", "info", "debug", "trace"};
+const int DEFAULT_LOG_LEVEL = LOG_LEVEL_INFO;
+const size_t LOG_SINK_FLUSH_SIZE = 1024 * 64;
+const size_t LOG_SINK_MAX_SIZE = 1024 * 1024 * 16;
+
+enum fastq_format_t {
+    FASTQ_FORMAT_BGZF,
+    FASTQ_FORMAT_GZIP,
+    FASTQ_FORMAT_PLAIN, // uncompressed, such as for piping into an aligner
+};
+const char *FASTQ_FORMAT_NAMES[] = {"bgzf", "gz", "plain"};
+const char *FASTQ_FORMAT_EXTENSIONS[] = {".fastq.gz", ".fastq.gz", ".fastq"}; // of the output files of the configurations of -M
+const size_t DEFAULT_BATCH_SIZE = 1024 * 4;
+const size_t MATE_PAIRER_FLUSH_SIZE = BGZF_BLOCK_SIZE * 16;
+const size_t UMI_CACHE_SIZE = 1024 * 4; // has to be a power of two
+const size_t UMI_CACHE_WAYS = 4; // has to be a power of two not greater than UMI_CACHE_SIZE
+
 const char *ACGT = "ACGT";
 const char *TAG_FA = "FA";
 
@@ -57,6 +118,104 @@ bool ispowerof2(int n) {
     return 0 == (n & (n-1));
 }
 
+// The log messages are appended to buf by any thread and are written to stderr by the sink thread, 
+// so that logging does not wait for stderr on the hot path. 
+typedef struct {
+    int verbosity = DEFAULT_LOG_LEVEL;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::string buf;
+    bool is_started = false;
+    bool is_stopping = false;
+    std::thread thread;
+} log_sink_t;
+
+log_sink_t log_sink;
+
+void log_sink_run() {
+    std::string outbuf;
+    std::unique_lock<std::mutex> lock(log_sink.mutex);
+    while (!log_sink.is_stopping || log_sink.buf.size() > 0) {
+        if (0 == log_sink.buf.size()) {
+            log_sink.cond.wait_for(lock, std::chrono::milliseconds(200));
+            continue;
+        }
+        std::swap(outbuf, log_sink.buf);
+        lock.unlock();
+        fwrite(outbuf.data(), 1, outbuf.size(), stderr);
+        fflush(stderr);
+        outbuf.clear();
+        lock.lock();
+    }
+}
+
+// Messages logged before log_sink_start or after log_sink_stop are written to stderr synchronously. 
+void log_sink_start() {
+    log_sink.is_started = true;
+    log_sink.thread = std::thread(log_sink_run);
+}
+
+void log_sink_stop() {
+    if (!log_sink.is_started) { return; }
+    {
+        std::lock_guard<std::mutex> lock(log_sink.mutex);
+        log_sink.is_stopping = true;
+    }
+    log_sink.cond.notify_one();
+    log_sink.thread.join();
+    log_sink.is_started = false;
+    log_sink.is_stopping = false;
+}
+
+__attribute__((format(printf, 1, 2)))
+void log_printf(const char *fmt, ...) {
+    char msg[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int msglen = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    std::string longmsg;
+    if (msglen >= (int)sizeof(msg)) {
+        longmsg.resize(msglen + 1);
+        va_start(ap, fmt);
+        vsnprintf(&longmsg[0], longmsg.size(), fmt, ap);
+        va_end(ap);
+    }
+    const char *outmsg = (longmsg.size() ? longmsg.data() : msg);
+    if (msglen < 0) { return; }
+    std::unique_lock<std::mutex> lock(log_sink.mutex);
+    if (!log_sink.is_started) {
+        fwrite(outmsg, 1, msglen, stderr);
+        return;
+    }
+    log_sink.buf.append(outmsg, msglen);
+    if (log_sink.buf.size() >= LOG_SINK_MAX_SIZE) {
+        // back-pressure: the logging thread writes the messages by itself instead of letting the buffer grow without bound
+        fwrite(log_sink.buf.data(), 1, log_sink.buf.size(), stderr);
+        log_sink.buf.clear();
+    } else if (log_sink.buf.size() >= LOG_SINK_FLUSH_SIZE) {
+        lock.unlock();
+        log_sink.cond.notify_one();
+    }
+}
+
+// A disabled log statement costs only one comparison, and its arguments are not evaluated. 
+#define LOG_IS_ENABLED(level) ((level) <= log_sink.verbosity)
+#define LOG_AT(level, ...) do { if (LOG_IS_ENABLED(level)) { log_printf(__VA_ARGS__); } } while (0)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+// Build with "make NO_DEBUG_LOG=1" to remove the debug and trace statements at compile time. 
+#ifdef NO_DEBUG_LOG
+#define LOG_DEBUG(...) do {} while (0)
+#define LOG_TRACE(...) do {} while (0)
+#define LOG_SAMPLED(level, count, ...) do { if (ispowerof2(count)) { LOG_AT(level, __VA_ARGS__); } } while (0)
+#else
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+// Rate-limited logging of a per-read event: only the 1st, 2nd, 4th, 8th, etc. occurrences are logged at level, and all of them are logged at the trace level. 
+#define LOG_SAMPLED(level, count, ...) do { if (ispowerof2(count) ? LOG_IS_ENABLED(level) : LOG_IS_ENABLED(LOG_LEVEL_TRACE)) { log_printf(__VA_ARGS__); } } while (0)
+#endif
+
 double phred2prob(int8_t phred) {
     return pow(10.0, -(phred / 10.0));
 }
@@ -64,52 +223,79 @@ int prob2phred(double prob) {
     return -(int)round(10.0 / log(10.0) * log(prob));
 }
 
-uint32_t hashes2hash(std::vector<uint32_t>  hashes) {
-    uint32_t ret = 0;
-    for (uint32_t hash : hashes) {
-        ret = __ac_Wang_hash(hash ^ ret);
+// The hash combiners below are equivalent to folding __ac_Wang_hash(hash ^ ret) over the hashes from left to right starting at ret=0. 
+// They have fixed arities so that no per-call container is needed. 
+static inline uint32_t hashes2hash(uint32_t h1, uint32_t h2, uint32_t h3) {
+    return __ac_Wang_hash(h3 ^ __ac_Wang_hash(h2 ^ __ac_Wang_hash(h1)));
+}
+
+static inline uint32_t hashes2hash(uint32_t h1, uint32_t h2, uint32_t h3, uint32_t h4) {
+    return __ac_Wang_hash(h4 ^ hashes2hash(h1, h2, h3));
+}
+
+static inline uint32_t hashes2hash(uint32_t h1, uint32_t h2, uint32_t h3, uint32_t h4, uint32_t h5) {
+    return __ac_Wang_hash(h5 ^ hashes2hash(h1, h2, h3, h4));
+}
+
+// Same as __ac_X31_hash_string on the first len characters of str. 
+static inline uint32_t x31_hash_strn(const char *str, size_t len) {
+    if (0 == len) { return 0; }
+    uint32_t h = (uint32_t)*str;
+    for (size_t i = 1; i < len; i++) {
+        h = (h << 5) - h + (uint32_t)str[i];
     }
-    return ret;
+    return h;
 }
 
-double umistr2prob(uint32_t &umihash, uint32_t randseed, uint32_t begpos, uint32_t endpos, const char *str) {
-    
-    const char *umistr1 = strchr(str, '#');
-    const char *umistr = (NULL == umistr1 ? str : (umistr1 + 1));
-    
-    std::vector<uint32_t>  hashes;
-    hashes.reserve(4 + 1);
-    hashes.push_back(randseed);
-    hashes.push_back(begpos);
-    hashes.push_back(endpos);
-    size_t umi_strlen = strlen(umistr);
-    
+// Set umistr to the UMI after the first '#' in str (or to str if str has no '#'), and return the X31 hash of the UMI. 
+static inline uint32_t umistr_find(const char *str, const char *&umistr, size_t &umi_strlen) {
+    // one pass to find the UMI after the first '#' and to hash the UMI
+    umistr = str;
+    for (const char *p = str; *p; p++) {
+        if ('#' == *p) {
+            umistr = p + 1;
+            break;
+        }
+    }
+    uint32_t umistr_hash = 0;
+    umi_strlen = 0;
+    if (umistr[0]) {
+        umistr_hash = (uint32_t)umistr[0];
+        for (umi_strlen = 1; umistr[umi_strlen]; umi_strlen++) {
+            umistr_hash = (umistr_hash << 5) - umistr_hash + (uint32_t)umistr[umi_strlen];
+        }
+    }
+    return umistr_hash;
+}
+
+// The hash of the UMI family, where the alpha and beta tags of a duplex UMI are sorted so that both strands are in the same family. 
+static inline uint32_t umi_family_hash(uint32_t randseed, uint32_t begpos, uint32_t endpos, const char *umistr, size_t umi_strlen, uint32_t umistr_hash) {
+    uint32_t k = 0;
     if ((umi_strlen % 2 == 1) && (umistr[(umi_strlen - 1) / 2] == '+') && umi_strlen <= 16 * 2 - 3) {
-        char alpha[16] = {0};
-        char beta[16] = {0};
-        strncpy(alpha, umistr, (umi_strlen - 1) / 2);
-        strncpy(beta, umistr + (umi_strlen - 1) / 2 + 1, (umi_strlen - 1) / 2);
-        const char *abmin = ((strcmp(alpha, beta) <= 0) ? alpha : beta);
-        const char *abmax = ((strcmp(alpha, beta) >= 0) ? alpha : beta);
-        hashes.push_back(__ac_X31_hash_string(abmin));
-        hashes.push_back(__ac_X31_hash_string(abmax));
-        //fprintf(stderr, "The read %s has one duplex UMI with length %d for UMI %s\n", umistr, umi_strlen, umistr);
+        const size_t halflen = (umi_strlen - 1) / 2;
+        const char *alpha = umistr;
+        const char *beta = umistr + halflen + 1;
+        const int cmp = memcmp(alpha, beta, halflen);
+        const char *abmin = ((cmp <= 0) ? alpha : beta);
+        const char *abmax = ((cmp >= 0) ? alpha : beta);
+        k = hashes2hash(randseed, begpos, endpos, x31_hash_strn(abmin, halflen), x31_hash_strn(abmax, halflen));
     } else {
-        hashes.push_back(__ac_X31_hash_string(umistr));
-        //fprintf(stderr, "The read %s has  NO duplex UMI with length %d for UMI %s\n", umistr, umi_strlen, umistr);
+        k = hashes2hash(randseed, begpos, endpos, umistr_hash);
     }
-    uint32_t k = hashes2hash(hashes);
+    return k;
+}
+
+double umistr2prob(uint32_t &umihash, uint32_t randseed, uint32_t begpos, uint32_t endpos, const char *str) {
+    const char *umistr = NULL;
+    size_t umi_strlen = 0;
+    const uint32_t umistr_hash = umistr_find(str, umistr, umi_strlen);
+    const uint32_t k = umi_family_hash(randseed, begpos, endpos, umistr, umi_strlen, umistr_hash);
     umihash = k;
     return (double)(k&0xffffff) / 0x1000000;
 }
 
 double qnameqpos2prob(uint32_t &hash, uint32_t randseed, const char *qname, int qpos) {
-    std::vector<uint32_t>  hashes;
-    hashes.reserve(3);
-    hashes.push_back(randseed);
-    hashes.push_back(__ac_X31_hash_string(qname));
-    hashes.push_back(qpos);
-    uint32_t k = hashes2hash(hashes);
+    uint32_t k = hashes2hash(randseed, __ac_X31_hash_string(qname), qpos);
     hash = k;
     return (double)(k&0xffffff) / 0x1000000;
 }
@@ -122,16 +308,8 @@ allelefrac_powlaw_transform(
         uint32_t samplehash1,
         uint32_t samplehash2,
         double exponent) {
-    std::vector<uint32_t> ks1;
-    ks1.push_back(samplehash1);
-    ks1.push_back(tid);
-    ks1.push_back(rpos);
-    uint32_t k1 = hashes2hash(ks1);
-    std::vector<uint32_t> ks2;
-    ks2.push_back(samplehash2);
-    ks2.push_back(tid);
-    ks2.push_back(rpos);
-    uint32_t k2 = hashes2hash(ks2);
+    uint32_t k1 = hashes2hash(samplehash1, tid, rpos);
+    uint32_t k2 = hashes2hash(samplehash2, tid, rpos);
     double altfrac =         allelefrac * pow((double)(k1 & 0xffffff) / (double)0x1000000, 1.0 / exponent);
     double reffrac = (1.0 - allelefrac) * pow((double)(k2 & 0xffffff) / (double)0x1000000, 1.0 / exponent);
     double odds_ratio = ((altfrac + 1e-9) / (reffrac + 1e-9));
@@ -153,16 +331,8 @@ allelefrac_lognormal_transform(
         uint32_t samplehash1,
         uint32_t samplehash2,
         double lnsigma) {
-    std::vector<uint32_t> ks1;
-    ks1.push_back(samplehash1);
-    ks1.push_back(tid);
-    ks1.push_back(rpos);
-    uint32_t k1 = hashes2hash(ks1);
-    std::vector<uint32_t> ks2;
-    ks2.push_back(samplehash2);
-    ks2.push_back(tid);
-    ks2.push_back(rpos);
-    uint32_t k2 = hashes2hash(ks2);
+    uint32_t k1 = hashes2hash(samplehash1, tid, rpos);
+    uint32_t k2 = hashes2hash(samplehash2, tid, rpos);
     // if norm-z-score(rv) is log(2), then its lognormal rv doubles
     //   at rv=log(2), std-norm       density-val is exp(-1/2 * ((log(2) - 0) / 1)**2)
     //   at rv=log(2), norm(0, stdev) density-val is exp(-1/2 * ((log(2) / stdev - 0) / 1)**2), which is frac
@@ -217,157 +387,373 @@ void reverse(std::string & astring) {
     }
 }
 
-int is_var1_before_var2(int tid1, int pos1, int tid2, int pos2) {
-    return (tid1 < tid2) || (tid1 == tid2 && pos1 < pos2);
+// Each byte of the nibble-packed sequence decoded into two bases, either as is (fwd) or reverse-complemented (rc). 
+struct _Nt16PairTable {
+    char fwd[256][2];
+    char rc[256][2];
+    char fwd16[16];
+    char rc16[16];
+    _Nt16PairTable() {
+        for (int i = 0; i < 16; i++) {
+            fwd16[i] = seq_nt16_str[i];
+            rc16[i] = THE_REV_COMPLEMENT.data[(uint8_t)seq_nt16_str[i]];
+        }
+        for (int i = 0; i < 256; i++) {
+            fwd[i][0] = fwd16[i >> 4];
+            fwd[i][1] = fwd16[i & 0xf];
+            rc[i][0] = rc16[i & 0xf];
+            rc[i][1] = rc16[i >> 4];
+        }
+    }
+};
+
+const _Nt16PairTable THE_NT16_PAIR_TABLE;
+
+// The SIMD kernels decode whole blocks of 16 (SSSE3 and NEON) or 32 (AVX2) input bytes and return the number of input bytes done, 
+//   leaving the rest to the scalar code. The x86 kernels are compiled for their own instruction sets and chosen at startup. 
+typedef int (*simd_kernel_t)(char *out, const uint8_t *in, int n);
+
+typedef struct {
+    const char *name;
+    simd_kernel_t nt16_fwd; // nibble-packed bases to text
+    simd_kernel_t nt16_rc; // nibble-packed bases to reverse-complemented text, with the input read from its end
+    simd_kernel_t qual_fwd; // base qualities to Phred+33 text
+    simd_kernel_t qual_rev; // base qualities to reversed Phred+33 text
+} simd_kernels_t;
+
+int simd_kernel_scalar(char *out, const uint8_t *in, int n) { return 0; }
+
+const simd_kernels_t SIMD_KERNELS_SCALAR = {"scalar", simd_kernel_scalar, simd_kernel_scalar, simd_kernel_scalar, simd_kernel_scalar};
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+int nt16_decode_fwd_ssse3(char *out, const uint8_t *seq, int nbytes) {
+    const __m128i lut = _mm_loadu_si128((const __m128i*)THE_NT16_PAIR_TABLE.fwd16);
+    const __m128i mask = _mm_set1_epi8(0xf);
+    int i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(seq + i));
+        const __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i*)(out + i * 2),      _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
 }
 
-int bamrec_write_fastq_raw(const bam1_t *aln, gzFile &outfile) {
-    std::string seq;
-    std::string qual;
-    
-    gzprintf(outfile, "@%s\n", bam_get_qname(aln));
-    
-    for (int i = 0; i < aln->core.l_qseq; i++) {
-        char c = seq_nt16_str[bam_seqi(bam_get_seq(aln), i)];
-        seq.push_back(c);
-        assert(c > ' ' || !fprintf(stderr, "The read with qname %s is invalid with qlen = %d!\n", bam_get_qname(aln), aln->core.l_qseq));
+__attribute__((target("ssse3")))
+int nt16_decode_rc_ssse3(char *out, const uint8_t *seq, int nbytes) {
+    const __m128i lut = _mm_loadu_si128((const __m128i*)THE_NT16_PAIR_TABLE.rc16);
+    const __m128i mask = _mm_set1_epi8(0xf);
+    const __m128i revidx = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    int i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(seq + nbytes - i - 16)), revidx);
+        const __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i*)(out + i * 2),      _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(lo, hi));
     }
-    if ((aln->core.flag & 0x10)) { reverse(seq); complement(seq); }
-    gzprintf(outfile, "%s\n+\n", seq.c_str());
-    for (int i = 0; i < aln->core.l_qseq; i++) {
-        char c = bam_get_qual(aln)[i];
-        qual.push_back(c+33);
+    return i;
+}
+
+__attribute__((target("ssse3")))
+int qual_encode_fwd_ssse3(char *out, const uint8_t *qual, int len) {
+    const __m128i offset = _mm_set1_epi8(33);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(qual + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(v, offset));
     }
-    if ((aln->core.flag & 0x10)) { reverse(qual); }
-    int ret = gzprintf(outfile, "%s\n", qual.c_str());
-    return ret;
+    return i;
+}
+
+__attribute__((target("ssse3")))
+int qual_encode_rev_ssse3(char *out, const uint8_t *qual, int len) {
+    const __m128i offset = _mm_set1_epi8(33);
+    const __m128i revidx = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(qual + len - i - 16));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(_mm_shuffle_epi8(v, revidx), offset));
+    }
+    return i;
+}
+
+// The AVX2 shuffles and unpacks work within each 128-bit lane, so the lanes are put in order with permutes, 
+//   and the input left over after the 32-byte blocks goes through the SSSE3 kernels, after vzeroupper to avoid the AVX-SSE transition penalty. 
+__attribute__((target("avx2")))
+int nt16_decode_fwd_avx2(char *out, const uint8_t *seq, int nbytes) {
+    const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)THE_NT16_PAIR_TABLE.fwd16));
+    const __m256i mask = _mm256_set1_epi8(0xf);
+    int i = 0;
+    for (; i + 32 <= nbytes; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(seq + i));
+        const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*)(out + i * 2),      _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    _mm256_zeroupper();
+    return i + nt16_decode_fwd_ssse3(out + i * 2, seq + i, nbytes - i);
+}
+
+__attribute__((target("avx2")))
+int nt16_decode_rc_avx2(char *out, const uint8_t *seq, int nbytes) {
+    const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)THE_NT16_PAIR_TABLE.rc16));
+    const __m256i mask = _mm256_set1_epi8(0xf);
+    const __m256i revidx = _mm256_broadcastsi128_si256(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    int i = 0;
+    for (; i + 32 <= nbytes; i += 32) {
+        const __m256i v0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(seq + nbytes - i - 32)), revidx);
+        const __m256i v = _mm256_permute4x64_epi64(v0, 0x4e);
+        const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        const __m256i a = _mm256_unpacklo_epi8(lo, hi);
+        const __m256i b = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((__m256i*)(out + i * 2),      _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    _mm256_zeroupper();
+    return i + nt16_decode_rc_ssse3(out + i * 2, seq, nbytes - i);
+}
+
+__attribute__((target("avx2")))
+int qual_encode_fwd_avx2(char *out, const uint8_t *qual, int len) {
+    const __m256i offset = _mm256_set1_epi8(33);
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(qual + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi8(v, offset));
+    }
+    _mm256_zeroupper();
+    return i + qual_encode_fwd_ssse3(out + i, qual + i, len - i);
+}
+
+__attribute__((target("avx2")))
+int qual_encode_rev_avx2(char *out, const uint8_t *qual, int len) {
+    const __m256i offset = _mm256_set1_epi8(33);
+    const __m256i revidx = _mm256_broadcastsi128_si256(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(qual + len - i - 32)), revidx);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi8(_mm256_permute4x64_epi64(v, 0x4e), offset));
+    }
+    _mm256_zeroupper();
+    return i + qual_encode_rev_ssse3(out + i, qual, len - i);
+}
+
+const simd_kernels_t SIMD_KERNELS_SSSE3 = {"SSSE3", nt16_decode_fwd_ssse3, nt16_decode_rc_ssse3, qual_encode_fwd_ssse3, qual_encode_rev_ssse3};
+const simd_kernels_t SIMD_KERNELS_AVX2 = {"AVX2", nt16_decode_fwd_avx2, nt16_decode_rc_avx2, qual_encode_fwd_avx2, qual_encode_rev_avx2};
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+int nt16_decode_fwd_neon(char *out, const uint8_t *seq, int nbytes) {
+    const uint8x16_t lut = vld1q_u8((const uint8_t*)THE_NT16_PAIR_TABLE.fwd16);
+    const uint8x16_t mask = vdupq_n_u8(0xf);
+    int i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        const uint8x16_t v = vld1q_u8(seq + i);
+        const uint8x16_t hi = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+        const uint8x16_t lo = vqtbl1q_u8(lut, vandq_u8(v, mask));
+        vst1q_u8((uint8_t*)(out + i * 2),      vzip1q_u8(hi, lo));
+        vst1q_u8((uint8_t*)(out + i * 2 + 16), vzip2q_u8(hi, lo));
+    }
+    return i;
+}
+
+int nt16_decode_rc_neon(char *out, const uint8_t *seq, int nbytes) {
+    const uint8x16_t lut = vld1q_u8((const uint8_t*)THE_NT16_PAIR_TABLE.rc16);
+    const uint8x16_t mask = vdupq_n_u8(0xf);
+    int i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        const uint8x16_t v0 = vrev64q_u8(vld1q_u8(seq + nbytes - i - 16));
+        const uint8x16_t v = vextq_u8(v0, v0, 8);
+        const uint8x16_t hi = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+        const uint8x16_t lo = vqtbl1q_u8(lut, vandq_u8(v, mask));
+        vst1q_u8((uint8_t*)(out + i * 2),      vzip1q_u8(lo, hi));
+        vst1q_u8((uint8_t*)(out + i * 2 + 16), vzip2q_u8(lo, hi));
+    }
+    return i;
+}
+
+int qual_encode_fwd_neon(char *out, const uint8_t *qual, int len) {
+    const uint8x16_t offset = vdupq_n_u8(33);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8((uint8_t*)(out + i), vaddq_u8(vld1q_u8(qual + i), offset));
+    }
+    return i;
+}
+
+int qual_encode_rev_neon(char *out, const uint8_t *qual, int len) {
+    const uint8x16_t offset = vdupq_n_u8(33);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t v0 = vrev64q_u8(vld1q_u8(qual + len - i - 16));
+        vst1q_u8((uint8_t*)(out + i), vaddq_u8(vextq_u8(v0, v0, 8), offset));
+    }
+    return i;
+}
+
+const simd_kernels_t SIMD_KERNELS_NEON = {"NEON", nt16_decode_fwd_neon, nt16_decode_rc_neon, qual_encode_fwd_neon, qual_encode_rev_neon};
+#endif
+
+// AArch64 always has NEON, and x86 gets the widest instruction set that the running CPU supports
+simd_kernels_t simd_kernels_select() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init(); // required before __builtin_cpu_supports during static initialization
+    if (__builtin_cpu_supports("avx2")) { return SIMD_KERNELS_AVX2; }
+    if (__builtin_cpu_supports("ssse3")) { return SIMD_KERNELS_SSSE3; }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return SIMD_KERNELS_NEON;
+#endif
+    return SIMD_KERNELS_SCALAR;
+}
+
+const simd_kernels_t THE_SIMD_KERNELS = simd_kernels_select();
+
+// Decode the len bases of the nibble-packed seq into out, reverse-complementing them if is_rc is true. 
+void nt16_decode(char *out, const uint8_t *seq, int len, bool is_rc) {
+    const int nbytes = len / 2;
+    if (!is_rc) {
+        for (int i = THE_SIMD_KERNELS.nt16_fwd(out, seq, nbytes); i < nbytes; i++) {
+            memcpy(out + i * 2, THE_NT16_PAIR_TABLE.fwd[seq[i]], 2);
+        }
+        if (len % 2) { out[len - 1] = THE_NT16_PAIR_TABLE.fwd16[seq[nbytes] >> 4]; }
+        return;
+    }
+    // the last base (in the high nibble of the byte at nbytes if len is odd) becomes the first one
+    if (len % 2) { *(out++) = THE_NT16_PAIR_TABLE.rc16[seq[nbytes] >> 4]; }
+    for (int i = THE_SIMD_KERNELS.nt16_rc(out, seq, nbytes); i < nbytes; i++) {
+        memcpy(out + i * 2, THE_NT16_PAIR_TABLE.rc[seq[nbytes - 1 - i]], 2);
+    }
+}
+
+// Append the len bases of the nibble-packed seq starting at the base beg to out. 
+void nt16_decode_append(std::string &out, const uint8_t *seq, int beg, int len) {
+    const size_t out_size0 = out.size();
+    out.resize(out_size0 + len);
+    char *p = &out[out_size0];
+    if ((beg % 2) && len > 0) {
+        *(p++) = seq_nt16_str[bam_seqi(seq, beg)];
+        beg++;
+        len--;
+    }
+    nt16_decode(p, seq + beg / 2, len, false);
+}
+
+// Write the len base qualities of qual as Phred+33 text into out, reversing them if is_reverse is true. 
+void qual_encode(char *out, const uint8_t *qual, int len, bool is_reverse) {
+    if (is_reverse) {
+        for (int i = THE_SIMD_KERNELS.qual_rev(out, qual, len); i < len; i++) { out[i] = (char)(qual[len - 1 - i] + 33); }
+    } else {
+        for (int i = THE_SIMD_KERNELS.qual_fwd(out, qual, len); i < len; i++) { out[i] = (char)(qual[i] + 33); }
+    }
+}
+
+int is_var1_before_var2(int tid1, int pos1, int tid2, int pos2) {
+    return (tid1 < tid2) || (tid1 == tid2 && pos1 < pos2);
 }
 
+// The sequence and quality are decoded straight into outstr without any intermediate string. 
+int bamrec_write_fastq_raw(const bam1_t *aln, std::string &outstr) {
+    size_t outstr_size0 = outstr.size();
+    outstr.push_back('@');
+    outstr.append(bam_get_qname(aln));
+    outstr.push_back('\n');
+    
+    const int len = aln->core.l_qseq;
+    const bool is_reverse = (0 != (aln->core.flag & 0x10));
+    const size_t seq_beg = outstr.size();
+    outstr.resize(seq_beg + len * 2 + 4);
+    char *out = &outstr[seq_beg];
+    nt16_decode(out, bam_get_seq(aln), len, is_reverse);
+    memcpy(out + len, "\n+\n", 3);
+    qual_encode(out + len + 3, bam_get_qual(aln), len, is_reverse);
+    out[len * 2 + 3] = '\n';
+    return (int)(outstr.size() - outstr_size0);
+}
 
-int bamrec_write_fastq(const bam1_t *aln, std::string &seq, std::string &qual, gzFile &outfile) {
+int bamrec_write_fastq(const bam1_t *aln, std::string &seq, std::string &qual, std::string &outstr) {
     
     assert(qual.size() == seq.size());
     for (int i = 0; i < qual.size(); i++) {
         qual[i] = (char)(qual[i] + 33);
     }
-    gzprintf(outfile, "@%s\n", bam_get_qname(aln));
+    size_t outstr_size0 = outstr.size();
+    outstr.push_back('@');
+    outstr.append(bam_get_qname(aln));
+    outstr.push_back('\n');
     if ((aln->core.flag & 0x10)) { reverse(seq); complement(seq); }
     for (int i = 0; i < seq.size(); i++) {
         assert(seq[i] > ' ' || !fprintf(stderr, "The read with qname %s is invalid!\n", bam_get_qname(aln)));
     }
-    gzprintf(outfile, "%s\n+\n", seq.c_str());
+    outstr.append(seq);
+    outstr.append("\n+\n");
     if ((aln->core.flag & 0x10)) { reverse(qual); }
-    int ret = gzprintf(outfile, "%s\n", qual.c_str());
-    return ret;
+    outstr.append(qual);
+    outstr.push_back('\n');
+    return (int)(outstr.size() - outstr_size0);
 }
 
-void help(int argc, char **argv, int exit_code) {
-    fprintf(stdout, "Program %s version %s (%s)\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH);
-    fprintf(stdout, "  This is a NGS variant simulator that is aware of the molecular-barcodes (also known as unique molecular identifiers (UMIs))\n");
-    
-    fprintf(stdout, "Usage: %s -b <INPUT-BAM> -v <INPUT-VCF> -1 <OUTPUT-R1-FASTQ> -2 <OUTPUT-R2-FASTQ.gz> -0 <OUTPUT-UNPAIRED-FASTQ.GZ>\n", argv[0]);
-    fprintf(stdout, "Optional parameters:\n");
-    fprintf(stdout, " -f Fraction of variant allele (FA) to simulate. "
-            "This value is overriden by the INFO/FA tag (specified by the -F command-line parameter) in the INPUT-VCF. "
-            "Please note that INFO/FA must be defined the header of INPUT-VCF to be effective. "
-            "Otherwise, the value defined by -f is used in the simulation [default to %f].\n", DEFAULT_ALLELE_FRAC);
-    fprintf(stdout, " -p The power-law exponent simulating the over-dispersion of allele fractions in NGS [default to %f] (https://doi.org/10.1093/bib/bbab458). Negative value means that no over-dispersion is simulated. \n", DEFAULT_POWER_LAW_EXPONENT);
-    fprintf(stdout, " -q the log-normal over-dispersion parameter in Phred scale [default to %f] (https://doi.org/10.1093/bib/bbab458). Negative value means that no over-dispersion is simulated. \n", DEFAULT_LOGNORMAL_DISP);
-    fprintf(stdout, " -s The random seed used to simulate allele fractions from read names labeled with UMIs [default to %u].\n", DEFAULT_RANDSEED);
+typedef struct {
+    double defallelefrac;
+    int snv_bq_phred;
+    int ins_bq_phred;
+    uint32_t randseed;
+    uint32_t randseed_basecall;
+    const char *tagFA;
+    bool is_FA_from_INFO;
+    int tag_sample_idx;
+    double powerlaw_exponent;
+    double lognormal_disp;
+    double lnsigma;
+    uint32_t samplehash1;
+    uint32_t samplehash2;
+    const bcf_hdr_t *vcf_hdr;
+    bool is_outfile_set[3];
+    fastq_format_t fastq_format;
+    int fastq_level;
+    bool is_mate_paired; // if true, then the R1 and R2 FASTQ records are compressed by mate_pairer_t instead of by the workers
+    bool is_bam_output; // if true, then only the reads spiked with indels are written to the FASTQ files
+    int config_idx; // the index of this configuration, where the outputs of the i-th configuration are at [3*i, 3*i+3)
+    bool is_profiling; // if true, then the time spent in each stage of the pipeline is measured for the run report
+    struct spike_variant_report_t *variant_report; // if not NULL, then the reads covering and spiked with each variant are counted
+    struct spike_progress_t *progress; // if not NULL, then the readers publish their progress for the progress thread
+    int kernel_idx; // the specialization of bamrec_spike selected by spike_args_set_kernel, where 0 is the generic one
+} spike_args_t;
 
-    
-    fprintf(stdout, " -x Phred-scale sequencing error rates of simulated SNV variants "
-            "where -2 means zero error and -1 means using sequencer BQ [default to %d].\n", DEFAULT_SNV_BQ_PHRED);
-    
-    fprintf(stdout, " -i The base quality of the inserted bases in the simulated insertion variants. "
-            "[default to %d].\n", DEFAULT_INS_BQ_PHRED);
-    fprintf(stdout, " -A The number of reads used to generate the randomness for simulating the nominator of the allele fraction used with the -p cmd-line param [default to %u].\n", DEFAULT_NITERS1);
-    fprintf(stdout, " -B The number of reads used to generate the randomness for simulating the denominator of the allele fraction used with the -p cmd-line param [default to %u].\n", DEFAULT_NITERS2);
-    fprintf(stdout, " -C The random seed used to simulate basecalling error [default to %u].\n", DEFAULT_RANDSEED);
-    fprintf(stdout, " -F allele fraction TAG in the VCF file. " "[default to FA].\n");
-    fprintf(stdout, " -S sample name used for the -F command-line parameter. "
-                    "The special values NULL pointer, empty-string, and INFO mean using the INFO column instead of the FORMAT column." "[default to NULL pointer].\n");
-    
-    fprintf(stdout, "Note:\n");
-    fprintf(stdout, "Reads in <OUTPUT-R1-FASTQ> and <OUTPUT-R2-FASTQ> are not in the same order, so these output FASTQ files have to be sorted using a tool such as fastq-sort before being aligned again, as most aligners such as BWA and Bowtie2 require reads in the R1 and R2 files to be in the same order (This is VERY IMPORTANT!).\n");
-    fprintf(stdout, "<INPUT-BAM> and <INPUT-VCF> both have to be sorted and indexed.\n");
-    fprintf(stdout, "To detect UMI, this prgram first checks for the MI tag in each alignment record in <INPUT-BAM>. If the MI tag is absent, then the program checks for the string after the number-hash-pound sign (#) in the read name (QNAME).\n");
-    fprintf(stdout, "Each variant record in the INPUT-VCF needs to have only one variant, it cannot be multiallelic.\n");
-    fprintf(stdout, "Currently, the simulation of insertion/deletion variants causes longer/shorter-than-expected lengths of read template sequences due to preservation of alignment start and end positions on the reference genome.\n");
-    fprintf(stdout, "The symbol '#' denotes the start of UMI sequence so that any string before the '#' symbol is discarded.\n");
-    fprintf(stdout, "The symbol '+' in a UMI sequence means that the UMI is a duplex, so the substrings before/after the '+' symbol are respectively the alpha/beta tags.\n");
-    fprintf(stdout, "The BAM tag MI has special meaning as mentioned in the BAM file format specification."
-           "Therefore, for each BAM record, this program first searches for the MI tag. If the MI tag is not found, then this program uses the read name QNAME as the string containing UMI sequence.\n");
-    fprintf(stdout, "The -v command-line parameter without any other comamnd-line parameter means 'print version then exit with zero'.\n");
-    exit(exit_code);
+// The stages of the pipeline timed in the profiling mode, where the time of each stage is summed over all the threads running the stage. 
+enum spike_stage_t {
+    SPIKE_STAGE_DECODE,
+    SPIKE_STAGE_VARIANT_LOOKUP,
+    SPIKE_STAGE_MUTATION,
+    SPIKE_STAGE_FORMATTING,
+    SPIKE_STAGE_COMPRESSION,
+    SPIKE_STAGE_WRITE,
+    SPIKE_STAGE_NUM,
+};
+const char *SPIKE_STAGE_NAMES[] = {"decode", "variant_lookup", "mutation", "formatting", "compression", "write"};
+
+static inline int64_t clock_ns(clockid_t clock_id) {
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-int 
-main(int argc, char **argv) {
-    
-    int flags, opt;
-    char *inbam = NULL;
-    char *invcf = NULL;
-    char *r0outfq = NULL;
-    char *r1outfq = NULL;
-    char *r2outfq = NULL;
-    double defallelefrac = DEFAULT_ALLELE_FRAC;
-    int snv_bq_phred = DEFAULT_SNV_BQ_PHRED;
-    int ins_bq_phred = DEFAULT_INS_BQ_PHRED;
-    uint32_t randseed = DEFAULT_RANDSEED;
-    uint32_t rand_niters1 = DEFAULT_NITERS1;
-    uint32_t rand_niters2 = DEFAULT_NITERS2;
-    uint32_t randseed_basecall = DEFAULT_RANDSEED;
-    const char *tagFA = TAG_FA;
-    const char *tagsample = NULL;
-    bool is_always_log = false;
-    double powerlaw_exponent = DEFAULT_POWER_LAW_EXPONENT;
-    double lognormal_disp = DEFAULT_LOGNORMAL_DISP;
-    while ((opt = getopt(argc, argv, "h0:1:2:b:f:i:p:q:s:v:x:A:B:C:F:L:S:")) != -1) {
-        switch (opt) {
-            case 'h': help(argc, argv, 0);
-            case '0': r0outfq = optarg; break;
-            case '1': r1outfq = optarg; break;
-            case '2': r2outfq = optarg; break;
-            case 'b': inbam = optarg; break; // required            
-            case 'f': defallelefrac = atof(optarg); break;
-            case 'i': ins_bq_phred = atof(optarg); break;
-            case 'p': powerlaw_exponent = atof(optarg); break;
-            case 'q': lognormal_disp = atof(optarg); break;
-            case 's': randseed = atoi(optarg); break;
-            case 'v': invcf = optarg; break; // required
-            case 'x': snv_bq_phred = atof(optarg); break;
-            case 'A': rand_niters1 = atoi(optarg); break;
-            case 'B': rand_niters2 = atoi(optarg); break;
-            case 'C': randseed_basecall = atoi(optarg); break;
-            case 'F': tagFA = optarg; break;
-            case 'L': is_always_log = true; break; // developer debug-mode flag which is not on the cmd-line help
-            case 'S': tagsample = optarg; break;
-            default: help(argc, argv, -1);
-        }
-    }
-    if (NULL == inbam || NULL == invcf) {
-        fprintf(stderr, "The input BAM and VCF filenames have to be specified on the command line\n");
-        help(argc, argv, -1);
-    }
-    if ((NULL == r0outfq) && (NULL == r1outfq) && (NULL == r2outfq)) {
-        fprintf(stderr, "At least one output FASTQ file has to be specified on the command line\n");
-        help(argc, argv, -1);
-    }
-    double lnfrac = pow(10.0, -lognormal_disp / 10.0);
-    double lnsigma = log(2.0) / sqrt(log(lnfrac) / (-1.0/2.0));
-    lnsigma = lnsigma / sqrt(2.0); // transform obs-to-obs var to obs-to-exp var
-    
-    if (0 != randseed) {
-        randseed  = portable_int2randint(randseed , 1);
-    }
-    if (0 != randseed_basecall) {
-        randseed_basecall = portable_int2randint(randseed_basecall, 4);
-    }
-    const bool is_FA_from_INFO = ((tagsample == NULL) || (0 == strlen(tagsample)) || !strcmp("INFO", tagsample));
-    fprintf(stderr, "%s\n=== version ===\n%s\n%s\n%s\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH, GIT_DIFF_FULL);
-    fprintf(stderr, "lnsigma = %f\n", lnsigma);
-    
+// The wall and CPU times at the start of a timed region
+typedef struct {
+    int64_t wall_ns;
+    int64_t cpu_ns;
+} spike_clock_t;
+
+static inline spike_clock_t spike_clock_now() {
+    spike_clock_t clock = {clock_ns(CLOCK_MONOTONIC), clock_ns(CLOCK_THREAD_CPUTIME_ID)};
+    return clock;
+}
+
+typedef struct {
     int64_t num_kept_reads = 0;
     int64_t num_kept_snv = 0;
     int64_t num_kept_mnv = 0;
@@ -375,287 +761,3763 @@ main(int argc, char **argv) {
     int64_t num_kept_del = 0;
     int64_t num_skip_reads = 0;
     int64_t num_skip_cmatches = 0;
-    
-    htsFile *vcf_fp = vcf_open(invcf, "r");
-    bcf_hdr_t *vcf_hdr = bcf_hdr_read(vcf_fp);
+    int64_t num_edited_bam_reads = 0;
+    int64_t num_indel_bam_reads = 0;
+    int64_t num_flagged_bam_alns = 0; // the secondary and supplementary alignments flagged in the output BAM
+    int64_t num_passthrough_reads = 0;
+    int64_t num_mutated_reads = 0;
+    int64_t num_umi_cache_lookups = 0;
+    int64_t num_umi_cache_hits = 0;
+    int64_t num_input_reads = 0;
+    int64_t num_rescued_mates = 0; // the mates outside the target regions (-R) read for their other mates
+    int64_t max_variant_window = 0; // the maximum number of variants in the sweep at the same time
+    int64_t stage_wall_ns[SPIKE_STAGE_NUM] = {0};
+    int64_t stage_cpu_ns[SPIKE_STAGE_NUM] = {0};
+} spike_stats_t;
+
+void spike_stats_add_time(spike_stats_t &stats, spike_stage_t stage, const spike_clock_t &beg) {
+    const spike_clock_t end = spike_clock_now();
+    stats.stage_wall_ns[stage] += end.wall_ns - beg.wall_ns;
+    stats.stage_cpu_ns[stage] += end.cpu_ns - beg.cpu_ns;
+}
+
+// The region starting at beg is split into stage and substage, where the wall time of substage was measured per read into substage_wall_ns. 
+// Reading the CPU clock of the thread per read is too slow, so the CPU time of the region is distributed in proportion to the wall times. 
+void spike_stats_add_split_time(spike_stats_t &stats, spike_stage_t stage, spike_stage_t substage, const spike_clock_t &beg, int64_t substage_wall_ns) {
+    const spike_clock_t end = spike_clock_now();
+    const int64_t wall_ns = end.wall_ns - beg.wall_ns;
+    const int64_t cpu_ns = end.cpu_ns - beg.cpu_ns;
+    const int64_t substage_cpu_ns = (wall_ns > 0 ? (int64_t)((double)cpu_ns * substage_wall_ns / wall_ns) : 0);
+    stats.stage_wall_ns[stage] += wall_ns - substage_wall_ns;
+    stats.stage_cpu_ns[stage] += cpu_ns - substage_cpu_ns;
+    stats.stage_wall_ns[substage] += substage_wall_ns;
+    stats.stage_cpu_ns[substage] += substage_cpu_ns;
+}
+
+void spike_stats_add(spike_stats_t &stats, const spike_stats_t &other) {
+    stats.num_kept_reads += other.num_kept_reads;
+    stats.num_kept_snv += other.num_kept_snv;
+    stats.num_kept_mnv += other.num_kept_mnv;
+    stats.num_kept_ins += other.num_kept_ins;
+    stats.num_kept_del += other.num_kept_del;
+    stats.num_skip_reads += other.num_skip_reads;
+    stats.num_skip_cmatches += other.num_skip_cmatches;
+    stats.num_edited_bam_reads += other.num_edited_bam_reads;
+    stats.num_indel_bam_reads += other.num_indel_bam_reads;
+    stats.num_flagged_bam_alns += other.num_flagged_bam_alns;
+    stats.num_passthrough_reads += other.num_passthrough_reads;
+    stats.num_mutated_reads += other.num_mutated_reads;
+    stats.num_umi_cache_lookups += other.num_umi_cache_lookups;
+    stats.num_umi_cache_hits += other.num_umi_cache_hits;
+    stats.num_input_reads += other.num_input_reads;
+    stats.num_rescued_mates += other.num_rescued_mates;
+    stats.max_variant_window = MAX(stats.max_variant_window, other.max_variant_window);
+    for (int stage = 0; stage < SPIKE_STAGE_NUM; stage++) {
+        stats.stage_wall_ns[stage] += other.stage_wall_ns[stage];
+        stats.stage_cpu_ns[stage] += other.stage_cpu_ns[stage];
+    }
+}
+
+enum spike_variant_type_t {
+    VARIANT_TYPE_SNV,
+    VARIANT_TYPE_MNV,
+    VARIANT_TYPE_INS,
+    VARIANT_TYPE_DEL,
+    VARIANT_TYPE_OTHER,
+};
+
+typedef struct {
+    double allelefrac;  // accumulated over the variants at the same position entering the sweep so far
+    double allelefrac2; // after the power-law transform
+    double allelefrac3; // after the log-normal transform
+    double requested; // the allele fraction of this variant alone (without the variants before it at the same position)
+    double target; // allelefrac3 minus the one of the variant before it at the same position
+    // updated by all the workers for the variant report
+    mutable uint32_t n_covering_reads;
+    mutable uint32_t n_spiked_reads;
+} spike_allelefracs_t;
+
+// A variant is parsed only once when it enters the sweep because everything used for spiking depends only on the variant. 
+typedef struct {
+    int32_t rid;
+    hts_pos_t pos;
+    uint32_t reflen;
+    uint32_t altlen;
+    spike_variant_type_t type;
+    std::vector<spike_allelefracs_t> allelefracs; // one per configuration
+    const char *alt; // points to either altbuf or the ALT allele in the mapped spike plan
+    std::string altbuf;
+    int64_t voffset; // the virtual offset of the record in the VCF file (or its index in the spike plan), from which a resumed run reads it again
+} spike_variant_t;
+
+const char *SPIKE_VARIANT_REPORT_HEADER = "#CHROM\tPOS\tREFLEN\tALT\tCONFIG\tREQUESTED_FA\tTARGET_FA\tDEPTH\tSPIKED\tREALIZED_FA\n";
+
+// The reads covering and spiked with each variant are written as one TSV row per variant and configuration once the variant leaves the sweep. 
+// The rows are in the order of the variants except in the shard-parallel mode, 
+//   and a variant near the boundary between two shards has one row per shard, whose counts add up. 
+typedef struct spike_variant_report_t {
+    std::mutex mutex;
+    FILE *file;
+    const sam_hdr_t *bam_hdr;
+} spike_variant_report_t;
+
+// If is_resumed, then the variant report of the interrupted run is kept to be truncated at the checkpoint. 
+void spike_variant_report_open(spike_variant_report_t &report, const char *fname, const sam_hdr_t *bam_hdr, bool is_resumed) {
+    report.file = fopen(fname, (is_resumed ? "r+" : "w"));
+    if (NULL == report.file) {
+        fprintf(stderr, "Failed to open the variant report %s for writing\n", fname);
+        exit(-1);
+    }
+    report.bam_hdr = bam_hdr;
+    if (is_resumed) { return; }
+    fputs(SPIKE_VARIANT_REPORT_HEADER, report.file);
+}
+
+void spike_variant_retire(spike_variant_t *variant, const spike_args_t &args) {
+    spike_variant_report_t *report = args.variant_report;
+    if (report != NULL) {
+        const char *tname = ((variant->rid >= 0 && variant->rid < sam_hdr_nref(report->bam_hdr)) ? sam_hdr_tid2name(report->bam_hdr, variant->rid) : ".");
+        std::lock_guard<std::mutex> lock(report->mutex);
+        for (size_t i = 0; i < variant->allelefracs.size(); i++) {
+            const spike_allelefracs_t &allelefracs = variant->allelefracs[i];
+            fprintf(report->file, "%s\t%ld\t%u\t%s\t%lu\t%f\t%f\t%u\t%u\t", tname, variant->pos + 1, variant->reflen, 
+                    (variant->altlen > 0 ? variant->alt : "."), i, allelefracs.requested, allelefracs.target, 
+                    allelefracs.n_covering_reads, allelefracs.n_spiked_reads);
+            if (allelefracs.n_covering_reads > 0) {
+                fprintf(report->file, "%f\n", (double)allelefracs.n_spiked_reads / allelefracs.n_covering_reads);
+            } else {
+                fprintf(report->file, "NA\n");
+            }
+        }
+    }
+}
+
+spike_variant_type_t spike_variant_type(uint32_t reflen, uint32_t altlen) {
+    if (1 == reflen && 1 == altlen) {
+        return VARIANT_TYPE_SNV;
+    } else if (reflen == altlen) {
+        return VARIANT_TYPE_MNV;
+    } else if (1 == reflen && altlen > 1) {
+        return VARIANT_TYPE_INS;
+    } else if (reflen > 1 && 1 == altlen) {
+        return VARIANT_TYPE_DEL;
+    } else {
+        return VARIANT_TYPE_OTHER;
+    }
+}
+
+// The FA tag is taken from the INFO column if tagsample is NULL, empty, or INFO. 
+bool tagsample_is_INFO(const char *tagsample) {
+    return (tagsample == NULL) || (0 == strlen(tagsample)) || !strcmp("INFO", tagsample);
+}
+
+// The FA tag is taken from the FORMAT column of the sample named tagsample, or of the last sample if no sample has this name. 
+int vcf_hdr_tag_sample_idx(const bcf_hdr_t *vcf_hdr, const char *tagsample) {
     int tag_sample_idx = bcf_hdr_nsamples(vcf_hdr) - 1; 
     for (int sidx = 0; sidx < bcf_hdr_nsamples(vcf_hdr); sidx++) {
         if ((tagsample != NULL) && !strcmp(tagsample, vcf_hdr->samples[sidx])) {
             tag_sample_idx = sidx; 
         }
     }
-    bcf1_t *vcf_rec = bcf_init();
-    vcf_rec->rid = -1;
-    vcf_rec->pos = 0;
-    samFile *bam_fp = sam_open(inbam, "r");
-    sam_hdr_t *bam_hdr = sam_hdr_read(bam_fp);
-    bam1_t *bam_rec1 = bam_init1();
-    
-    gzFile r0file = gzopen(r0outfq, "wb1");
-    gzFile r1file = gzopen(r1outfq, "wb1");
-    gzFile r2file = gzopen(r2outfq, "wb1");
-    
-    std::deque<bcf1_t*> vcf_list;
-    
-    float *bcffloats = NULL; // [256] = {0}; 
-    int vcf_read_ret = 0;
-    
-    std::string newseq, newqual;
-    
-    samFile *bam_fp2 = sam_open(inbam, "r");
-    sam_hdr_t *bam_hdr2 = sam_hdr_read(bam_fp2);
-    uint64_t read_cnt = 0;
-    uint32_t samplehash1 = 0;
-    uint32_t samplehash2 = 0;
-    while (sam_read1(bam_fp2, bam_hdr, bam_rec1) >= 0 && read_cnt < MAX(rand_niters1, rand_niters2)) {
-        if (read_cnt < rand_niters1) { 
-            samplehash1 += __ac_X31_hash_string(bam_get_qname(bam_rec1));
+    return tag_sample_idx;
+}
+
+// Return true and set allelefrac if the FA tag is found in vcf_rec, where bcffloats is the reusable buffer of htslib. 
+bool vcf_rec_get_allelefrac(double &allelefrac, const bcf_hdr_t *vcf_hdr, bcf1_t *vcf_rec, 
+        const char *tagFA, bool is_FA_from_INFO, int tag_sample_idx, float **bcffloats) {
+    int ndst_val = 0;
+    int valsize = 0;
+    if (is_FA_from_INFO) {
+        valsize = bcf_get_info_float(vcf_hdr, vcf_rec, tagFA, bcffloats, &ndst_val);
+        if (valsize > 0) { 
+            allelefrac = (*bcffloats)[valsize - 1]; 
+            return true;
         }
-        if (read_cnt < rand_niters2) { 
-            samplehash2 += __ac_X31_hash_string(bam_get_qname(bam_rec1));
+    } else {
+        valsize = bcf_get_format_float(vcf_hdr, vcf_rec, tagFA, bcffloats, &ndst_val);
+        if (valsize > 0 && valsize == bcf_hdr_nsamples(vcf_hdr)) { 
+            allelefrac = (*bcffloats)[tag_sample_idx]; 
+            return true;
         }
-        read_cnt += 1;
     }
-    fprintf(stderr, "The value samplehash1 and samplehash2 are %u and %u, read_cnt = %lu\n", samplehash1, samplehash2, read_cnt);
-    bam_hdr_destroy(bam_hdr2);
-    sam_close(bam_fp2);
-    
-    while (sam_read1(bam_fp, bam_hdr, bam_rec1) >= 0) {
-        const bam1_t *bam_rec = bam_rec1;
-        if ((0 != (bam_rec->core.flag & 0x900)) && (0 == (bam_rec->core.flag & 0x4))) { continue; }
-        auto &outfile = ((bam_rec->core.flag & 0x40) ? r1file : ((bam_rec->core.flag & 0x80) ? r2file : r0file));
-        const char *outfname = ((bam_rec->core.flag & 0x40) ? r1outfq : ((bam_rec->core.flag & 0x80) ? r2outfq : r0outfq));
-        if ((0 != (bam_rec->core.flag & 0x4))) {
-            int write_ret = bamrec_write_fastq_raw(bam_rec1, outfile);
-            continue;
+    return false;
+}
+
+// The spike plan is a VCF file compiled by the compile-vcf command into a flat layout in native byte order, 
+//   so that it is mapped into memory and used without any parsing. The plan consists of 
+//   the header, the NUL-terminated contig names of the VCF header, the variant records sorted by (rid, pos), and the NUL-terminated ALT alleles. 
+const char SPIKE_PLAN_MAGIC[8] = {'S', 'M', 'P', 'L', 'A', 'N', '\0', '\0'};
+const uint32_t SPIKE_PLAN_VERSION = 1;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_contigs;
+    uint64_t n_variants;
+    uint64_t contigs_offset;
+    uint64_t variants_offset;
+    uint64_t alts_offset;
+    uint64_t file_size;
+} spike_plan_header_t;
+
+typedef struct {
+    int32_t rid;
+    uint32_t type;
+    int64_t pos;
+    uint32_t reflen;
+    uint32_t altlen;
+    uint64_t alt_offset; // relative to alts_offset
+    float allelefrac; // resolved from the INFO or FORMAT column at compile time
+    uint32_t is_allelefrac_found;
+} spike_plan_variant_t;
+
+typedef struct {
+    void *addr; // NULL means that no spike plan is mapped
+    size_t size;
+    const spike_plan_header_t *header;
+    const spike_plan_variant_t *variants;
+    const char *alts;
+    std::vector<const char*> contigs;
+} spike_plan_t;
+
+bool spike_plan_is_plan(const char *fname) {
+    char magic[sizeof(SPIKE_PLAN_MAGIC)];
+    if (!strcmp("-", fname)) { return false; } // the standard input is not mapped into memory
+    FILE *file = fopen(fname, "rb");
+    if (NULL == file) { return false; }
+    const bool is_plan = (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, SPIKE_PLAN_MAGIC, sizeof(magic)));
+    fclose(file);
+    return is_plan;
+}
+
+void spike_plan_open(spike_plan_t &plan, const char *fname) {
+    const int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open the spike plan %s for reading\n", fname);
+        abort();
+    }
+    plan.size = st.st_size;
+    plan.addr = mmap(NULL, plan.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == plan.addr) {
+        fprintf(stderr, "Failed to map the spike plan %s into memory\n", fname);
+        abort();
+    }
+    const char *bytes = (const char*)plan.addr;
+    plan.header = (const spike_plan_header_t*)bytes;
+    bool is_valid = (plan.size >= sizeof(spike_plan_header_t) && plan.header->version == SPIKE_PLAN_VERSION && plan.header->file_size == plan.size
+            && plan.header->contigs_offset >= sizeof(spike_plan_header_t) && plan.header->contigs_offset <= plan.header->variants_offset
+            && plan.header->alts_offset <= plan.size && plan.header->variants_offset <= plan.header->alts_offset
+            && plan.header->n_variants <= (plan.header->alts_offset - plan.header->variants_offset) / sizeof(spike_plan_variant_t));
+    // each contig name is NUL-terminated before the variant records
+    const char *contig = bytes + plan.header->contigs_offset;
+    for (uint32_t i = 0; is_valid && i < plan.header->n_contigs; i++) {
+        const char *contig_end = (const char*)memchr(contig, '\0', bytes + plan.header->variants_offset - contig);
+        if (NULL == contig_end) {
+            is_valid = false;
+            break;
         }
-        while (1) {
-            if (vcf_read_ret != -1) {
-                fprintf(stderr, "The variant at tid %d pos %ld is before the read at tid %d pos %ld, readname = %s\n", 
-                    vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_rec->core.pos, bam_get_qname(bam_rec));
-                vcf_read_ret = vcf_read(vcf_fp, vcf_hdr, vcf_rec); // skip this variant
-                fprintf(stderr, "The new prep variant is at tid %d pos %ld\n", 
-                    vcf_rec->rid, vcf_rec->pos);
-            }
-            if (vcf_read_ret < 0) { break; }
-            if (!is_var1_before_var2(vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_rec->core.pos)) {
-                vcf_list.push_back(bcf_dup(vcf_rec));  
-                break;
+        plan.contigs.push_back(contig);
+        contig = contig_end + 1;
+    }
+    // each ALT allele with its NUL terminator is within the file
+    if (is_valid) {
+        plan.variants = (const spike_plan_variant_t*)(bytes + plan.header->variants_offset);
+        plan.alts = bytes + plan.header->alts_offset;
+        const uint64_t alts_size = plan.size - plan.header->alts_offset;
+        for (uint64_t i = 0; is_valid && i < plan.header->n_variants; i++) {
+            const spike_plan_variant_t &variant = plan.variants[i];
+            is_valid = (variant.rid >= 0 && (uint32_t)variant.rid < plan.header->n_contigs 
+                    && variant.alt_offset < alts_size && variant.altlen < alts_size - variant.alt_offset);
+        }
+    }
+    if (!is_valid) {
+        fprintf(stderr, "The spike plan %s is truncated or is not of the version %u, please run compile-vcf again\n", fname, SPIKE_PLAN_VERSION);
+        abort();
+    }
+}
+
+void spike_plan_close(spike_plan_t &plan) {
+    if (plan.addr != NULL) { munmap(plan.addr, plan.size); }
+    plan.addr = NULL;
+    plan.contigs.clear();
+}
+
+// Set [beg_idx, end_idx) to the variants on the contig tname starting at or after the position beg
+void spike_plan_query(const spike_plan_t &plan, const char *tname, hts_pos_t beg, uint64_t &beg_idx, uint64_t &end_idx) {
+    beg_idx = 0;
+    end_idx = 0;
+    for (size_t rid = 0; rid < plan.contigs.size(); rid++) {
+        if (strcmp(tname, plan.contigs[rid])) { continue; }
+        const spike_plan_variant_t *variants_end = plan.variants + plan.header->n_variants;
+        auto is_before = [](const spike_plan_variant_t &variant, const std::pair<int32_t, hts_pos_t> &key) {
+            return variant.rid < key.first || (variant.rid == key.first && variant.pos < key.second);
+        };
+        const spike_plan_variant_t *it_beg = std::lower_bound(plan.variants, variants_end, std::make_pair((int32_t)rid, beg), is_before);
+        const spike_plan_variant_t *it_end = std::lower_bound(it_beg, variants_end, std::make_pair((int32_t)rid + 1, (hts_pos_t)0), is_before);
+        beg_idx = it_beg - plan.variants;
+        end_idx = it_end - plan.variants;
+        return;
+    }
+}
+
+// The hash of a UMI family with its fragment, which is shared by all the reads of the family. 
+typedef struct {
+    bool is_used;
+    int32_t tid; // the contig of the read that added the family, used only for the eviction
+    uint32_t randseed;
+    uint32_t begpos;
+    uint32_t endpos;
+    uint32_t umihash;
+    std::string umi;
+} umi_cache_entry_t;
+
+// per-thread buffers reused across reads
+typedef struct {
+    std::string newseq;
+    std::string newqual;
+    // The cache is set-associative by the UMI and the fragment. A new family takes an empty way first, 
+    //   then the way of a family whose fragment ends before the sweep position (or is on another contig), then the way of the family whose fragment ends first. 
+    std::vector<umi_cache_entry_t> umi_cache;
+    int64_t substage_wall_ns = 0; // see spike_stats_add_split_time
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_compressor *compressor = NULL;
+#endif
+} spike_workspace_t;
+
+void spike_workspace_destroy(spike_workspace_t &ws) {
+#ifdef USE_LIBDEFLATE
+    if (ws.compressor != NULL) {
+        libdeflate_free_compressor(ws.compressor);
+        ws.compressor = NULL;
+    }
+#endif
+}
+
+// Same as umistr2prob but with the UMI-family hash looked up in the cache of ws first, where the read is at the position pos of the contig tid. 
+double umistr2prob_cached(uint32_t &umihash, uint32_t randseed, uint32_t begpos, uint32_t endpos, const char *str, int32_t tid, hts_pos_t pos, 
+        spike_workspace_t &ws, spike_stats_t &stats) {
+    const char *umistr = NULL;
+    size_t umi_strlen = 0;
+    const uint32_t umistr_hash = umistr_find(str, umistr, umi_strlen);
+    if (0 == ws.umi_cache.size()) {
+        ws.umi_cache.resize(UMI_CACHE_SIZE);
+    }
+    umi_cache_entry_t *set = &ws.umi_cache[(umistr_hash ^ (begpos * 0x9E3779B1U) ^ (endpos * 0x85EBCA77U) ^ randseed) & (UMI_CACHE_SIZE - UMI_CACHE_WAYS)];
+    stats.num_umi_cache_lookups++;
+    // The ways of a set are filled in order and never emptied, so no family is cached after the first empty way. 
+    umi_cache_entry_t *victim = NULL;
+    bool is_victim_behind_sweep = false;
+    for (size_t i = 0; i < UMI_CACHE_WAYS; i++) {
+        umi_cache_entry_t &entry = set[i];
+        if (!entry.is_used) {
+            victim = &entry;
+            break;
+        }
+        if (entry.randseed == randseed && entry.begpos == begpos && entry.endpos == endpos 
+                && entry.umi.size() == umi_strlen && !memcmp(entry.umi.data(), umistr, umi_strlen)) {
+            stats.num_umi_cache_hits++;
+            umihash = entry.umihash;
+            return (double)(umihash&0xffffff) / 0x1000000;
+        }
+        const bool is_behind_sweep = (entry.tid != tid || (hts_pos_t)entry.endpos < pos);
+        if (NULL == victim || (!is_victim_behind_sweep && (is_behind_sweep || entry.endpos < victim->endpos))) {
+            victim = &entry;
+            is_victim_behind_sweep = is_behind_sweep;
+        }
+    }
+    victim->is_used = true;
+    victim->tid = tid;
+    victim->randseed = randseed;
+    victim->begpos = begpos;
+    victim->endpos = endpos;
+    victim->umihash = umi_family_hash(randseed, begpos, endpos, umistr, umi_strlen, umistr_hash);
+    victim->umi.assign(umistr, umi_strlen);
+    umihash = victim->umihash;
+    return (double)(umihash&0xffffff) / 0x1000000;
+}
+
+// The BGZF end-of-file marker block (https://samtools.github.io/hts-specs/SAMv1.pdf)
+const char BGZF_EOF_BLOCK[28 + 1] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0";
+
+// Append one BGZF block containing the uncompressed data to dst. 
+int bgzf_block_compress(std::string &dst, const char *src, size_t srclen, int level, spike_workspace_t &ws) {
+    assert(srclen <= BGZF_BLOCK_SIZE);
+    const size_t dst_size0 = dst.size();
+    dst.resize(dst_size0 + BGZF_MAX_BLOCK_SIZE);
+    size_t blocklen = BGZF_MAX_BLOCK_SIZE;
+#ifdef USE_LIBDEFLATE
+    // same layout as in bgzf_compress from htslib
+    const size_t header_size = 18;
+    const size_t footer_size = 8;
+    uint8_t *block = (uint8_t*)&dst[dst_size0];
+    const size_t deflatedlen = libdeflate_deflate_compress(ws.compressor, src, srclen, 
+            block + header_size, BGZF_MAX_BLOCK_SIZE - header_size - footer_size);
+    if (0 == deflatedlen) { return -1; }
+    blocklen = header_size + deflatedlen + footer_size;
+    const uint32_t crc = libdeflate_crc32(0, src, srclen);
+    const uint8_t header[18] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 
+            (uint8_t)((blocklen - 1) & 0xff), (uint8_t)(((blocklen - 1) >> 8) & 0xff)};
+    memcpy(block, header, header_size);
+    for (int i = 0; i < 4; i++) {
+        block[header_size + deflatedlen + i]     = (uint8_t)((crc    >> (8 * i)) & 0xff);
+        block[header_size + deflatedlen + 4 + i] = (uint8_t)((srclen >> (8 * i)) & 0xff);
+    }
+#else
+    if (bgzf_compress(&dst[dst_size0], &blocklen, src, srclen, level) != 0) { return -1; }
+#endif
+    dst.resize(dst_size0 + blocklen);
+    return 0;
+}
+
+// Append one gzip member containing the uncompressed data to dst. 
+int gzip_member_compress(std::string &dst, const char *src, size_t srclen, int level, spike_workspace_t &ws) {
+    const size_t dst_size0 = dst.size();
+#ifdef USE_LIBDEFLATE
+    const size_t bound = libdeflate_gzip_compress_bound(ws.compressor, srclen);
+    dst.resize(dst_size0 + bound);
+    const size_t memberlen = libdeflate_gzip_compress(ws.compressor, src, srclen, &dst[dst_size0], bound);
+    if (0 == memberlen) { return -1; }
+    dst.resize(dst_size0 + memberlen);
+#else
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { return -1; }
+    const size_t bound = deflateBound(&zs, srclen);
+    dst.resize(dst_size0 + bound);
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = srclen;
+    zs.next_out = (Bytef*)&dst[dst_size0];
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) { return -1; }
+    dst.resize(dst_size0 + zs.total_out);
+#endif
+    return 0;
+}
+
+// Compress the FASTQ text of one batch into self-contained gzip members so that batches can be compressed by different threads 
+//   and then be concatenated in order. 
+int fastq_compress(std::string &dst, const std::string &src, fastq_format_t format, int level, spike_workspace_t &ws) {
+    if (FASTQ_FORMAT_PLAIN == format) {
+        dst.append(src);
+        return 0;
+    }
+#ifdef USE_LIBDEFLATE
+    if (NULL == ws.compressor) {
+        ws.compressor = libdeflate_alloc_compressor(level);
+        if (NULL == ws.compressor) { return -1; }
+    }
+#endif
+    if (FASTQ_FORMAT_GZIP == format) {
+        return gzip_member_compress(dst, src.data(), src.size(), level, ws);
+    }
+    for (size_t offset = 0; offset < src.size(); offset += BGZF_BLOCK_SIZE) {
+        if (bgzf_block_compress(dst, src.data() + offset, MIN(src.size() - offset, (size_t)BGZF_BLOCK_SIZE), level, ws) != 0) { return -1; }
+    }
+    return 0;
+}
+
+// 0 for unpaired, 1 for R1, and 2 for R2
+int bamrec_outidx(const bam1_t *aln) {
+    return ((aln->core.flag & 0x40) ? 1 : ((aln->core.flag & 0x80) ? 2 : 0));
+}
+
+// the fields used for spiking reads into FASTQ records, which are the only fields decoded from CRAM if the output BAM file is not set
+const int SPIKE_FASTQ_REQUIRED_FIELDS = SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_SEQ | SAM_QUAL | SAM_AUX;
+
+// The ways of calling the base of a spiked SNV (-x), where SPIKE_SNV_BQ_FROM_ARGS means checking -x at each spiked base. 
+enum spike_snv_bq_mode_t {
+    SPIKE_SNV_BQ_NO_ERROR, // -2
+    SPIKE_SNV_BQ_FROM_READ, // -1
+    SPIKE_SNV_BQ_FIXED,
+    SPIKE_SNV_BQ_FROM_ARGS,
+};
+
+static inline spike_snv_bq_mode_t spike_snv_bq_mode(int snv_bq_phred) {
+    return ((-2 == snv_bq_phred) ? SPIKE_SNV_BQ_NO_ERROR : ((-1 == snv_bq_phred) ? SPIKE_SNV_BQ_FROM_READ : SPIKE_SNV_BQ_FIXED));
+}
+
+// The smallest numerator k in [1, 0x1000000] such that prob2phred(k / 0x1000000) < phred for each phred in [0, 256), 
+//   where 0x1000000 means none. The probabilities from qnameqpos2prob are such fractions, so they are compared with base qualities exactly 
+//   without computing any logarithm. 
+static const uint32_t *phred_min_numerators() {
+    static const std::vector<uint32_t> numerators = [] {
+        std::vector<uint32_t> ret(256);
+        for (int phred = 0; phred < 256; phred++) {
+            uint32_t lo = 1, hi = 0x1000000; // prob2phred is non-increasing in the numerator
+            while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (prob2phred((double)mid / 0x1000000) < phred) { hi = mid; } else { lo = mid + 1; }
             }
+            ret[phred] = lo;
         }
-        while (is_var1_before_var2(vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_endpos(bam_rec))) {
-            if (vcf_read_ret != -1) {
-                fprintf(stderr, "The variant at tid %d pos %ld is before the read at tid %d endpos %ld, readname = %s\n", 
-                    vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_endpos(bam_rec), bam_get_qname(bam_rec));
-                vcf_read_ret = vcf_read(vcf_fp, vcf_hdr, vcf_rec); // get this variant
-                fprintf(stderr, "The new pushed variant is at tid %d pos %ld\n", 
-                    vcf_rec->rid, vcf_rec->pos);
-            }
-            if (vcf_read_ret < 0) { break; }
-            vcf_list.push_back(bcf_dup(vcf_rec));
-        }
-        while (vcf_list.size() > 0 && is_var1_before_var2(vcf_list.front()->rid, vcf_list.front()->pos, bam_rec->core.tid, bam_rec->core.pos)) {
-            fprintf(stderr, "The variant at tid %d pos %ld is destroyed\n", 
-                    vcf_list.front()->rid, vcf_list.front()->pos);
-            bcf_destroy(vcf_list.front());
-            vcf_list.pop_front();
-        }
-        
-        const auto *seq = bam_get_seq(bam_rec);
-        const auto *qual = bam_get_qual(bam_rec); 
-        newseq.clear();
-        newqual.clear();
-        
-        uint32_t umihash = 0;
-        const auto *bam_aux_data = bam_aux_get(bam_rec, "MI"); // this tag is reserved (https://samtools.github.io/hts-specs/SAMtags.pdf)
-        const char *umistr = ((bam_aux_data != NULL) ? bam_aux2Z(bam_aux_data) : bam_get_qname(bam_rec));
-        
-        // TODO: this assumes 100% duplex forming efficiency, which is not what happens in practice. 
-        // TODO: introduce another parameter to simulate the efficiency of duplex formation?
-        uint32_t begpos = MIN(bam_rec->core.pos, bam_rec->core.mpos);
-        const double mutprob = umistr2prob(umihash, randseed, begpos, begpos + abs(bam_rec->core.isize), umistr);
-        if (vcf_list.size() > 0) {
-            int qpos = 0;
-            int rpos = bam_rec->core.pos;
-            auto vcf_rec_it = vcf_list.begin();
-            int vcf_list_idx = 0;
-            for (int i = 0; i < bam_rec->core.n_cigar; i++) {
-                const auto c = bam_get_cigar(bam_rec)[i];
-                const auto cigar_op = bam_cigar_op(c);
-                const auto cigar_oplen = bam_cigar_oplen(c);
-                if (cigar_op == BAM_CMATCH || cigar_op == BAM_CEQUAL || cigar_op == BAM_CDIFF) {
-                    auto cigar_oplen1 = cigar_oplen;
-                    for (int j = 0; j < cigar_oplen1; j++) {
-                        while (vcf_rec_it != vcf_list.end() && is_var1_before_var2((*vcf_rec_it)->rid, (*vcf_rec_it)->pos, bam_rec->core.tid, rpos)) {
-                            vcf_rec_it++;
-                            vcf_list_idx++;
+        return ret;
+    }();
+    return numerators.data();
+}
+
+// The spiked base is a random one with the probability of the sequencing error of the base quality, which needs no hashing without errors. 
+// The generic kernel hashes the read name at each spiked base, whereas the specialized ones hash it once per read into qnamehash. 
+template <int SNV_BQ_MODE>
+static inline char spike_snv_base(const char alt, const bam1_t *bam_rec, const uint32_t qnamehash, const int qpos, const int bq, const spike_args_t &args) {
+    if (SPIKE_SNV_BQ_FROM_ARGS == SNV_BQ_MODE) {
+        if (-2 == args.snv_bq_phred) { return alt; }
+        uint32_t hash = 0;
+        double randprob = qnameqpos2prob(hash, args.randseed_basecall, bam_get_qname(bam_rec), qpos);
+        return ((prob2phred(randprob) < (-1 == args.snv_bq_phred ? bq : args.snv_bq_phred)) ? alt : ACGT[hash % 4]);
+    }
+    if (SPIKE_SNV_BQ_NO_ERROR == SNV_BQ_MODE) { return alt; }
+    const uint32_t hash = hashes2hash(args.randseed_basecall, qnamehash, qpos);
+    const uint32_t numerator = (hash & 0xffffff);
+    const int phred = (SPIKE_SNV_BQ_FROM_READ == SNV_BQ_MODE ? bq : args.snv_bq_phred);
+    const bool is_error_free = ((numerator > 0 && phred >= 0 && phred < 256) 
+            ? (numerator >= phred_min_numerators()[phred]) : (prob2phred((double)numerator / 0x1000000) < phred));
+    return (is_error_free ? alt : ACGT[hash % 4]);
+}
+
+// The variants in [vcf_recs_beg, vcf_recs_end) are read-only so that they can be shared across threads. 
+// The output of this function depends only on its input read and variants, which allows reads to be processed in any order. 
+// Return -1 if the read is unmapped or overlaps with no variant. Otherwise, 
+//   store the new sequence and quality (in the alignment orientation) into ws and return the SPIKED_* bits of the spiked variants. 
+// The options fixed for the whole run are template parameters so that each specialization has no branch on them in its per-base loop, 
+//   where IS_REPORTING and IS_INFO_LOGGED only allow (instead of force) the counting for the variant report and the INFO log. 
+template <int SNV_BQ_MODE, bool IS_REPORTING, bool IS_INFO_LOGGED>
+int bamrec_spike_kernel(
+        const bam1_t *bam_rec,
+        const spike_variant_t *const *vcf_recs_beg,
+        const spike_variant_t *const *vcf_recs_end,
+        const spike_args_t &args,
+        spike_stats_t &stats,
+        spike_workspace_t &ws) {
+    if ((0 != (bam_rec->core.flag & 0x4))) {
+        return -1;
+    }
+    int spiked = 0;
+    const auto *seq = bam_get_seq(bam_rec);
+    const auto *qual = bam_get_qual(bam_rec); 
+    auto &newseq = ws.newseq;
+    auto &newqual = ws.newqual;
+    newseq.clear();
+    newqual.clear();
+    // The spiked read is at most as long as the read plus the bases inserted by its variants, so its buffers are sized once per read 
+    //   instead of being regrown base by base, which matters for long reads. 
+    size_t max_newlen = bam_rec->core.l_qseq;
+    for (auto vcf_rec_it = vcf_recs_beg; vcf_rec_it != vcf_recs_end; vcf_rec_it++) {
+        if (VARIANT_TYPE_INS == (*vcf_rec_it)->type) { max_newlen += (*vcf_rec_it)->altlen - 1; }
+    }
+    newseq.reserve(max_newlen);
+    newqual.reserve(max_newlen);
+    
+    uint32_t umihash = 0;
+    const auto *bam_aux_data = bam_aux_get(bam_rec, "MI"); // this tag is reserved (https://samtools.github.io/hts-specs/SAMtags.pdf)
+    const char *umistr = ((bam_aux_data != NULL) ? bam_aux2Z(bam_aux_data) : bam_get_qname(bam_rec));
+    
+    // TODO: this assumes 100% duplex forming efficiency, which is not what happens in practice. 
+    // TODO: introduce another parameter to simulate the efficiency of duplex formation?
+    uint32_t begpos = MIN(bam_rec->core.pos, bam_rec->core.mpos);
+    const double mutprob = umistr2prob_cached(umihash, args.randseed, begpos, begpos + abs(bam_rec->core.isize), umistr, 
+            bam_rec->core.tid, bam_rec->core.pos, ws, stats);
+    if (vcf_recs_beg != vcf_recs_end) {
+        const bool is_qname_hashed = (SPIKE_SNV_BQ_FROM_READ == SNV_BQ_MODE || SPIKE_SNV_BQ_FIXED == SNV_BQ_MODE);
+        const uint32_t qnamehash = (is_qname_hashed ? __ac_X31_hash_string(bam_get_qname(bam_rec)) : 0);
+        int qpos = 0;
+        int rpos = bam_rec->core.pos;
+        auto vcf_rec_it = vcf_recs_beg;
+        for (int i = 0; i < bam_rec->core.n_cigar; i++) {
+            const auto c = bam_get_cigar(bam_rec)[i];
+            const auto cigar_op = bam_cigar_op(c);
+            const auto cigar_oplen = bam_cigar_oplen(c);
+            if (cigar_op == BAM_CMATCH || cigar_op == BAM_CEQUAL || cigar_op == BAM_CDIFF) {
+                auto cigar_oplen1 = cigar_oplen;
+                for (int j = 0; j < cigar_oplen1; j++) {
+                    // the next variant is usually not before rpos, otherwise it is found by binary search over the sorted variants
+                    if (vcf_rec_it != vcf_recs_end && is_var1_before_var2((*vcf_rec_it)->rid, (*vcf_rec_it)->pos, bam_rec->core.tid, rpos)) {
+                        vcf_rec_it = std::lower_bound(vcf_rec_it + 1, vcf_recs_end, rpos, [&](const spike_variant_t *variant, int rpos1) {
+                            return is_var1_before_var2(variant->rid, variant->pos, bam_rec->core.tid, rpos1);
+                        });
+                    }
+                    if (vcf_rec_it != vcf_recs_end && bam_rec->core.tid == (*vcf_rec_it)->rid && rpos == (*vcf_rec_it)->pos) {
+                        auto vcf_rec_it_end = vcf_rec_it;
+                        while (vcf_rec_it_end != vcf_recs_end && ((*vcf_rec_it_end)->rid == (*vcf_rec_it)->rid && (*vcf_rec_it_end)->pos == (*vcf_rec_it)->pos)) {
+                            vcf_rec_it_end++;
                         }
-                        if (vcf_rec_it != vcf_list.end() && rpos == (*vcf_rec_it)->pos) {
-                            auto vcf_rec_it_end = vcf_rec_it;
-                            auto vcf_list_idx_end = vcf_list_idx;
-                            while (vcf_rec_it_end != vcf_list.end() && ((*vcf_rec_it_end)->rid == (*vcf_rec_it)->rid && (*vcf_rec_it_end)->pos == (*vcf_rec_it)->pos)) {
-                                vcf_rec_it_end++;
-                                vcf_list_idx_end++;
+                        if (IS_REPORTING && args.variant_report != NULL) {
+                            for (auto vcf_rec_it2 = vcf_rec_it; vcf_rec_it2 != vcf_rec_it_end; vcf_rec_it2++) {
+                                __atomic_fetch_add(&(*vcf_rec_it2)->allelefracs[args.config_idx].n_covering_reads, 1, __ATOMIC_RELAXED);
                             }
-                            double allelefrac = (double)0;
-                            bool is_mutated = false;
+                        }
+                        bool is_mutated = false;
 for (auto vcf_rec_it2 = vcf_rec_it; vcf_rec_it2 != vcf_rec_it_end; vcf_rec_it2++) {
-                            const auto & vcf_rec = *vcf_rec_it2;
-                            bcf_unpack(vcf_rec, BCF_UN_ALL);
-                            int ndst_val = 0;
-                            int valsize = 0;
-                            if (is_FA_from_INFO) {
-                                valsize = bcf_get_info_float(vcf_hdr, vcf_rec, tagFA, &bcffloats, &ndst_val);
-                                allelefrac += (valsize > 0 ? bcffloats[valsize - 1] : defallelefrac);
-                            } else {
-                                valsize = bcf_get_format_float(vcf_hdr, vcf_rec, tagFA, &bcffloats, &ndst_val);
-                                allelefrac += ((valsize > 0 && valsize == bcf_hdr_nsamples(vcf_hdr)) ? bcffloats[tag_sample_idx] : defallelefrac);
-                            }
-                            
-                            double allelefrac2 = allelefrac;
-                            if (powerlaw_exponent > 0) {
-                                allelefrac2 = allelefrac_powlaw_transform(
-                                    allelefrac,
-                                    (uint32_t)(vcf_rec->rid),
-                                    (uint32_t)(rpos),
-                                    (uint32_t)samplehash1,
-                                    (uint32_t)samplehash2,
-                                    powerlaw_exponent);
-                            }
-                            double allelefrac3 = allelefrac2;
-                            if (lognormal_disp > 0) {
-                                allelefrac3 = allelefrac_lognormal_transform(
-                                    allelefrac2,
-                                    (uint32_t)(vcf_rec->rid),
-                                    (uint32_t)(rpos),
-                                    (uint32_t)samplehash1,
-                                    (uint32_t)samplehash2,
-                                    lnsigma);
-                            }
-                            if (mutprob <= allelefrac3) {
-                                const char *newref = vcf_rec->d.allele[0];
-                                const char *newalt = vcf_rec->d.allele[1];
-                                if (1 == strlen(newref) && 1 == strlen(newalt)) {
-                                    uint32_t hash = 0;
-                                    double randprob = qnameqpos2prob(hash, randseed_basecall, bam_get_qname(bam_rec), qpos);
-                                    const char base = ((-2 == snv_bq_phred)
-                                            || (prob2phred(randprob) < (-1 == snv_bq_phred ? qual[qpos] : snv_bq_phred)) 
-                                            ? (newalt[0]) : (ACGT[hash % 4]));
-                                    newseq.push_back(base);
-                                    newqual.push_back(qual[qpos]);
-                                    num_kept_snv++;
-                                    if (ispowerof2(num_kept_snv) || is_always_log) { 
-                                        fprintf(stderr, "The read with name %s is spiked with the snv-variant at tid %d pos %ld, FAs = %f,%f,%f\n", 
-                                                bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos, allelefrac, allelefrac2, allelefrac3);
-                                    }
-                                } else if (strlen(newref) == strlen(newalt)) {
-                                    fprintf(stderr, "Warning: the MNV at tid %d pos %ld is decomposed into SNV and only the first SNV is simulated\n", 
-                                            bam_rec->core.tid, bam_rec->core.pos);
-                                    uint32_t hash = 0;
-                                    double randprob = qnameqpos2prob(hash, randseed_basecall, bam_get_qname(bam_rec), qpos);
-                                    const char base = ((-2 == snv_bq_phred)
-                                            || (prob2phred(randprob) < (-1 == snv_bq_phred ? qual[qpos] : snv_bq_phred)) 
-                                            ? (newalt[0]) : (ACGT[hash % 4]));
-                                    newseq.push_back(base);
-                                    newqual.push_back(qual[qpos]);
-                                    num_kept_mnv++;
-                                } else if (strlen(newref) == 1 && strlen(newalt) >  1) {
-                                    for (int k = 0; k < strlen(newalt); k++) { 
-                                        newseq.push_back(newalt[k]);
-                                    }
+                        const auto & vcf_rec = *vcf_rec_it2;
+                        const double allelefrac = vcf_rec->allelefracs[args.config_idx].allelefrac;
+                        const double allelefrac2 = vcf_rec->allelefracs[args.config_idx].allelefrac2;
+                        const double allelefrac3 = vcf_rec->allelefracs[args.config_idx].allelefrac3;
+                        if (mutprob <= allelefrac3) {
+                            const char *newalt = vcf_rec->alt;
+                            if (VARIANT_TYPE_SNV == vcf_rec->type) {
+                                newseq.push_back(spike_snv_base<SNV_BQ_MODE>(newalt[0], bam_rec, qnamehash, qpos, qual[qpos], args));
+                                newqual.push_back(qual[qpos]);
+                                stats.num_kept_snv++;
+                                spiked |= SPIKED_SUBSTITUTION;
+                                if (IS_INFO_LOGGED) { LOG_SAMPLED(LOG_LEVEL_INFO, stats.num_kept_snv, "The read with name %s is spiked with the snv-variant at tid %d pos %ld, FAs = %f,%f,%f\n", 
+                                        bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos, allelefrac, allelefrac2, allelefrac3); }
+                            } else if (VARIANT_TYPE_MNV == vcf_rec->type) {
+                                LOG_SAMPLED(LOG_LEVEL_WARN, stats.num_kept_mnv + 1, "Warning: the MNV at tid %d pos %ld is decomposed into SNV and only the first SNV is simulated\n", 
+                                        bam_rec->core.tid, bam_rec->core.pos);
+                                newseq.push_back(spike_snv_base<SNV_BQ_MODE>(newalt[0], bam_rec, qnamehash, qpos, qual[qpos], args));
+                                newqual.push_back(qual[qpos]);
+                                stats.num_kept_mnv++;
+                                spiked |= SPIKED_SUBSTITUTION;
+                            } else if (VARIANT_TYPE_INS == vcf_rec->type) {
+                                for (int k = 0; k < vcf_rec->altlen; k++) { 
+                                    newseq.push_back(newalt[k]);
+                                }
+                                newqual.push_back(qual[qpos]);
+                                for (int k = 1; k < vcf_rec->altlen; k++) { 
+                                    newqual.push_back((char)(args.ins_bq_phred)); 
+                                }
+                                stats.num_kept_ins++;
+                                spiked |= SPIKED_INDEL;
+                                if (IS_INFO_LOGGED) { LOG_SAMPLED(LOG_LEVEL_INFO, stats.num_kept_ins, "The read with name %s is spiked with the ins-variant at tid %d pos %ld\n", 
+                                        bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); }
+                            } else if (VARIANT_TYPE_DEL == vcf_rec->type) {
+                                if (vcf_rec->reflen + j < cigar_oplen1) {
+                                    const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
+                                    newseq.push_back(nuc);
                                     newqual.push_back(qual[qpos]);
-                                    for (int k = 1; k < strlen(newalt); k++) { 
-                                        newqual.push_back((char)(ins_bq_phred)); 
-                                    }
-                                    num_kept_ins++;
-                                    if (ispowerof2(num_kept_ins) || is_always_log) { fprintf(stderr, "The read with name %s is spiked with the ins-variant at tid %d pos %ld\n", 
-                                                bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); }
-                                } else if (strlen(newref) >  1 && strlen(newalt) == 1) {
-                                    if (strlen(newref) + j < cigar_oplen1) {
-                                        const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
-                                        newseq.push_back(nuc);
-                                        newqual.push_back(qual[qpos]);
-                                        j += strlen(newref) - 1;
-                                        qpos += strlen(newref) - 1;
-                                        rpos += strlen(newref) - 1;
-                                        num_kept_del++;
-                                        if (ispowerof2(num_kept_del) || is_always_log) { fprintf(stderr, "The read with name %s is spiked with the del-variant at tid %d pos %ld\n", 
-                                                bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); }
-                                    } else {
-                                        newseq.push_back(seq_nt16_str[bam_seqi(seq, qpos)]);
-                                        newqual.push_back(qual[qpos]);
-                                    }
+                                    j += vcf_rec->reflen - 1;
+                                    qpos += vcf_rec->reflen - 1;
+                                    rpos += vcf_rec->reflen - 1;
+                                    stats.num_kept_del++;
+                                    spiked |= SPIKED_INDEL;
+                                    if (IS_INFO_LOGGED) { LOG_SAMPLED(LOG_LEVEL_INFO, stats.num_kept_del, "The read with name %s is spiked with the del-variant at tid %d pos %ld\n", 
+                                            bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); }
                                 } else {
-                                    fprintf(stderr, "The variant at tid %d pos %ld failed to be processed!\n", bam_rec->core.tid, bam_rec->core.pos);
+                                    newseq.push_back(seq_nt16_str[bam_seqi(seq, qpos)]);
+                                    newqual.push_back(qual[qpos]);
                                 }
-                                num_kept_reads++;
-                                is_mutated = true;
-                                break;
                             } else {
-                                if (ispowerof2(num_skip_reads) || is_always_log) {
-                                    fprintf(stderr, "The read with name %s is not affected by the variant at tid %d pos %ld\n", 
-                                    bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); 
-                                }
+                                LOG_AT(LOG_LEVEL_ERROR, "The variant at tid %d pos %ld failed to be processed!\n", bam_rec->core.tid, bam_rec->core.pos);
                             }
-}
-                            if (!is_mutated) {
-                                const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
-                                newseq.push_back(nuc);
-                                newqual.push_back(qual[qpos]);
-                                num_skip_reads++;
+                            stats.num_kept_reads++;
+                            if (IS_REPORTING && args.variant_report != NULL) {
+                                __atomic_fetch_add(&vcf_rec->allelefracs[args.config_idx].n_spiked_reads, 1, __ATOMIC_RELAXED);
                             }
+                            is_mutated = true;
+                            break;
                         } else {
+                            if (IS_INFO_LOGGED) { LOG_SAMPLED(LOG_LEVEL_INFO, stats.num_skip_reads, "The read with name %s is not affected by the variant at tid %d pos %ld\n", 
+                                    bam_get_qname(bam_rec), vcf_rec->rid, vcf_rec->pos); }
+                        }
+}
+                        if (!is_mutated) {
                             const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
                             newseq.push_back(nuc);
                             newqual.push_back(qual[qpos]);
-                            num_skip_cmatches++;
+                            stats.num_skip_reads++;
                         }
-                        qpos++;
-                        rpos++;
-                    }
-                } else if ((cigar_op == BAM_CINS) || (cigar_op == BAM_CSOFT_CLIP)) {
-                    for (int j = 0; j < cigar_oplen; j++) {
-                        const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
-                        newseq.push_back(seq_nt16_str[bam_seqi(seq, qpos)]);
-                        newqual.push_back(qual[qpos]);
-                        qpos++;
+                    } else {
+                        // the bases up to the next variant (or up to the end of this cigar operation) are copied at once
+                        const int64_t next_var_pos = ((vcf_rec_it != vcf_recs_end && bam_rec->core.tid == (*vcf_rec_it)->rid) 
+                                ? (int64_t)(*vcf_rec_it)->pos : (int64_t)rpos + cigar_oplen1);
+                        const int n_bases = (int)MIN((int64_t)cigar_oplen1 - j, next_var_pos - rpos);
+                        nt16_decode_append(newseq, seq, qpos, n_bases);
+                        newqual.append((const char*)(qual + qpos), n_bases);
+                        stats.num_skip_cmatches += n_bases;
+                        j += n_bases - 1;
+                        qpos += n_bases - 1;
+                        rpos += n_bases - 1;
                     }
-                } else if (cigar_op == BAM_CDEL) {
-                    rpos += cigar_oplen;
-                } else if (cigar_op == BAM_CHARD_CLIP) {
-                    // fall through
-                } else {
-                    fprintf(stderr, "The cigar code %d is invalid at tid %d pos %ld for read %s!\n", 
-                            cigar_op, bam_rec->core.tid, bam_rec->core.pos, bam_get_qname(bam_rec));
-                    abort();
+                    qpos++;
+                    rpos++;
+                }
+            } else if ((cigar_op == BAM_CINS) || (cigar_op == BAM_CSOFT_CLIP)) {
+                for (int j = 0; j < cigar_oplen; j++) {
+                    const char nuc = seq_nt16_str[bam_seqi(seq, qpos)];
+                    newseq.push_back(seq_nt16_str[bam_seqi(seq, qpos)]);
+                    newqual.push_back(qual[qpos]);
+                    qpos++;
                 }
+            } else if (cigar_op == BAM_CDEL) {
+                rpos += cigar_oplen;
+            } else if (cigar_op == BAM_CHARD_CLIP) {
+                // fall through
+            } else {
+                fprintf(stderr, "The cigar code %d is invalid at tid %d pos %ld for read %s!\n", 
+                        cigar_op, bam_rec->core.tid, bam_rec->core.pos, bam_get_qname(bam_rec));
+                abort();
             }
-            if (outfname != NULL) { bamrec_write_fastq(bam_rec, newseq, newqual, outfile); }
-        } else {
-            if (outfname != NULL) { bamrec_write_fastq_raw(bam_rec, outfile); } 
         }
+        if (spiked) { stats.num_mutated_reads++; }
+        return spiked;
+    } else {
+        return -1;
     }
-    if (bcffloats != NULL) {
-        free(bcffloats);
+}
+
+typedef int (*spike_kernel_t)(const bam1_t*, const spike_variant_t *const*, const spike_variant_t *const*, const spike_args_t&, spike_stats_t&, spike_workspace_t&);
+
+// indexed by spike_args_t::kernel_idx
+const spike_kernel_t SPIKE_KERNELS[] = {
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FROM_ARGS, true, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_NO_ERROR, false, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_NO_ERROR, false, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_NO_ERROR, true, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_NO_ERROR, true, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FROM_READ, false, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FROM_READ, false, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FROM_READ, true, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FROM_READ, true, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FIXED, false, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FIXED, false, true>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FIXED, true, false>,
+    bamrec_spike_kernel<SPIKE_SNV_BQ_FIXED, true, true>,
+};
+
+// Select the specialization of bamrec_spike once all the options of args and the verbosity of the log are set. 
+void spike_args_set_kernel(spike_args_t &args) {
+    args.kernel_idx = 1 + (int)spike_snv_bq_mode(args.snv_bq_phred) * 4 + (args.variant_report != NULL ? 2 : 0) + (LOG_IS_ENABLED(LOG_LEVEL_INFO) ? 1 : 0);
+}
+
+static inline int bamrec_spike(
+        const bam1_t *bam_rec,
+        const spike_variant_t *const *vcf_recs_beg,
+        const spike_variant_t *const *vcf_recs_end,
+        const spike_args_t &args,
+        spike_stats_t &stats,
+        spike_workspace_t &ws) {
+    return SPIKE_KERNELS[args.kernel_idx](bam_rec, vcf_recs_beg, vcf_recs_end, args, stats, ws);
+}
+
+// The variants of a read start with the next variant at or after the start of the read, 
+//   so the read overlaps no variant if this next variant is at or after the end of the read. 
+// Such a read is written as is without looking up and hashing its UMI. 
+static inline bool bamrec_is_passthrough(
+        const bam1_t *bam_rec,
+        const spike_variant_t *const *vcf_recs_beg,
+        const spike_variant_t *const *vcf_recs_end) {
+    return (vcf_recs_beg == vcf_recs_end) 
+            || (0 != (bam_rec->core.flag & 0x4)) 
+            || (*vcf_recs_beg)->rid != bam_rec->core.tid 
+            || (*vcf_recs_beg)->pos >= bam_endpos(bam_rec);
+}
+
+void bamrec_spike_and_write(
+        const bam1_t *bam_rec,
+        const spike_variant_t *const *vcf_recs_beg,
+        const spike_variant_t *const *vcf_recs_end,
+        const spike_args_t &args,
+        spike_stats_t &stats,
+        spike_workspace_t &ws,
+        std::string *outstr) {
+    const int spiked = bamrec_spike(bam_rec, vcf_recs_beg, vcf_recs_end, args, stats, ws);
+    if (outstr != NULL) {
+        const int64_t beg_ns = (args.is_profiling ? clock_ns(CLOCK_MONOTONIC) : 0);
+        if (spiked >= 0) {
+            bamrec_write_fastq(bam_rec, ws.newseq, ws.newqual, *outstr);
+        } else {
+            bamrec_write_fastq_raw(bam_rec, *outstr);
+        }
+        if (args.is_profiling) { ws.substage_wall_ns += clock_ns(CLOCK_MONOTONIC) - beg_ns; }
     }
+}
+
+// Edit the sequence of the read in place to newseq which must have the same length as the original sequence, 
+//   and then update the MD and NM tags accordingly. Return the number of edited bases. 
+// If the MD tag is absent, then the edited bases are assumed to match the reference before editing. 
+int bamrec_edit_seq(bam1_t *aln, const std::string &newseq) {
+    assert(newseq.size() == aln->core.l_qseq);
+    uint8_t *seq = bam_get_seq(aln);
+    const uint32_t *cigar = bam_get_cigar(aln);
     
-    bam_destroy1(bam_rec1);
-    bam_hdr_destroy(bam_hdr);
-    sam_close(bam_fp);
-    
-    bcf_destroy1(vcf_rec);
-    bcf_hdr_destroy(vcf_hdr);
-    vcf_close(vcf_fp);
+    // the reference bases covered by the M and D cigar operations, where '=' means the same as the read base before editing
+    std::string mdref;
+    const uint8_t *md_data = bam_aux_get(aln, "MD");
+    const char *md = ((md_data != NULL) ? bam_aux2Z(md_data) : NULL);
+    if (md != NULL) {
+        bool is_md_valid = true;
+        for (const char *p = md; *p && is_md_valid; ) {
+            if (isdigit(*p)) {
+                char *pend = NULL;
+                mdref.append(strtol(p, &pend, 10), '=');
+                p = pend;
+            } else if ('^' == *p) {
+                for (p++; isalpha(*p); p++) { mdref.push_back(toupper(*p)); }
+            } else if (isalpha(*p)) {
+                mdref.push_back(toupper(*p));
+                p++;
+            } else {
+                is_md_valid = false;
+            }
+        }
+        size_t mdlen = 0;
+        for (int i = 0; i < aln->core.n_cigar; i++) {
+            const auto op = bam_cigar_op(cigar[i]);
+            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF || op == BAM_CDEL) { mdlen += bam_cigar_oplen(cigar[i]); }
+        }
+        if (!is_md_valid || mdlen != mdref.size()) {
+            LOG_WARN("Warning: the MD tag %s of the read %s is inconsistent with its CIGAR, so the MD tag is kept as is\n", md, bam_get_qname(aln));
+            mdref.clear();
+            md = NULL;
+        }
+    }
+    int n_edits = 0;
+    int nm_diff = 0;
+    int qpos = 0;
+    size_t mdpos = 0;
+    for (int i = 0; i < aln->core.n_cigar; i++) {
+        const auto op = bam_cigar_op(cigar[i]);
+        const auto oplen = bam_cigar_oplen(cigar[i]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+            for (int j = 0; j < oplen; j++, qpos++, mdpos++) {
+                const char oldbase = seq_nt16_str[bam_seqi(seq, qpos)];
+                const char newbase = toupper(newseq[qpos]);
+                if (oldbase == newbase) { continue; }
+                bam_set_seqi(seq, qpos, seq_nt16_table[(uint8_t)newbase]);
+                n_edits++;
+                if (md != NULL) {
+                    const char refbase = (('=' == mdref[mdpos]) ? oldbase : mdref[mdpos]);
+                    nm_diff += (int)(newbase != refbase) - (int)('=' != mdref[mdpos]);
+                    mdref[mdpos] = ((newbase == refbase) ? '=' : refbase);
+                } else {
+                    nm_diff++;
+                }
+            }
+        } else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) {
+            qpos += oplen;
+        } else if (op == BAM_CDEL) {
+            mdpos += oplen;
+        }
+    }
+    if (md != NULL && n_edits > 0) {
+        std::string newmd;
+        int nmatches = 0;
+        mdpos = 0;
+        for (int i = 0; i < aln->core.n_cigar; i++) {
+            const auto op = bam_cigar_op(cigar[i]);
+            const auto oplen = bam_cigar_oplen(cigar[i]);
+            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+                for (int j = 0; j < oplen; j++, mdpos++) {
+                    if ('=' == mdref[mdpos]) {
+                        nmatches++;
+                    } else {
+                        newmd.append(std::to_string(nmatches));
+                        newmd.push_back(mdref[mdpos]);
+                        nmatches = 0;
+                    }
+                }
+            } else if (op == BAM_CDEL) {
+                newmd.append(std::to_string(nmatches));
+                newmd.push_back('^');
+                newmd.append(mdref, mdpos, oplen);
+                mdpos += oplen;
+                nmatches = 0;
+            }
+        }
+        newmd.append(std::to_string(nmatches));
+        bam_aux_update_str(aln, "MD", newmd.size() + 1, newmd.c_str());
+    }
+    const uint8_t *nm_data = bam_aux_get(aln, "NM");
+    if (nm_data != NULL && nm_diff != 0) {
+        bam_aux_update_int(aln, "NM", bam_aux2i(nm_data) + nm_diff);
+    }
+    return n_edits;
+}
+
+// A shard consists of the reads overlapping [beg, end) on the contig tid but starting at or after min_pos, and the variants overlapping with these reads, 
+//   where min_pos is beg unless the reads starting before beg do not belong to any previous shard. 
+// The shard with tid equal to HTS_IDX_NOCOOR consists of the unmapped reads without any coordinate. 
+// A rescue shard consists of only the mates rescued for the target regions (see target_mates_t). 
+typedef struct {
+    int tid;
+    hts_pos_t beg;
+    hts_pos_t end;
+    hts_pos_t min_pos;
+    bool is_rescue;
+} spike_shard_t;
+
+// The readers publish their progress once per batch, and the progress thread prints it every interval_sec seconds, 
+//   so that the sweep never checks per read whether it is time to report. 
+// The fraction done is estimated from the compressed offset in the input BAM file, or from the finished shards in the shard-parallel mode. 
+typedef struct spike_progress_t {
+    std::atomic<int64_t> num_reads;
+    std::atomic<int64_t> compressed_offset; // -1 if the input is not BGZF-compressed
+    std::atomic<int32_t> tid;
+    std::atomic<int64_t> pos;
+    std::atomic<int64_t> num_done_shards;
+    int64_t num_shards; // zero if the shards are not processed in parallel
+    int64_t file_size; // zero if unknown (for example, the standard input)
+    const sam_hdr_t *bam_hdr;
+    int interval_sec;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool is_stopping;
+    std::thread thread;
+} spike_progress_t;
+
+void spike_progress_print(spike_progress_t &progress, double elapsed_sec) {
+    const int64_t num_reads = progress.num_reads.load(std::memory_order_relaxed);
+    const int64_t offset = progress.compressed_offset.load(std::memory_order_relaxed);
+    const int32_t tid = progress.tid.load(std::memory_order_relaxed);
+    const int64_t pos = progress.pos.load(std::memory_order_relaxed);
+    double frac = -1;
+    if (progress.num_shards > 0) {
+        frac = (double)progress.num_done_shards.load(std::memory_order_relaxed) / progress.num_shards;
+    } else if (progress.file_size > 0 && offset >= 0) {
+        frac = MIN(1.0, (double)offset / progress.file_size);
+    }
+    std::string where = "*";
+    if (tid >= 0 && tid < sam_hdr_nref(progress.bam_hdr)) {
+        where = std::string(sam_hdr_tid2name(progress.bam_hdr, tid)) + ":" + std::to_string(pos + 1);
+    }
+    std::string input_rate;
+    if (0 == progress.num_shards && offset >= 0) {
+        input_rate = ", " + std::to_string((int64_t)(offset / elapsed_sec / 1e3)) + " KB per second of input";
+    }
+    if (frac > 0) {
+        LOG_INFO("Progress: %ld reads in %.0f seconds (%.0f reads per second%s) at %s, %.2f%% done, ETA %.0f seconds\n", 
+                num_reads, elapsed_sec, num_reads / elapsed_sec, input_rate.c_str(), where.c_str(), frac * 100, elapsed_sec * (1 - frac) / frac);
+    } else {
+        LOG_INFO("Progress: %ld reads in %.0f seconds (%.0f reads per second%s) at %s, ETA unknown\n", 
+                num_reads, elapsed_sec, num_reads / elapsed_sec, input_rate.c_str(), where.c_str());
+    }
+}
+
+void spike_progress_run(spike_progress_t *progress) {
+    const int64_t beg_ns = clock_ns(CLOCK_MONOTONIC);
+    std::unique_lock<std::mutex> lock(progress->mutex);
+    while (!progress->cond.wait_for(lock, std::chrono::seconds(progress->interval_sec), [&] { return progress->is_stopping; })) {
+        spike_progress_print(*progress, MAX(clock_ns(CLOCK_MONOTONIC) - beg_ns, (int64_t)1) / 1e9);
+    }
+}
+
+void spike_progress_start(spike_progress_t &progress, const sam_hdr_t *bam_hdr, int64_t file_size, int64_t num_shards, int interval_sec) {
+    progress.num_reads = 0;
+    progress.compressed_offset = -1;
+    progress.tid = -1;
+    progress.pos = -1;
+    progress.num_done_shards = 0;
+    progress.num_shards = num_shards;
+    progress.file_size = file_size;
+    progress.bam_hdr = bam_hdr;
+    progress.interval_sec = interval_sec;
+    progress.is_stopping = false;
+    progress.thread = std::thread(spike_progress_run, &progress);
+}
+
+void spike_progress_stop(spike_progress_t &progress) {
+    {
+        std::lock_guard<std::mutex> lock(progress.mutex);
+        progress.is_stopping = true;
+    }
+    progress.cond.notify_all();
+    progress.thread.join();
+}
+
+// the state of the merge sweep over the coordinate-sorted BAM and VCF
+typedef struct {
+    samFile *bam_fp;
+    sam_hdr_t *bam_hdr;
+    htsFile *vcf_fp;
+    bcf_hdr_t *vcf_hdr;
+    bcf1_t *vcf_rec;
+    int vcf_read_ret;
+    int64_t vcf_rec_voffset; // the voffset of vcf_rec (see spike_variant_t) if the VCF file is swept without the index
+    std::deque<spike_variant_t*> vcf_list;
+    // The retired variants are returned here by spike_batch_reclaim and reused with their buffers by the variants entering the sweep, 
+    //   so that no variant is allocated once the sweep window stops growing. 
+    std::vector<spike_variant_t*> vcf_pool;
+    uint64_t vcf_list_beg_idx; // number of variants that have ever been popped from vcf_list
+    bool is_keeping_all_reads; // if true, then the secondary and supplementary alignments are also kept to be copied to the output BAM
+    const std::vector<spike_args_t> *configs; // the first configuration also holds the arguments shared by all configurations
+    float *bcffloats;
+    int32_t last_rid; // the position of the last variant entering vcf_list
+    hts_pos_t last_pos;
+    std::vector<double> last_allelefracs;
+    std::vector<double> last_allelefracs3;
+    // The shards are swept one after another using the indexes. No shard means sweeping the whole BAM and VCF files. 
+    std::vector<spike_shard_t> shards;
+    size_t shard_idx;
+    hts_idx_t *bam_idx;
+    hts_idx_t *vcf_idx; // for BCF
+    tbx_t *vcf_tbx; // for bgzipped VCF
+    hts_itr_t *bam_itr;
+    hts_itr_t *vcf_itr;
+    kstring_t vcf_line;
+    // the spike plan that is read instead of the VCF file if mapped, where [plan_idx, plan_end) are the variants not read yet
+    spike_plan_t plan;
+    uint64_t plan_idx;
+    uint64_t plan_end;
+    const spike_plan_variant_t *plan_variant; // the last variant read from the spike plan
+    std::deque<bam1_t*> bam_lookahead; // the leading records already read for the sample hashes, which are read again by the sweep
+    // If targets is not NULL, then only the reads overlapping the targets are spiked, and the other reads are passed through unchanged. 
+    // The reads not overlapping the targets are all visited if is_off_target_kept, otherwise the shards are made of the targets followed by the rescue shards of mates. 
+    const target_regions_t *targets;
+    bool is_off_target_kept;
+    target_mates_t target_mates;
+    bool is_rescue_sharded;
+    spike_stats_t stats; // the decode and variant-lookup times measured by the reader
+} spike_reader_t;
+
+void spike_reader_init(spike_reader_t &reader, const std::vector<spike_args_t> *configs) {
+    reader.bam_fp = NULL;
+    reader.bam_hdr = NULL;
+    reader.vcf_fp = NULL;
+    reader.vcf_hdr = NULL;
+    reader.vcf_rec = bcf_init();
+    reader.vcf_rec->rid = -1;
+    reader.vcf_rec->pos = 0;
+    reader.vcf_read_ret = 0;
+    reader.vcf_rec_voffset = 0;
+    reader.vcf_list_beg_idx = 0;
+    reader.is_keeping_all_reads = false;
+    reader.configs = configs;
+    reader.bcffloats = NULL;
+    reader.last_rid = -1;
+    reader.last_pos = -1;
+    reader.shard_idx = 0;
+    reader.bam_idx = NULL;
+    reader.vcf_idx = NULL;
+    reader.vcf_tbx = NULL;
+    reader.bam_itr = NULL;
+    reader.vcf_itr = NULL;
+    reader.vcf_line = {0, 0, NULL};
+    reader.plan.addr = NULL;
+    reader.plan_idx = 0;
+    reader.plan_end = 0;
+    reader.plan_variant = NULL;
+    reader.targets = NULL;
+    reader.is_off_target_kept = false;
+    reader.is_rescue_sharded = false;
+}
+
+// The reference is used for decoding CRAM, and required_fields (zero means all fields) lets CRAM skip decoding the other fields. 
+void spike_reader_open_vcf(spike_reader_t &reader, const char *invcf) {
+    if (spike_plan_is_plan(invcf)) {
+        spike_plan_open(reader.plan, invcf);
+        reader.plan_end = reader.plan.header->n_variants;
+    } else {
+        reader.vcf_fp = vcf_open(invcf, "r");
+        if (NULL == reader.vcf_fp || NULL == (reader.vcf_hdr = bcf_hdr_read(reader.vcf_fp))) {
+            fprintf(stderr, "Failed to open the VCF file %s for reading\n", invcf);
+            abort();
+        }
+    }
+}
+
+void spike_reader_open(spike_reader_t &reader, const char *inbam, const char *invcf, const char *reference, int required_fields, htsThreadPool *tpool) {
+    spike_reader_open_vcf(reader, invcf);
+    reader.bam_fp = sam_open(inbam, "r");
+    if (NULL == reader.bam_fp) {
+        fprintf(stderr, "Failed to open the BAM file %s for reading\n", inbam);
+        abort();
+    }
+    if (reference != NULL && hts_set_opt(reader.bam_fp, CRAM_OPT_REFERENCE, reference) != 0) {
+        fprintf(stderr, "Failed to set the reference %s for the file %s\n", reference, inbam);
+        abort();
+    }
+    if (required_fields != 0) {
+        hts_set_opt(reader.bam_fp, CRAM_OPT_REQUIRED_FIELDS, required_fields);
+    }
+    if (NULL == (reader.bam_hdr = sam_hdr_read(reader.bam_fp))) {
+        fprintf(stderr, "Failed to read the header of the BAM file %s\n", inbam);
+        abort();
+    }
+    if (tpool != NULL && tpool->pool != NULL) {
+        hts_set_opt(reader.bam_fp, HTS_OPT_THREAD_POOL, tpool);
+        if (reader.vcf_fp != NULL) { hts_set_opt(reader.vcf_fp, HTS_OPT_THREAD_POOL, tpool); }
+    }
+}
+
+void spike_reader_load_index(spike_reader_t &reader, const char *inbam, const char *invcf) {
+    reader.bam_idx = sam_index_load(reader.bam_fp, inbam);
+    if (NULL == reader.bam_idx) {
+        fprintf(stderr, "Failed to load the index of the BAM file %s\n", inbam);
+        abort();
+    }
+    if (reader.plan.addr != NULL) { return; } // the spike plan is sorted and thus needs no index
+    if (bcf == hts_get_format(reader.vcf_fp)->format) {
+        reader.vcf_idx = bcf_index_load(invcf);
+    } else {
+        reader.vcf_tbx = tbx_index_load(invcf);
+    }
+    if (NULL == reader.vcf_idx && NULL == reader.vcf_tbx) {
+        fprintf(stderr, "Failed to load the index of the VCF file %s\n", invcf);
+        abort();
+    }
+}
+
+void spike_reader_close(spike_reader_t &reader) {
+    if (reader.bam_itr != NULL) { hts_itr_destroy(reader.bam_itr); }
+    if (reader.vcf_itr != NULL) { hts_itr_destroy(reader.vcf_itr); }
+    if (reader.bam_idx != NULL) { hts_idx_destroy(reader.bam_idx); }
+    if (reader.vcf_idx != NULL) { hts_idx_destroy(reader.vcf_idx); }
+    if (reader.vcf_tbx != NULL) { tbx_destroy(reader.vcf_tbx); }
+    free(reader.vcf_line.s);
+    for (auto *bam_rec : reader.bam_lookahead) {
+        bam_destroy1(bam_rec);
+    }
+    reader.bam_lookahead.clear();
+    for (auto *variant : reader.vcf_list) {
+        spike_variant_retire(variant, reader.configs->at(0));
+        delete variant;
+    }
+    reader.vcf_list.clear();
+    for (auto *variant : reader.vcf_pool) {
+        delete variant;
+    }
+    reader.vcf_pool.clear();
+    free(reader.bcffloats);
+    bcf_destroy(reader.vcf_rec);
+    if (reader.bam_fp != NULL) {
+        bam_hdr_destroy(reader.bam_hdr);
+        sam_close(reader.bam_fp);
+    }
+    if (reader.vcf_fp != NULL) {
+        bcf_hdr_destroy(reader.vcf_hdr);
+        vcf_close(reader.vcf_fp);
+    }
+    spike_plan_close(reader.plan);
+}
+
+// Start sweeping the shard at shard_idx, where the variants of the previous shard are retired into the batch. 
+void spike_reader_open_shard(spike_reader_t &reader, std::vector<spike_variant_t*> &vcf_retired) {
+    for (auto *variant : reader.vcf_list) {
+        vcf_retired.push_back(variant);
+        reader.vcf_list_beg_idx++;
+    }
+    reader.vcf_list.clear();
+    reader.vcf_rec->rid = -1;
+    reader.vcf_rec->pos = 0;
+    reader.vcf_read_ret = 0;
+    reader.last_rid = -1;
+    reader.last_pos = -1;
+    if (reader.bam_itr != NULL) { hts_itr_destroy(reader.bam_itr); }
+    if (reader.vcf_itr != NULL) { hts_itr_destroy(reader.vcf_itr); }
+    reader.bam_itr = NULL;
+    reader.vcf_itr = NULL;
+    reader.plan_idx = 0;
+    reader.plan_end = 0;
+    // the sweep over the shards seeks with the index, so the leading records are read again from the BAM file if needed
+    for (auto *bam_rec : reader.bam_lookahead) {
+        bam_destroy1(bam_rec);
+    }
+    reader.bam_lookahead.clear();
     
-    gzclose(r0file);
-    gzclose(r1file);
-    gzclose(r2file);
+    const spike_shard_t &shard = reader.shards[reader.shard_idx];
+    reader.bam_itr = sam_itr_queryi(reader.bam_idx, shard.tid, shard.beg, shard.end);
+    if (NULL == reader.bam_itr) {
+        fprintf(stderr, "Failed to query the region tid %d [%ld, %ld) in the BAM file\n", shard.tid, shard.beg, shard.end);
+        abort();
+    }
+    if (HTS_IDX_NOCOOR == shard.tid) { return; }
+    // the variants after the end of the shard are still needed for the reads starting before the end of the shard
+    const char *tname = sam_hdr_tid2name(reader.bam_hdr, shard.tid);
+    if (reader.plan.addr != NULL) {
+        spike_plan_query(reader.plan, tname, shard.min_pos, reader.plan_idx, reader.plan_end);
+    } else if (reader.vcf_idx != NULL) {
+        const int vcf_tid = bcf_hdr_name2id(reader.vcf_hdr, tname);
+        if (vcf_tid >= 0) { reader.vcf_itr = bcf_itr_queryi(reader.vcf_idx, vcf_tid, shard.min_pos, HTS_POS_MAX); }
+    } else {
+        const int vcf_tid = tbx_name2id(reader.vcf_tbx, tname);
+        if (vcf_tid >= 0) { reader.vcf_itr = tbx_itr_queryi(reader.vcf_tbx, vcf_tid, shard.min_pos, HTS_POS_MAX); }
+    }
+}
+
+int spike_reader_read_bam(spike_reader_t &reader, bam1_t *bam_rec) {
+    if (0 == reader.shards.size()) {
+        if (reader.bam_lookahead.size() > 0) {
+            bam1_t *lookahead_rec = reader.bam_lookahead.front();
+            reader.bam_lookahead.pop_front();
+            if (NULL == bam_copy1(bam_rec, lookahead_rec)) {
+                fprintf(stderr, "Failed to copy the BAM record %s\n", bam_get_qname(lookahead_rec));
+                abort();
+            }
+            bam_destroy1(lookahead_rec);
+            return 0;
+        }
+        return sam_read1(reader.bam_fp, reader.bam_hdr, bam_rec);
+    }
+    const spike_shard_t &shard = reader.shards[reader.shard_idx];
+    int ret = 0;
+    while ((ret = sam_itr_next(reader.bam_fp, reader.bam_itr, bam_rec)) >= 0) {
+        // the reads starting before the shard belong to the previous shard
+        if (HTS_IDX_NOCOOR != shard.tid && bam_rec->core.pos < shard.min_pos) { continue; }
+        if (NULL == reader.targets || reader.is_off_target_kept) { break; }
+        if (!shard.is_rescue) {
+            target_mates_add(reader.target_mates, *reader.targets, bam_rec);
+            break;
+        }
+        if (target_mates_is_rescued(reader.target_mates, *reader.targets, bam_rec)) {
+            reader.stats.num_rescued_mates++;
+            break;
+        }
+    }
+    return ret;
+}
+
+// Append the rescue shards of the mates outside the targets after the last shard of the targets has been swept. 
+// Return false if there is no mate to rescue or the mates were already rescued. 
+bool spike_reader_push_rescue_shards(spike_reader_t &reader) {
+    if (NULL == reader.targets || reader.is_off_target_kept || reader.is_rescue_sharded) { return false; }
+    reader.is_rescue_sharded = true;
+    const size_t n_shards = reader.shards.size();
+    const auto intervals = target_mates_intervals(reader.target_mates, reader.targets->intervals.size(), TARGET_MATES_MAX_GAP);
+    for (size_t tid = 0; tid < intervals.size(); tid++) {
+        for (const auto & interval : intervals[tid]) {
+            spike_shard_t shard = {(int)tid, interval.first, interval.second, interval.first, true};
+            reader.shards.push_back(shard);
+        }
+    }
+    return reader.shards.size() > n_shards;
+}
+
+// The position of the next variant in the VCF file (or in the spike plan) swept without the index
+int64_t spike_reader_vcf_tell(const spike_reader_t &reader) {
+    if (reader.plan.addr != NULL) { return reader.plan_idx; }
+    return (reader.vcf_fp->is_bgzf ? bgzf_tell(reader.vcf_fp->fp.bgzf) : -1);
+}
+
+int spike_reader_read_vcf(spike_reader_t &reader) {
+    if (reader.plan.addr != NULL) {
+        if (reader.plan_idx >= reader.plan_end) { return -1; }
+        reader.vcf_rec_voffset = reader.plan_idx;
+        reader.plan_variant = &reader.plan.variants[reader.plan_idx++];
+        reader.vcf_rec->rid = reader.plan_variant->rid;
+        reader.vcf_rec->pos = reader.plan_variant->pos;
+        return 0;
+    }
+    if (0 == reader.shards.size()) {
+        reader.vcf_rec_voffset = spike_reader_vcf_tell(reader);
+        return vcf_read(reader.vcf_fp, reader.vcf_hdr, reader.vcf_rec);
+    }
+    if (NULL == reader.vcf_itr) {
+        return -1;
+    }
+    if (reader.vcf_idx != NULL) {
+        return bcf_itr_next(reader.vcf_fp, reader.vcf_itr, reader.vcf_rec);
+    }
+    const int ret = tbx_itr_next(reader.vcf_fp, reader.vcf_tbx, reader.vcf_itr, &reader.vcf_line);
+    if (ret < 0) { return ret; }
+    return vcf_parse1(&reader.vcf_line, reader.vcf_hdr, reader.vcf_rec);
+}
+
+// The sample hashes are computed from the names of the leading niters1 and niters2 records of the BAM file, 
+//   which are kept in the look-ahead buffer so that the BAM file is opened only once (and can thus be a stream). 
+// Return the number of records used for the sample hashes. 
+uint64_t spike_reader_samplehashes(spike_reader_t &reader, uint32_t niters1, uint32_t niters2, uint32_t &samplehash1, uint32_t &samplehash2) {
+    samplehash1 = 0;
+    samplehash2 = 0;
+    uint64_t read_cnt = 0;
+    while (read_cnt < MAX(niters1, niters2)) {
+        bam1_t *bam_rec = bam_init1();
+        if (sam_read1(reader.bam_fp, reader.bam_hdr, bam_rec) < 0) {
+            bam_destroy1(bam_rec);
+            break;
+        }
+        if (read_cnt < niters1) { 
+            samplehash1 += __ac_X31_hash_string(bam_get_qname(bam_rec));
+        }
+        if (read_cnt < niters2) { 
+            samplehash2 += __ac_X31_hash_string(bam_get_qname(bam_rec));
+        }
+        reader.bam_lookahead.push_back(bam_rec);
+        read_cnt += 1;
+    }
+    return read_cnt;
+}
+
+// A batch of reads together with the variants that overlap with these reads. 
+// The variants popped from the sweep while filling this batch are destroyed only after this batch is written, 
+// because the variants are shared with the batches that are still being processed. 
+typedef struct {
+    uint64_t seqnum;
+    std::vector<bam1_t*> bam_recs;
+    size_t n_bam_recs = 0;
+    std::vector<spike_variant_t*> vcf_recs;
+    std::vector<std::pair<size_t, size_t>> vcf_ranges; // the variants of the i-th read in vcf_recs
+    std::vector<spike_variant_t*> vcf_retired;
+    std::vector<spike_variant_t*> vcf_free; // the retired variants already reported, which are reclaimed by the reader when it fills this batch again
+    std::vector<std::string> outstrs; // three (R0, R1, and R2) per configuration
+    std::vector<std::string> outbufs; // compressed outstrs
+    int n_pending_writes = 0;
+} spike_batch_t;
+
+// Move the variants freed by the last recycling of the batch to the pool of the reader, which owns the batch while calling this function. 
+void spike_batch_reclaim(spike_batch_t &batch, spike_reader_t &reader) {
+    reader.vcf_pool.insert(reader.vcf_pool.end(), batch.vcf_free.begin(), batch.vcf_free.end());
+    batch.vcf_free.clear();
+}
+
+void spike_batch_destroy(spike_batch_t &batch) {
+    for (auto *bam_rec : batch.bam_recs) {
+        bam_destroy1(bam_rec);
+    }
+    batch.bam_recs.clear();
+    for (auto *variant : batch.vcf_free) {
+        delete variant;
+    }
+    batch.vcf_free.clear();
+}
+
+void spike_reader_push_variant(spike_reader_t &reader, spike_batch_t &batch) {
+    spike_variant_t *variant = NULL;
+    if (reader.vcf_pool.size() > 0) {
+        variant = reader.vcf_pool.back();
+        reader.vcf_pool.pop_back();
+        variant->allelefracs.clear();
+    } else {
+        variant = new spike_variant_t();
+    }
+    bool is_FA_found = false;
+    double vcf_allelefrac = 0;
+    if (reader.plan.addr != NULL) {
+        const spike_plan_variant_t *plan_variant = reader.plan_variant;
+        variant->rid = plan_variant->rid;
+        variant->pos = plan_variant->pos;
+        variant->reflen = plan_variant->reflen;
+        variant->alt = reader.plan.alts + plan_variant->alt_offset;
+        variant->altlen = plan_variant->altlen;
+        variant->type = (spike_variant_type_t)plan_variant->type;
+        is_FA_found = (0 != plan_variant->is_allelefrac_found);
+        vcf_allelefrac = plan_variant->allelefrac;
+    } else {
+        bcf1_t *vcf_rec = reader.vcf_rec;
+        bcf_unpack(vcf_rec, BCF_UN_ALL);
+        variant->rid = vcf_rec->rid;
+        variant->pos = vcf_rec->pos;
+        variant->reflen = strlen(vcf_rec->d.allele[0]);
+        variant->altbuf = ((vcf_rec->n_allele > 1) ? vcf_rec->d.allele[1] : "");
+        variant->alt = variant->altbuf.c_str();
+        variant->altlen = variant->altbuf.size();
+        variant->type = spike_variant_type(variant->reflen, variant->altlen);
+        const spike_args_t &args = reader.configs->at(0);
+        is_FA_found = vcf_rec_get_allelefrac(vcf_allelefrac, reader.vcf_hdr, vcf_rec, args.tagFA, args.is_FA_from_INFO, args.tag_sample_idx, &reader.bcffloats);
+    }
+    const bool is_same_pos = (reader.last_rid == variant->rid && reader.last_pos == variant->pos);
+    reader.last_allelefracs.resize(reader.configs->size(), 0);
+    reader.last_allelefracs3.resize(reader.configs->size(), 0);
+    for (const auto & config : *reader.configs) {
+        const double requested = (is_FA_found ? vcf_allelefrac : config.defallelefrac);
+        double allelefrac = (is_same_pos ? reader.last_allelefracs[config.config_idx] : (double)0);
+        allelefrac += requested;
+        double allelefrac2 = allelefrac;
+        if (config.powerlaw_exponent > 0) {
+            allelefrac2 = allelefrac_powlaw_transform(
+                allelefrac,
+                (uint32_t)(variant->rid),
+                (uint32_t)(variant->pos),
+                (uint32_t)config.samplehash1,
+                (uint32_t)config.samplehash2,
+                config.powerlaw_exponent);
+        }
+        double allelefrac3 = allelefrac2;
+        if (config.lognormal_disp > 0) {
+            allelefrac3 = allelefrac_lognormal_transform(
+                allelefrac2,
+                (uint32_t)(variant->rid),
+                (uint32_t)(variant->pos),
+                (uint32_t)config.samplehash1,
+                (uint32_t)config.samplehash2,
+                config.lnsigma);
+        }
+        const double target = allelefrac3 - (is_same_pos ? reader.last_allelefracs3[config.config_idx] : (double)0);
+        spike_allelefracs_t allelefracs = {allelefrac, allelefrac2, allelefrac3, requested, target, 0, 0};
+        variant->allelefracs.push_back(allelefracs);
+        reader.last_allelefracs[config.config_idx] = allelefrac;
+        reader.last_allelefracs3[config.config_idx] = allelefrac3;
+    }
+    reader.last_rid = variant->rid;
+    reader.last_pos = variant->pos;
+    variant->voffset = reader.vcf_rec_voffset;
     
-    fprintf(stderr, "In total: kept %ld read support, skipped %ld read support"
-            ", and skipped %ld no-variant CMATCH cigars.\n", num_kept_reads, num_skip_reads, num_skip_cmatches);
-    fprintf(stderr, "Kept %ld snv read support\n", num_kept_snv);
-    fprintf(stderr, "Kept %ld mnv read support\n", num_kept_mnv);
-    fprintf(stderr, "Kept %ld insertion read support\n", num_kept_ins);
-    fprintf(stderr, "Kept %ld deletion read support\n", num_kept_del);
+    reader.vcf_list.push_back(variant);
+    batch.vcf_recs.push_back(variant);
+}
+
+// Advance the sweep to the mapped primary read and append the range of the variants of the read to batch, 
+//   where the variant with the index vcf_recs_beg_idx in the sweep is the first one of batch.vcf_recs. 
+void spike_batch_sweep(spike_batch_t &batch, spike_reader_t &reader, const bam1_t *bam_rec, uint64_t vcf_recs_beg_idx) {
+    auto &vcf_list = reader.vcf_list;
+    auto *vcf_rec = reader.vcf_rec;
+    while (1) {
+        if (reader.vcf_read_ret != -1) {
+            LOG_DEBUG("The variant at tid %d pos %ld is before the read at tid %d pos %ld, readname = %s\n", 
+                vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_rec->core.pos, bam_get_qname(bam_rec));
+            reader.vcf_read_ret = spike_reader_read_vcf(reader); // skip this variant
+            LOG_DEBUG("The new prep variant is at tid %d pos %ld\n", 
+                vcf_rec->rid, vcf_rec->pos);
+        }
+        if (reader.vcf_read_ret < 0) { break; }
+        if (!is_var1_before_var2(vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_rec->core.pos)) {
+            spike_reader_push_variant(reader, batch);
+            break;
+        }
+    }
+    while (is_var1_before_var2(vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_endpos(bam_rec))) {
+        if (reader.vcf_read_ret != -1) {
+            LOG_DEBUG("The variant at tid %d pos %ld is before the read at tid %d endpos %ld, readname = %s\n", 
+                vcf_rec->rid, vcf_rec->pos, bam_rec->core.tid, bam_endpos(bam_rec), bam_get_qname(bam_rec));
+            reader.vcf_read_ret = spike_reader_read_vcf(reader); // get this variant
+            LOG_DEBUG("The new pushed variant is at tid %d pos %ld\n", 
+                vcf_rec->rid, vcf_rec->pos);
+        }
+        if (reader.vcf_read_ret < 0) { break; }
+        spike_reader_push_variant(reader, batch);
+    }
+    while (vcf_list.size() > 0 && is_var1_before_var2(vcf_list.front()->rid, vcf_list.front()->pos, bam_rec->core.tid, bam_rec->core.pos)) {
+        LOG_DEBUG("The variant at tid %d pos %ld is destroyed\n", 
+                vcf_list.front()->rid, vcf_list.front()->pos);
+        batch.vcf_retired.push_back(vcf_list.front());
+        vcf_list.pop_front();
+        reader.vcf_list_beg_idx++;
+    }
+    const size_t vcf_range_beg = reader.vcf_list_beg_idx - vcf_recs_beg_idx;
+    batch.vcf_ranges.push_back(std::make_pair(vcf_range_beg, vcf_range_beg + vcf_list.size()));
+}
+
+size_t spike_batch_fill(spike_batch_t &batch, spike_reader_t &reader, size_t batch_size) {
+    auto &vcf_list = reader.vcf_list;
+    spike_batch_reclaim(batch, reader);
+    batch.n_bam_recs = 0;
+    batch.vcf_ranges.clear();
+    batch.vcf_recs.assign(vcf_list.begin(), vcf_list.end());
+    const uint64_t vcf_recs_beg_idx = reader.vcf_list_beg_idx;
+    const bool is_profiling = reader.configs->at(0).is_profiling;
+    const spike_clock_t beg_clock = (is_profiling ? spike_clock_now() : spike_clock_t());
+    int64_t lookup_wall_ns = 0;
+    while (batch.n_bam_recs < batch_size) {
+        if (batch.n_bam_recs == batch.bam_recs.size()) {
+            batch.bam_recs.push_back(bam_init1());
+        }
+        bam1_t *bam_rec = batch.bam_recs[batch.n_bam_recs];
+        if (spike_reader_read_bam(reader, bam_rec) < 0) {
+            if (reader.shard_idx + 1 >= reader.shards.size() && !spike_reader_push_rescue_shards(reader)) { break; }
+            reader.shard_idx++;
+            spike_reader_open_shard(reader, batch.vcf_retired);
+            continue;
+        }
+        reader.stats.num_input_reads++;
+        if ((0 != (bam_rec->core.flag & 0x900)) && (0 == (bam_rec->core.flag & 0x4)) && !reader.is_keeping_all_reads) { continue; }
+        if ((0 != (bam_rec->core.flag & 0x4)) || (0 != (bam_rec->core.flag & 0x900))
+                || (reader.targets != NULL && !target_regions_overlap_read(*reader.targets, bam_rec))) {
+            batch.vcf_ranges.push_back(std::make_pair(0, 0));
+            batch.n_bam_recs++;
+            continue;
+        }
+        const int64_t lookup_beg_ns = (is_profiling ? clock_ns(CLOCK_MONOTONIC) : 0);
+        spike_batch_sweep(batch, reader, bam_rec, vcf_recs_beg_idx);
+        if (is_profiling) {
+            lookup_wall_ns += clock_ns(CLOCK_MONOTONIC) - lookup_beg_ns;
+            reader.stats.max_variant_window = MAX(reader.stats.max_variant_window, (int64_t)vcf_list.size());
+        }
+        batch.n_bam_recs++;
+    }
+    if (is_profiling) {
+        spike_stats_add_split_time(reader.stats, SPIKE_STAGE_DECODE, SPIKE_STAGE_VARIANT_LOOKUP, beg_clock, lookup_wall_ns);
+    }
+    spike_progress_t *progress = reader.configs->at(0).progress;
+    if (progress != NULL && batch.n_bam_recs > 0) {
+        const bam1_t *last_rec = batch.bam_recs[batch.n_bam_recs - 1];
+        progress->num_reads.fetch_add(batch.n_bam_recs, std::memory_order_relaxed);
+        progress->tid.store(last_rec->core.tid, std::memory_order_relaxed);
+        progress->pos.store(last_rec->core.pos, std::memory_order_relaxed);
+        if (reader.bam_fp->is_bgzf) {
+            progress->compressed_offset.store(bgzf_tell(reader.bam_fp->fp.bgzf) >> 16, std::memory_order_relaxed);
+        }
+    }
+    return batch.n_bam_recs;
 }
 
+// In the BAM-output mode, the reads spiked with only SNVs/MNVs are edited in place, 
+//   and the reads spiked with indels are flagged with 0x200 (not passing quality controls) and written to the R0 FASTQ file, 
+//   so that they are aligned again as single-end reads without their mates, which may be written before them and are not spiked. 
+// The secondary and supplementary alignments are only flagged with 0x200, because their primary alignments (which may be edited) 
+//   are not known when they are written, so the alignments without 0x200 never disagree on the bases of the same read. 
+void spike_batch_process_bam(spike_batch_t &batch, const spike_args_t &args, spike_stats_t &stats, spike_workspace_t &ws) {
+    for (size_t i = 0; i < batch.n_bam_recs; i++) {
+        bam1_t *bam_rec = batch.bam_recs[i];
+        if ((0 != (bam_rec->core.flag & 0x900)) && (0 == (bam_rec->core.flag & 0x4))) {
+            bam_rec->core.flag |= 0x200;
+            stats.num_flagged_bam_alns++;
+            continue;
+        }
+        const auto *vcf_recs_beg = batch.vcf_recs.data() + batch.vcf_ranges[i].first;
+        const auto *vcf_recs_end = batch.vcf_recs.data() + batch.vcf_ranges[i].second;
+        if (bamrec_is_passthrough(bam_rec, vcf_recs_beg, vcf_recs_end)) {
+            stats.num_passthrough_reads++;
+            continue;
+        }
+        const int spiked = bamrec_spike(bam_rec, vcf_recs_beg, vcf_recs_end, args, stats, ws);
+        if (spiked > 0 && (spiked & SPIKED_INDEL)) {
+            if (args.is_outfile_set[0]) { bamrec_write_fastq(bam_rec, ws.newseq, ws.newqual, batch.outstrs[0]); }
+            bam_rec->core.flag |= 0x200;
+            stats.num_indel_bam_reads++;
+        } else if (spiked > 0) {
+            bamrec_edit_seq(bam_rec, ws.newseq);
+            stats.num_edited_bam_reads++;
+        }
+    }
+}
+
+// Each read is decoded only once and then spiked with each configuration while the read is still in cache. 
+void spike_batch_process(spike_batch_t &batch, const std::vector<spike_args_t> &configs, spike_stats_t &stats, spike_workspace_t &ws) {
+    const spike_args_t &args = configs[0];
+    batch.outstrs.resize(configs.size() * 3);
+    batch.outbufs.resize(configs.size() * 3);
+    const spike_clock_t beg_clock = (args.is_profiling ? spike_clock_now() : spike_clock_t());
+    ws.substage_wall_ns = 0;
+    if (args.is_bam_output) {
+        spike_batch_process_bam(batch, args, stats, ws);
+    } else {
+        for (size_t i = 0; i < batch.n_bam_recs; i++) {
+            const bam1_t *bam_rec = batch.bam_recs[i];
+            const int outidx = bamrec_outidx(bam_rec);
+            const auto *vcf_recs_beg = batch.vcf_recs.data() + batch.vcf_ranges[i].first;
+            const auto *vcf_recs_end = batch.vcf_recs.data() + batch.vcf_ranges[i].second;
+            const bool is_passthrough = bamrec_is_passthrough(bam_rec, vcf_recs_beg, vcf_recs_end);
+            for (const auto & config : configs) {
+                std::string *outstr = (config.is_outfile_set[outidx] ? &batch.outstrs[config.config_idx * 3 + outidx] : NULL);
+                if (is_passthrough) {
+                    if (outstr != NULL) { 
+                        const int64_t beg_ns = (args.is_profiling ? clock_ns(CLOCK_MONOTONIC) : 0);
+                        bamrec_write_fastq_raw(bam_rec, *outstr); 
+                        if (args.is_profiling) { ws.substage_wall_ns += clock_ns(CLOCK_MONOTONIC) - beg_ns; }
+                    }
+                    stats.num_passthrough_reads++;
+                } else {
+                    bamrec_spike_and_write(bam_rec, vcf_recs_beg, vcf_recs_end, config, stats, ws, outstr);
+                }
+            }
+        }
+    }
+    if (args.is_profiling) {
+        spike_stats_add_split_time(stats, SPIKE_STAGE_MUTATION, SPIKE_STAGE_FORMATTING, beg_clock, ws.substage_wall_ns);
+    }
+    const spike_clock_t compression_beg_clock = (args.is_profiling ? spike_clock_now() : spike_clock_t());
+    for (size_t outidx = 0; outidx < (args.is_mate_paired ? 1 : batch.outstrs.size()); outidx++) {
+        if (batch.outstrs[outidx].size() > 0) {
+            if (fastq_compress(batch.outbufs[outidx], batch.outstrs[outidx], args.fastq_format, args.fastq_level, ws) != 0) {
+                fprintf(stderr, "Failed to compress %lu bytes of FASTQ records\n", batch.outstrs[outidx].size());
+                abort();
+            }
+            batch.outstrs[outidx].clear();
+        }
+    }
+    if (args.is_profiling) {
+        spike_stats_add_time(stats, SPIKE_STAGE_COMPRESSION, compression_beg_clock);
+    }
+}
+
+size_t spike_batch_write(spike_batch_t &batch, int outidx, FILE *outfile) {
+    std::string &outbuf = batch.outbufs[outidx];
+    size_t ret = 0;
+    if (outfile != NULL && outbuf.size() > 0) {
+        ret = fwrite(outbuf.data(), 1, outbuf.size(), outfile);
+        if (ret != outbuf.size()) {
+            fprintf(stderr, "Failed to write %lu bytes of compressed FASTQ records\n", outbuf.size());
+            abort();
+        }
+    }
+    outbuf.clear();
+    return ret;
+}
+
+void spike_batch_write_bam(spike_batch_t &batch, samFile *outbam_fp, const sam_hdr_t *outbam_hdr) {
+    for (size_t i = 0; i < batch.n_bam_recs; i++) {
+        const bam1_t *bam_rec = batch.bam_recs[i];
+        if (sam_write1(outbam_fp, outbam_hdr, bam_rec) < 0) {
+            fprintf(stderr, "Failed to write the read %s at tid %d pos %ld to the output BAM file\n", bam_get_qname(bam_rec), bam_rec->core.tid, bam_rec->core.pos);
+            abort();
+        }
+    }
+}
+
+void spike_batch_recycle(spike_batch_t &batch, const spike_args_t &args) {
+    for (auto *variant : batch.vcf_retired) {
+        spike_variant_retire(variant, args);
+    }
+    batch.vcf_free.insert(batch.vcf_free.end(), batch.vcf_retired.begin(), batch.vcf_retired.end());
+    batch.vcf_retired.clear();
+    batch.vcf_recs.clear();
+    batch.n_bam_recs = 0;
+}
+
+size_t fastq_compress_and_write(std::string &outstr, FILE *outfile, const spike_args_t &args, spike_workspace_t &ws) {
+    std::string outbuf;
+    if (fastq_compress(outbuf, outstr, args.fastq_format, args.fastq_level, ws) != 0) {
+        fprintf(stderr, "Failed to compress %lu bytes of FASTQ records\n", outstr.size());
+        abort();
+    }
+    outstr.clear();
+    if (outbuf.size() > 0 && fwrite(outbuf.data(), 1, outbuf.size(), outfile) != outbuf.size()) {
+        fprintf(stderr, "Failed to write %lu bytes of compressed FASTQ records\n", outbuf.size());
+        abort();
+    }
+    return outbuf.size();
+}
+
+// The mates whose other mates have not been seen yet are kept in a hash table keyed by QNAME. 
+// Both mates are written together once the second mate arrives, so that the R1 and R2 outputs are in the same order. 
+// If the buffered mates take more than max_bytes of memory, then they are sorted by QNAME and spilled into a temporary run file. 
+// The runs are merged at the end, and the mates that are still unpaired after the merge (orphans) go to the R0 output. 
+typedef struct {
+    std::unordered_map<std::string, std::pair<int, std::string>> mates; // QNAME -> (outidx, FASTQ record)
+    size_t n_bytes = 0;
+    size_t max_bytes = 0;
+    std::string run_prefix;
+    std::vector<std::string> run_fnames;
+    std::string outstrs[3];
+    FILE *outfiles[3] = {NULL, NULL, NULL};
+    spike_workspace_t ws;
+    int64_t num_pairs = 0;
+    int64_t num_orphans = 0;
+} mate_pairer_t;
+
+void mate_pairer_emit_pair(mate_pairer_t &pairer, const spike_args_t &args, const std::string &r1rec, const std::string &r2rec) {
+    pairer.outstrs[1].append(r1rec);
+    pairer.outstrs[2].append(r2rec);
+    pairer.num_pairs++;
+    if (pairer.outstrs[1].size() + pairer.outstrs[2].size() >= MATE_PAIRER_FLUSH_SIZE) {
+        fastq_compress_and_write(pairer.outstrs[1], pairer.outfiles[1], args, pairer.ws);
+        fastq_compress_and_write(pairer.outstrs[2], pairer.outfiles[2], args, pairer.ws);
+    }
+}
+
+void mate_pairer_emit_orphan(mate_pairer_t &pairer, const spike_args_t &args, const std::string &rec) {
+    pairer.num_orphans++;
+    if (NULL == pairer.outfiles[0]) { return; }
+    pairer.outstrs[0].append(rec);
+    if (pairer.outstrs[0].size() >= MATE_PAIRER_FLUSH_SIZE) {
+        fastq_compress_and_write(pairer.outstrs[0], pairer.outfiles[0], args, pairer.ws);
+    }
+}
+
+void mate_pairer_spill(mate_pairer_t &pairer) {
+    std::vector<const std::pair<const std::string, std::pair<int, std::string>>*> sorted_mates;
+    sorted_mates.reserve(pairer.mates.size());
+    for (const auto & mate : pairer.mates) {
+        sorted_mates.push_back(&mate);
+    }
+    std::sort(sorted_mates.begin(), sorted_mates.end(), [](const auto *a, const auto *b) {
+        return a->first < b->first;
+    });
+    std::string run_fname = pairer.run_prefix + std::to_string(pairer.run_fnames.size()) + ".tmp.gz";
+    gzFile run_file = gzopen(run_fname.c_str(), "wb1");
+    if (NULL == run_file) {
+        fprintf(stderr, "Failed to open the temporary file %s for writing\n", run_fname.c_str());
+        abort();
+    }
+    // each mate is stored as its outidx digit followed by its FASTQ record
+    for (const auto *mate : sorted_mates) {
+        if (gzputc(run_file, '0' + mate->second.first) < 0 
+                || gzwrite(run_file, mate->second.second.data(), mate->second.second.size()) != (int)mate->second.second.size()) {
+            fprintf(stderr, "Failed to write to the temporary file %s\n", run_fname.c_str());
+            abort();
+        }
+    }
+    if (gzclose(run_file) != Z_OK) {
+        fprintf(stderr, "Failed to close the temporary file %s\n", run_fname.c_str());
+        abort();
+    }
+    LOG_INFO("Spilled %lu unpaired mates taking %lu bytes into the temporary file %s\n", 
+            pairer.mates.size(), pairer.n_bytes, run_fname.c_str());
+    pairer.run_fnames.push_back(run_fname);
+    pairer.mates.clear();
+    pairer.n_bytes = 0;
+}
+
+void mate_pairer_add(mate_pairer_t &pairer, const spike_args_t &args, int outidx, const char *rec, size_t reclen) {
+    const char *qname_end = (const char*)memchr(rec, '\n', reclen);
+    std::string qname(rec + 1, qname_end - rec - 1);
+    auto mate_it = pairer.mates.find(qname);
+    if (mate_it != pairer.mates.end()) {
+        std::string &mate_rec = mate_it->second.second;
+        if (mate_it->second.first != outidx) {
+            std::string newrec(rec, reclen);
+            if (1 == outidx) { 
+                mate_pairer_emit_pair(pairer, args, newrec, mate_rec); 
+            } else {
+                mate_pairer_emit_pair(pairer, args, mate_rec, newrec);
+            }
+            pairer.n_bytes -= qname.size() + mate_rec.size();
+            pairer.mates.erase(mate_it);
+            return;
+        }
+        // the same mate is seen twice, so the one seen earlier becomes an orphan
+        mate_pairer_emit_orphan(pairer, args, mate_rec);
+        pairer.n_bytes -= qname.size() + mate_rec.size();
+        pairer.mates.erase(mate_it);
+    }
+    pairer.n_bytes += qname.size() + reclen;
+    pairer.mates.insert(std::make_pair(qname, std::make_pair(outidx, std::string(rec, reclen))));
+    if (pairer.n_bytes > pairer.max_bytes) {
+        mate_pairer_spill(pairer);
+    }
+}
+
+// The R1 and R2 FASTQ records of each batch have to be added in the batch order to keep the output deterministic. 
+void mate_pairer_add_batch(mate_pairer_t &pairer, const spike_args_t &args, spike_batch_t &batch) {
+    for (int outidx = 1; outidx < 3; outidx++) {
+        const std::string &outstr = batch.outstrs[outidx];
+        size_t rec_beg = 0;
+        while (rec_beg < outstr.size()) {
+            size_t rec_end = rec_beg;
+            for (int nlines = 0; nlines < 4; nlines++) {
+                rec_end = outstr.find('\n', rec_end) + 1;
+            }
+            mate_pairer_add(pairer, args, outidx, outstr.data() + rec_beg, rec_end - rec_beg);
+            rec_beg = rec_end;
+        }
+        batch.outstrs[outidx].clear();
+    }
+}
+
+bool gzgetline(gzFile file, std::string &line) {
+    char buf[1024 * 4];
+    line.clear();
+    while (gzgets(file, buf, sizeof(buf)) != NULL) {
+        line.append(buf);
+        if (line.back() == '\n') { return true; }
+    }
+    return line.size() > 0;
+}
+
+// read the next mate from the run file into (outidx, rec) and return its QNAME, or return the empty string at the end of the run file
+std::string mate_pairer_read_run(gzFile run_file, int &outidx, std::string &rec) {
+    int c = gzgetc(run_file);
+    if (c < 0) { return std::string(""); }
+    outidx = c - '0';
+    rec.clear();
+    std::string line;
+    for (int nlines = 0; nlines < 4; nlines++) {
+        if (!gzgetline(run_file, line)) {
+            fprintf(stderr, "The temporary file of unpaired mates is truncated\n");
+            abort();
+        }
+        rec.append(line);
+    }
+    return rec.substr(1, rec.find('\n') - 1);
+}
+
+// Merge the spilled runs with the mates in memory, then write out all remaining records. 
+void mate_pairer_finish(mate_pairer_t &pairer, const spike_args_t &args) {
+    if (pairer.run_fnames.size() > 0 && pairer.mates.size() > 0) {
+        mate_pairer_spill(pairer);
+    }
+    if (pairer.run_fnames.size() > 0) {
+        std::vector<gzFile> run_files;
+        std::vector<std::pair<int, std::string>> run_heads(pairer.run_fnames.size());
+        typedef std::pair<std::string, size_t> qname_runidx_t;
+        std::priority_queue<qname_runidx_t, std::vector<qname_runidx_t>, std::greater<qname_runidx_t>> heap;
+        for (size_t i = 0; i < pairer.run_fnames.size(); i++) {
+            run_files.push_back(gzopen(pairer.run_fnames[i].c_str(), "rb"));
+            if (NULL == run_files[i]) {
+                fprintf(stderr, "Failed to open the temporary file %s for reading\n", pairer.run_fnames[i].c_str());
+                abort();
+            }
+            std::string qname = mate_pairer_read_run(run_files[i], run_heads[i].first, run_heads[i].second);
+            if (qname.size() > 0) { heap.push(std::make_pair(qname, i)); }
+        }
+        bool has_prev = false;
+        std::string prev_qname;
+        std::pair<int, std::string> prev_mate;
+        while (heap.size() > 0) {
+            const qname_runidx_t top = heap.top();
+            heap.pop();
+            std::pair<int, std::string> &mate = run_heads[top.second];
+            if (has_prev && prev_qname == top.first && prev_mate.first != mate.first) {
+                if (1 == prev_mate.first) {
+                    mate_pairer_emit_pair(pairer, args, prev_mate.second, mate.second);
+                } else {
+                    mate_pairer_emit_pair(pairer, args, mate.second, prev_mate.second);
+                }
+                has_prev = false;
+            } else {
+                if (has_prev) { mate_pairer_emit_orphan(pairer, args, prev_mate.second); }
+                prev_qname = top.first;
+                prev_mate = mate;
+                has_prev = true;
+            }
+            std::string qname = mate_pairer_read_run(run_files[top.second], mate.first, mate.second);
+            if (qname.size() > 0) { heap.push(std::make_pair(qname, top.second)); }
+        }
+        if (has_prev) { mate_pairer_emit_orphan(pairer, args, prev_mate.second); }
+        for (size_t i = 0; i < pairer.run_fnames.size(); i++) {
+            gzclose(run_files[i]);
+            remove(pairer.run_fnames[i].c_str());
+        }
+    } else {
+        std::vector<std::string> qnames;
+        for (const auto & mate : pairer.mates) {
+            qnames.push_back(mate.first);
+        }
+        std::sort(qnames.begin(), qnames.end());
+        for (const auto & qname : qnames) {
+            mate_pairer_emit_orphan(pairer, args, pairer.mates[qname].second);
+        }
+        pairer.mates.clear();
+    }
+    for (int outidx = 0; outidx < 3; outidx++) {
+        if (pairer.outfiles[outidx] != NULL) {
+            fastq_compress_and_write(pairer.outstrs[outidx], pairer.outfiles[outidx], args, pairer.ws);
+        }
+    }
+    spike_workspace_destroy(pairer.ws);
+    LOG_INFO("Paired %ld R1/R2 mates and found %ld mates without their other mates%s\n", pairer.num_pairs, pairer.num_orphans, 
+            (NULL == pairer.outfiles[0] ? " (which are discarded because the R0 output is not specified)" : ""));
+}
+
+// An ordered writer of either one output FASTQ file, both R1 and R2 in the mate-paired mode (if pairer is not NULL), or the output BAM. 
+typedef struct {
+    int outidx;
+    FILE *outfile;
+    mate_pairer_t *pairer;
+    samFile *outbam_fp;
+    const sam_hdr_t *outbam_hdr;
+    spike_stats_t stats; // the write time measured by this writer
+} spike_writer_t;
+
+// In the mate-paired mode, the compression of the R1/R2 FASTQ records is done by the writer and is included in the write time. 
+void spike_writer_write(spike_writer_t &writer, const std::vector<spike_args_t> &configs, spike_batch_t &batch) {
+    const spike_clock_t beg_clock = (configs[0].is_profiling ? spike_clock_now() : spike_clock_t());
+    if (writer.pairer != NULL) {
+        mate_pairer_add_batch(*writer.pairer, configs[0], batch);
+    } else if (writer.outbam_fp != NULL) {
+        spike_batch_write_bam(batch, writer.outbam_fp, writer.outbam_hdr);
+    } else {
+        spike_batch_write(batch, writer.outidx, writer.outfile);
+    }
+    if (configs[0].is_profiling) {
+        spike_stats_add_time(writer.stats, SPIKE_STAGE_WRITE, beg_clock);
+    }
+}
+
+// The pipeline consists of one reader (the main thread), multiple workers, and multiple ordered writers. 
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<spike_batch_t*> free_batches;
+    std::deque<spike_batch_t*> todo_batches;
+    std::map<uint64_t, spike_batch_t*> done_batches;
+    uint64_t n_batches = 0;
+    bool is_reading_done = false;
+} spike_pipeline_t;
+
+void spike_pipeline_work(spike_pipeline_t *pipeline, const std::vector<spike_args_t> *configs, spike_stats_t *stats) {
+    spike_workspace_t ws;
+    while (true) {
+        spike_batch_t *batch = NULL;
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->cond.wait(lock, [&] { return pipeline->todo_batches.size() > 0 || pipeline->is_reading_done; });
+            if (pipeline->todo_batches.size() == 0) { break; }
+            batch = pipeline->todo_batches.front();
+            pipeline->todo_batches.pop_front();
+        }
+        spike_batch_process(*batch, *configs, *stats, ws);
+        {
+            std::lock_guard<std::mutex> lock(pipeline->mutex);
+            pipeline->done_batches[batch->seqnum] = batch;
+        }
+        pipeline->cond.notify_all();
+    }
+    spike_workspace_destroy(ws);
+}
+
+void spike_pipeline_write(spike_pipeline_t *pipeline, const std::vector<spike_args_t> *configs, spike_writer_t *writer) {
+    for (uint64_t seqnum = 0; ; seqnum++) {
+        spike_batch_t *batch = NULL;
+        {
+            std::unique_lock<std::mutex> lock(pipeline->mutex);
+            pipeline->cond.wait(lock, [&] { 
+                return pipeline->done_batches.count(seqnum) > 0 || (pipeline->is_reading_done && seqnum == pipeline->n_batches); 
+            });
+            if (pipeline->done_batches.count(seqnum) == 0) { break; }
+            batch = pipeline->done_batches[seqnum];
+        }
+        spike_writer_write(*writer, *configs, *batch);
+        {
+            std::lock_guard<std::mutex> lock(pipeline->mutex);
+            batch->n_pending_writes--;
+            if (0 == batch->n_pending_writes) {
+                pipeline->done_batches.erase(seqnum);
+                spike_batch_recycle(*batch, configs->at(0));
+                pipeline->free_batches.push_back(batch);
+            }
+        }
+        pipeline->cond.notify_all();
+    }
+}
+
+int64_t file_size(const char *fname) {
+    struct stat st;
+    if (NULL == fname || !strcmp("-", fname) || stat(fname, &st) != 0) { return 0; }
+    return (int64_t)st.st_size;
+}
+
+// A checkpoint (-c) is taken between two batches when no batch is in the pipeline, so all reads before it are written 
+//   and the sweep is exactly at the first read after it. A resumed run seeks to the checkpoint and truncates the output files to their sizes 
+//   at the checkpoint, where each batch ends at a gzip-member boundary, and then produces the same output as the run without any interruption. 
+// The checkpoint file consists of this header in native byte order, the offsets of the output files (-1 for no file) and the variant report, 
+//   and the read counts of the variants in the sweep (n_covering_reads and n_spiked_reads per variant and configuration). 
+const char SPIKE_CHECKPOINT_MAGIC[8] = {'S', 'M', 'C', 'K', 'P', 'T', '\0', '\0'};
+const uint32_t SPIKE_CHECKPOINT_VERSION = 1;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_configs;
+    uint32_t samplehash1;
+    uint32_t samplehash2;
+    int64_t bam_file_size;
+    int64_t vcf_file_size;
+    int64_t bam_voffset; // of the first read after the checkpoint
+    int64_t vcf_voffset; // of the first variant in the sweep, or of the next variant if the sweep is empty
+    int32_t vcf_read_ret;
+    uint32_t n_sweep_variants;
+    uint64_t vcf_list_beg_idx;
+    uint64_t n_outfiles;
+    uint64_t n_batches;
+    spike_stats_t reader_stats;
+    spike_stats_t worker_stats; // the UMI-family cache starts empty after resuming, so only its hit counts can differ from the ones of an uninterrupted run
+} spike_checkpoint_header_t;
+
+typedef struct {
+    const char *fname;
+    int64_t interval_ns;
+    int64_t last_ns;
+    const char *inbam;
+    const char *invcf;
+    std::vector<FILE*> outfiles; // the output FASTQ files followed by the variant report, where NULL means no file
+    std::vector<std::string> outfnames;
+    std::vector<spike_stats_t> *thread_stats;
+    uint64_t n_batches;
+} spike_checkpointer_t;
+
+// The checkpoint is due if the interval has passed since the last checkpoint and the sweep has consumed all the look-ahead records. 
+bool spike_checkpoint_is_due(const spike_checkpointer_t *checkpointer, const spike_reader_t &reader) {
+    return checkpointer != NULL && 0 == reader.bam_lookahead.size() && clock_ns(CLOCK_MONOTONIC) - checkpointer->last_ns >= checkpointer->interval_ns;
+}
+
+void spike_checkpoint_write(spike_checkpointer_t &checkpointer, const spike_reader_t &reader) {
+    const spike_args_t &args = reader.configs->at(0);
+    spike_checkpoint_header_t header;
+    memset((void*)&header, 0, sizeof(header)); // also the padding, so the same state is written as the same bytes
+    memcpy(header.magic, SPIKE_CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = SPIKE_CHECKPOINT_VERSION;
+    header.n_configs = reader.configs->size();
+    header.samplehash1 = args.samplehash1;
+    header.samplehash2 = args.samplehash2;
+    header.bam_file_size = file_size(checkpointer.inbam);
+    header.vcf_file_size = file_size(checkpointer.invcf);
+    header.bam_voffset = bgzf_tell(reader.bam_fp->fp.bgzf);
+    header.vcf_voffset = ((reader.vcf_list.size() > 0) ? reader.vcf_list.front()->voffset : spike_reader_vcf_tell(reader));
+    header.vcf_read_ret = reader.vcf_read_ret;
+    header.n_sweep_variants = reader.vcf_list.size();
+    header.vcf_list_beg_idx = reader.vcf_list_beg_idx;
+    header.n_outfiles = checkpointer.outfiles.size();
+    header.n_batches = checkpointer.n_batches;
+    header.reader_stats = reader.stats;
+    spike_stats_t worker_stats;
+    for (const auto & stats1 : *checkpointer.thread_stats) {
+        spike_stats_add(worker_stats, stats1);
+    }
+    header.worker_stats = worker_stats;
+    // the output files have to be on disk before the checkpoint refers to them
+    std::vector<int64_t> offsets;
+    for (size_t outidx = 0; outidx < checkpointer.outfiles.size(); outidx++) {
+        FILE *outfile = checkpointer.outfiles[outidx];
+        if (NULL == outfile) {
+            offsets.push_back(-1);
+            continue;
+        }
+        if (fflush(outfile) != 0 || fsync(fileno(outfile)) != 0) {
+            fprintf(stderr, "Failed to flush the file %s for the checkpoint\n", checkpointer.outfnames[outidx].c_str());
+            abort();
+        }
+        offsets.push_back(ftello(outfile));
+    }
+    std::vector<uint32_t> counts;
+    for (const auto *variant : reader.vcf_list) {
+        for (const auto & allelefracs : variant->allelefracs) {
+            counts.push_back(allelefracs.n_covering_reads);
+            counts.push_back(allelefracs.n_spiked_reads);
+        }
+    }
+    // the checkpoint replaces the previous one only after it is completely written
+    const std::string tmpfname = std::string(checkpointer.fname) + ".tmp";
+    FILE *file = fopen(tmpfname.c_str(), "wb");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the checkpoint %s for writing\n", tmpfname.c_str());
+        abort();
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1 
+            || fwrite(offsets.data(), sizeof(int64_t), offsets.size(), file) != offsets.size()
+            || fwrite(counts.data(), sizeof(uint32_t), counts.size(), file) != counts.size()
+            || fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0) {
+        fprintf(stderr, "Failed to write the checkpoint %s\n", tmpfname.c_str());
+        abort();
+    }
+    if (rename(tmpfname.c_str(), checkpointer.fname) != 0) {
+        fprintf(stderr, "Failed to rename the checkpoint %s to %s\n", tmpfname.c_str(), checkpointer.fname);
+        abort();
+    }
+    LOG_INFO("Wrote the checkpoint %s after %ld input reads in %lu batches\n", checkpointer.fname, reader.stats.num_input_reads, checkpointer.n_batches);
+    checkpointer.last_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+// Reopen the output file truncated to its size at the checkpoint for appending. 
+FILE *spike_checkpoint_reopen(const std::string &fname, int64_t offset) {
+    FILE *file = fopen(fname.c_str(), "r+b");
+    if (NULL == file || ftruncate(fileno(file), offset) != 0 || fseeko(file, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Failed to reopen the file %s at the offset %ld of the checkpoint\n", fname.c_str(), offset);
+        exit(-1);
+    }
+    return file;
+}
+
+// Restore the sweep, the stats and the output files of the checkpoint, where the look-ahead records were only used for the sample hashes. 
+void spike_checkpoint_resume(spike_checkpointer_t &checkpointer, spike_reader_t &reader) {
+    FILE *file = fopen(checkpointer.fname, "rb");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the checkpoint %s for reading\n", checkpointer.fname);
+        exit(-1);
+    }
+    const spike_args_t &args = reader.configs->at(0);
+    spike_checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SPIKE_CHECKPOINT_MAGIC, sizeof(header.magic)) || header.version != SPIKE_CHECKPOINT_VERSION) {
+        fprintf(stderr, "The file %s is not a checkpoint of version %u\n", checkpointer.fname, SPIKE_CHECKPOINT_VERSION);
+        exit(-1);
+    }
+    if (header.n_configs != reader.configs->size() || header.n_outfiles != checkpointer.outfiles.size() 
+            || header.samplehash1 != args.samplehash1 || header.samplehash2 != args.samplehash2
+            || header.bam_file_size != file_size(checkpointer.inbam) || header.vcf_file_size != file_size(checkpointer.invcf)) {
+        fprintf(stderr, "The checkpoint %s was taken by a run with other input files or command-line parameters\n", checkpointer.fname);
+        exit(-1);
+    }
+    std::vector<int64_t> offsets(header.n_outfiles);
+    std::vector<uint32_t> counts((size_t)header.n_sweep_variants * header.n_configs * 2);
+    if (fread(offsets.data(), sizeof(int64_t), offsets.size(), file) != offsets.size() || fread(counts.data(), sizeof(uint32_t), counts.size(), file) != counts.size()) {
+        fprintf(stderr, "The checkpoint %s is truncated\n", checkpointer.fname);
+        exit(-1);
+    }
+    fclose(file);
+    
+    for (size_t outidx = 0; outidx < checkpointer.outfiles.size(); outidx++) {
+        if ((NULL == checkpointer.outfiles[outidx]) != (offsets[outidx] < 0)) {
+            fprintf(stderr, "The checkpoint %s was taken by a run with other output files\n", checkpointer.fname);
+            exit(-1);
+        }
+        if (NULL == checkpointer.outfiles[outidx]) { continue; }
+        fclose(checkpointer.outfiles[outidx]);
+        checkpointer.outfiles[outidx] = spike_checkpoint_reopen(checkpointer.outfnames[outidx], offsets[outidx]);
+    }
+    for (auto *bam_rec : reader.bam_lookahead) {
+        bam_destroy1(bam_rec);
+    }
+    reader.bam_lookahead.clear();
+    if (bgzf_seek(reader.bam_fp->fp.bgzf, header.bam_voffset, SEEK_SET) < 0) {
+        fprintf(stderr, "Failed to seek to the virtual offset %ld of the checkpoint in the BAM file %s\n", header.bam_voffset, checkpointer.inbam);
+        abort();
+    }
+    if (reader.plan.addr != NULL) {
+        reader.plan_idx = header.vcf_voffset;
+    } else if (bgzf_seek(reader.vcf_fp->fp.bgzf, header.vcf_voffset, SEEK_SET) < 0) {
+        fprintf(stderr, "Failed to seek to the virtual offset %ld of the checkpoint in the VCF file %s\n", header.vcf_voffset, checkpointer.invcf);
+        abort();
+    }
+    // the variants in the sweep are read again in the same order, where the first one is never at the same position as a retired one
+    spike_batch_t batch;
+    size_t count_idx = 0;
+    for (uint32_t i = 0; i < header.n_sweep_variants; i++) {
+        if (spike_reader_read_vcf(reader) < 0) {
+            fprintf(stderr, "Failed to read the variant %u in the sweep of the checkpoint %s\n", i, checkpointer.fname);
+            abort();
+        }
+        spike_reader_push_variant(reader, batch);
+        for (auto & allelefracs : reader.vcf_list.back()->allelefracs) {
+            allelefracs.n_covering_reads = counts[count_idx++];
+            allelefracs.n_spiked_reads = counts[count_idx++];
+        }
+    }
+    reader.vcf_read_ret = header.vcf_read_ret;
+    reader.vcf_list_beg_idx = header.vcf_list_beg_idx;
+    reader.stats = header.reader_stats;
+    checkpointer.thread_stats->at(0) = header.worker_stats;
+    checkpointer.n_batches = header.n_batches;
+    fprintf(stderr, "Resumed from the checkpoint %s after %ld input reads in %lu batches\n", checkpointer.fname, reader.stats.num_input_reads, header.n_batches);
+}
+
+void spike_reader_run(spike_reader_t &reader, const std::vector<spike_args_t> &configs, spike_stats_t &stats, 
+        spike_workspace_t &ws, spike_batch_t &batch, std::vector<spike_writer_t> &writers, spike_checkpointer_t *checkpointer) {
+    while (spike_batch_fill(batch, reader, DEFAULT_BATCH_SIZE) > 0) {
+        spike_batch_process(batch, configs, stats, ws);
+        for (auto & writer : writers) {
+            spike_writer_write(writer, configs, batch);
+        }
+        spike_batch_recycle(batch, configs[0]);
+        if (checkpointer != NULL) {
+            checkpointer->n_batches++;
+            if (spike_checkpoint_is_due(checkpointer, reader)) { spike_checkpoint_write(*checkpointer, reader); }
+        }
+    }
+    spike_batch_recycle(batch, configs[0]);
+}
+
+// Split each region into shards of shard_size bases, where zero means no split. 
+std::vector<spike_shard_t> spike_shards_split(const std::vector<spike_shard_t> &regions, int64_t shard_size) {
+    if (shard_size <= 0) {
+        return regions;
+    }
+    std::vector<spike_shard_t> shards;
+    for (const auto & region1 : regions) {
+        if (HTS_IDX_NOCOOR == region1.tid) {
+            shards.push_back(region1);
+            continue;
+        }
+        if (region1.beg >= region1.end) {
+            shards.push_back(region1);
+        }
+        for (hts_pos_t beg = region1.beg; beg < region1.end; beg += shard_size) {
+            spike_shard_t shard = {region1.tid, beg, MIN(beg + shard_size, region1.end), beg, false};
+            shards.push_back(shard);
+        }
+    }
+    return shards;
+}
+
+// Split the region (or the whole genome followed by the unmapped reads if region is NULL) into shards of shard_size bases. 
+// If targets is not NULL, then each merged target interval is one shard instead, which visits all the reads overlapping the interval 
+//   except the ones already visited by the shard of the previous interval. 
+std::vector<spike_shard_t> spike_shards_make(const sam_hdr_t *bam_hdr, const char *region, int64_t shard_size, const target_regions_t *targets) {
+    std::vector<spike_shard_t> regions;
+    if (targets != NULL) {
+        for (size_t tid = 0; tid < targets->intervals.size(); tid++) {
+            hts_pos_t min_pos = 0;
+            for (const auto & interval : targets->intervals[tid]) {
+                spike_shard_t shard = {(int)tid, interval.first, interval.second, min_pos, false};
+                regions.push_back(shard);
+                min_pos = interval.second;
+            }
+        }
+        return regions;
+    }
+    if (NULL == region) {
+        for (int tid = 0; tid < bam_hdr->n_targets; tid++) {
+            spike_shard_t shard = {tid, 0, (hts_pos_t)bam_hdr->target_len[tid], 0, false};
+            regions.push_back(shard);
+        }
+        spike_shard_t shard = {HTS_IDX_NOCOOR, 0, 0, 0, false};
+        regions.push_back(shard);
+    } else if (!strcmp("*", region)) {
+        spike_shard_t shard = {HTS_IDX_NOCOOR, 0, 0, 0, false};
+        regions.push_back(shard);
+    } else {
+        hts_pos_t beg = 0;
+        hts_pos_t end = 0;
+        const char *tname_end = hts_parse_reg64(region, &beg, &end);
+        const std::string tname = ((tname_end != NULL) ? std::string(region, tname_end - region) : std::string(""));
+        const int tid = ((tname_end != NULL) ? sam_hdr_name2tid((sam_hdr_t*)bam_hdr, tname.c_str()) : -1);
+        if (tid < 0) {
+            fprintf(stderr, "The region %s is not found in the header of the input BAM file\n", region);
+            exit(-1);
+        }
+        spike_shard_t shard = {tid, beg, MIN(end, (hts_pos_t)bam_hdr->target_len[tid]), beg, false};
+        regions.push_back(shard);
+    }
+    return spike_shards_split(regions, shard_size);
+}
+
+// Load the shards of one part of the shard manifest written by the plan command, 
+//   where each line consists of the reference name (or * for the unmapped reads without coordinates) and the 0-based half-open interval. 
+std::vector<spike_shard_t> spike_shard_manifest_load(const char *fname, const sam_hdr_t *bam_hdr) {
+    FILE *file = fopen(fname, "r");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the shard manifest %s for reading\n", fname);
+        exit(-1);
+    }
+    std::vector<spike_shard_t> shards;
+    char line[1024 * 4];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
+        if ('#' == line[0] || '\n' == line[0]) { continue; }
+        char tname[1024];
+        long beg = 0;
+        long end = 0;
+        if (sscanf(line, "%1023s %ld %ld", tname, &beg, &end) != 3 || beg < 0 || end < beg) {
+            fprintf(stderr, "The line %d of the shard manifest %s is not a shard\n", lineno, fname);
+            exit(-1);
+        }
+        const int tid = (!strcmp("*", tname) ? HTS_IDX_NOCOOR : sam_hdr_name2tid((sam_hdr_t*)bam_hdr, tname));
+        if (HTS_IDX_NOCOOR != tid && (tid < 0 || end > (hts_pos_t)bam_hdr->target_len[tid])) {
+            fprintf(stderr, "The shard at line %d of the shard manifest %s is not in the header of the input BAM file\n", lineno, fname);
+            exit(-1);
+        }
+        spike_shard_t shard = {tid, beg, end, beg, false};
+        shards.push_back(shard);
+    }
+    fclose(file);
+    if (0 == shards.size()) {
+        fprintf(stderr, "The shard manifest %s has no shard\n", fname);
+        exit(-1);
+    }
+    return shards;
+}
+
+std::string spike_shard_tmpfname(const char *outfname, size_t shard_idx) {
+    return std::string(outfname) + ".shard" + std::to_string(shard_idx) + ".tmp";
+}
+
+// Append the first n_bytes of the file infname (or the whole file if n_bytes is negative) to outfile. 
+void file_append(FILE *outfile, const char *infname, int64_t n_bytes) {
+    FILE *infile = fopen(infname, "rb");
+    if (NULL == infile) {
+        fprintf(stderr, "Failed to open the file %s for reading\n", infname);
+        abort();
+    }
+    std::vector<char> buf(1024 * 1024);
+    size_t readlen = 0;
+    while ((readlen = fread(buf.data(), 1, ((n_bytes >= 0) ? (size_t)MIN(n_bytes, (int64_t)buf.size()) : buf.size()), infile)) > 0) {
+        if (n_bytes >= 0) { n_bytes -= readlen; }
+        if (fwrite(buf.data(), 1, readlen, outfile) != readlen) {
+            fprintf(stderr, "Failed to write %lu bytes from the file %s\n", readlen, infname);
+            abort();
+        }
+    }
+    fclose(infile);
+}
+
+// In the shard-parallel mode, each thread sweeps whole shards with its own file handles and writes each shard to its own temporary files, 
+//   and the main thread appends these temporary files to the output files in the order of the shards. 
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t n_taken_shards = 0;
+    std::vector<bool> is_shard_done;
+    const target_regions_t *targets = NULL; // the targets of the off-target reads passed through unchanged
+} spike_shard_queue_t;
+
+void spike_shard_queue_work(spike_shard_queue_t *queue, const std::vector<spike_args_t> *configs, spike_stats_t *stats, 
+        const char *inbam, const char *invcf, const char *reference, htsThreadPool *tpool, const std::vector<spike_shard_t> *shards, const std::vector<std::string> *outfnames) {
+    spike_reader_t reader;
+    spike_reader_init(reader, configs);
+    spike_reader_open(reader, inbam, invcf, reference, SPIKE_FASTQ_REQUIRED_FIELDS, tpool);
+    spike_reader_load_index(reader, inbam, invcf);
+    reader.targets = queue->targets;
+    reader.is_off_target_kept = (queue->targets != NULL);
+    spike_batch_t batch;
+    spike_workspace_t ws;
+    while (true) {
+        size_t shard_idx = 0;
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->n_taken_shards == shards->size()) { break; }
+            shard_idx = queue->n_taken_shards;
+            queue->n_taken_shards++;
+        }
+        reader.shards.assign(1, (*shards)[shard_idx]);
+        reader.shard_idx = 0;
+        spike_reader_open_shard(reader, batch.vcf_retired);
+        std::vector<spike_writer_t> writers;
+        for (size_t outidx = 0; outidx < outfnames->size(); outidx++) {
+            if (0 == (*outfnames)[outidx].size()) { continue; }
+            const std::string tmpfname = spike_shard_tmpfname((*outfnames)[outidx].c_str(), shard_idx);
+            spike_writer_t writer = {(int)outidx, fopen(tmpfname.c_str(), "wb"), NULL, NULL, NULL};
+            if (NULL == writer.outfile) {
+                fprintf(stderr, "Failed to open the file %s for writing\n", tmpfname.c_str());
+                abort();
+            }
+            writers.push_back(writer);
+        }
+        spike_reader_run(reader, *configs, *stats, ws, batch, writers, NULL);
+        for (auto & writer : writers) {
+            if (fclose(writer.outfile) != 0) {
+                fprintf(stderr, "Failed to close the temporary file of the shard %lu\n", shard_idx);
+                abort();
+            }
+            spike_stats_add(*stats, writer.stats);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->is_shard_done[shard_idx] = true;
+        }
+        if (configs->at(0).progress != NULL) {
+            configs->at(0).progress->num_done_shards.fetch_add(1, std::memory_order_relaxed);
+        }
+        queue->cond.notify_all();
+    }
+    spike_batch_destroy(batch);
+    spike_workspace_destroy(ws);
+    spike_reader_close(reader);
+    spike_stats_add(*stats, reader.stats);
+}
+
+// The command-line parameters that can be overridden by each configuration of the manifest
+typedef struct {
+    std::string outprefix;
+    double defallelefrac;
+    double powerlaw_exponent;
+    double lognormal_disp;
+    uint32_t randseed;
+    uint32_t randseed_basecall;
+} spike_config_t;
+
+void spike_args_set_config(spike_args_t &args, const spike_config_t &config) {
+    double lnfrac = pow(10.0, -config.lognormal_disp / 10.0);
+    double lnsigma = log(2.0) / sqrt(log(lnfrac) / (-1.0/2.0));
+    lnsigma = lnsigma / sqrt(2.0); // transform obs-to-obs var to obs-to-exp var
+    args.defallelefrac = config.defallelefrac;
+    args.powerlaw_exponent = config.powerlaw_exponent;
+    args.lognormal_disp = config.lognormal_disp;
+    args.lnsigma = lnsigma;
+    args.randseed = ((0 != config.randseed) ? portable_int2randint(config.randseed, 1) : 0);
+    args.randseed_basecall = ((0 != config.randseed_basecall) ? portable_int2randint(config.randseed_basecall, 4) : 0);
+}
+
+// Each non-empty line of the manifest not starting with '#' consists of an output prefix followed by 
+//   the pairs of command-line parameter and value overriding the ones in defconfig (for example: sim-s7-f0.05 -s 7 -f 0.05). 
+std::vector<spike_config_t> spike_manifest_load(const char *manifest, const spike_config_t &defconfig) {
+    std::vector<spike_config_t> configs;
+    FILE *manifest_file = fopen(manifest, "r");
+    if (NULL == manifest_file) {
+        fprintf(stderr, "Failed to open the manifest file %s for reading\n", manifest);
+        exit(-1);
+    }
+    char line[1024 * 4];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), manifest_file) != NULL) {
+        lineno++;
+        std::vector<std::string> tokens;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+            tokens.push_back(token);
+        }
+        if (0 == tokens.size() || '#' == tokens[0][0]) { continue; }
+        spike_config_t config = defconfig;
+        config.outprefix = tokens[0];
+        for (size_t i = 1; i < tokens.size(); i += 2) {
+            const std::string &key = tokens[i];
+            const char *val = ((i + 1 < tokens.size()) ? tokens[i + 1].c_str() : NULL);
+            if (NULL == val) { 
+                fprintf(stderr, "The parameter %s at line %d of the manifest file %s has no value\n", key.c_str(), lineno, manifest);
+                exit(-1);
+            }
+            if ("-f" == key) { config.defallelefrac = atof(val); }
+            else if ("-p" == key) { config.powerlaw_exponent = atof(val); }
+            else if ("-q" == key) { config.lognormal_disp = atof(val); }
+            else if ("-s" == key) { config.randseed = atoi(val); }
+            else if ("-C" == key) { config.randseed_basecall = atoi(val); }
+            else {
+                fprintf(stderr, "The parameter %s at line %d of the manifest file %s is not one of -f, -p, -q, -s, and -C\n", key.c_str(), lineno, manifest);
+                exit(-1);
+            }
+        }
+        configs.push_back(config);
+    }
+    fclose(manifest_file);
+    return configs;
+}
+
+void compile_vcf_help(int argc, char **argv, int exit_code) {
+    fprintf(stdout, "Usage: %s compile-vcf -v <INPUT-VCF> -o <OUTPUT-SPIKE-PLAN>\n", argv[0]);
+    fprintf(stdout, "  This command compiles the coordinate-sorted INPUT-VCF into a spike plan, which can be passed to the -v command-line parameter instead of INPUT-VCF. "
+            "The spike plan is mapped into memory without any parsing, so it is faster to load when the same VCF is spiked into many BAM files. "
+            "The spike plan is in the native byte order and needs no index.\n");
+    fprintf(stdout, "Optional parameters:\n");
+    fprintf(stdout, " -F allele fraction TAG in the VCF file. " "[default to FA].\n");
+    fprintf(stdout, " -S sample name used for the -F command-line parameter. "
+                    "The special values NULL pointer, empty-string, and INFO mean using the INFO column instead of the FORMAT column." "[default to NULL pointer].\n");
+    fprintf(stdout, "Note:\n");
+    fprintf(stdout, "The allele fractions are resolved with -F and -S when the spike plan is compiled, so -F and -S have no effect when the spike plan is used.\n");
+    exit(exit_code);
+}
+
+int compile_vcf_main(int argc, char **argv) {
+    const char *invcf = NULL;
+    const char *outplan = NULL;
+    const char *tagFA = TAG_FA;
+    const char *tagsample = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "hv:o:F:S:")) != -1) {
+        switch (opt) {
+            case 'h': compile_vcf_help(argc, argv, 0);
+            case 'v': invcf = optarg; break;
+            case 'o': outplan = optarg; break;
+            case 'F': tagFA = optarg; break;
+            case 'S': tagsample = optarg; break;
+            default: compile_vcf_help(argc, argv, -1);
+        }
+    }
+    if (NULL == invcf || NULL == outplan) {
+        fprintf(stderr, "The input VCF and output spike-plan filenames have to be specified on the command line\n");
+        compile_vcf_help(argc, argv, -1);
+    }
+    htsFile *vcf_fp = vcf_open(invcf, "r");
+    bcf_hdr_t *vcf_hdr = NULL;
+    if (NULL == vcf_fp || NULL == (vcf_hdr = bcf_hdr_read(vcf_fp))) {
+        fprintf(stderr, "Failed to open the VCF file %s for reading\n", invcf);
+        abort();
+    }
+    const bool is_FA_from_INFO = tagsample_is_INFO(tagsample);
+    const int tag_sample_idx = vcf_hdr_tag_sample_idx(vcf_hdr, tagsample);
+    
+    std::string contigs;
+    const int n_contigs = vcf_hdr->n[BCF_DT_CTG];
+    for (int rid = 0; rid < n_contigs; rid++) {
+        contigs += bcf_hdr_id2name(vcf_hdr, rid);
+        contigs.push_back('\0');
+    }
+    std::vector<spike_plan_variant_t> variants;
+    std::string alts;
+    bcf1_t *vcf_rec = bcf_init();
+    float *bcffloats = NULL;
+    int ret = 0;
+    while ((ret = vcf_read(vcf_fp, vcf_hdr, vcf_rec)) >= 0) {
+        bcf_unpack(vcf_rec, BCF_UN_ALL);
+        if (variants.size() > 0 && is_var1_before_var2(vcf_rec->rid, vcf_rec->pos, variants.back().rid, variants.back().pos)) {
+            fprintf(stderr, "The variant at tid %d pos %ld is before the previous variant, so the VCF file %s is not sorted\n", vcf_rec->rid, vcf_rec->pos, invcf);
+            exit(-1);
+        }
+        const char *alt = ((vcf_rec->n_allele > 1) ? vcf_rec->d.allele[1] : "");
+        spike_plan_variant_t variant;
+        memset(&variant, 0, sizeof(variant));
+        variant.rid = vcf_rec->rid;
+        variant.pos = vcf_rec->pos;
+        variant.reflen = strlen(vcf_rec->d.allele[0]);
+        variant.altlen = strlen(alt);
+        variant.type = spike_variant_type(variant.reflen, variant.altlen);
+        variant.alt_offset = alts.size();
+        double allelefrac = 0;
+        variant.is_allelefrac_found = vcf_rec_get_allelefrac(allelefrac, vcf_hdr, vcf_rec, tagFA, is_FA_from_INFO, tag_sample_idx, &bcffloats);
+        variant.allelefrac = (float)allelefrac;
+        variants.push_back(variant);
+        alts.append(alt, variant.altlen + 1);
+    }
+    if (ret < -1) {
+        fprintf(stderr, "Failed to read the VCF file %s after %lu variants\n", invcf, variants.size());
+        abort();
+    }
+    free(bcffloats);
+    bcf_destroy(vcf_rec);
+    bcf_hdr_destroy(vcf_hdr);
+    vcf_close(vcf_fp);
+    
+    spike_plan_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPIKE_PLAN_MAGIC, sizeof(header.magic));
+    header.version = SPIKE_PLAN_VERSION;
+    header.n_contigs = n_contigs;
+    header.n_variants = variants.size();
+    header.contigs_offset = sizeof(header);
+    header.variants_offset = (header.contigs_offset + contigs.size() + 7) / 8 * 8;
+    header.alts_offset = header.variants_offset + variants.size() * sizeof(spike_plan_variant_t);
+    header.file_size = header.alts_offset + alts.size();
+    const std::string padding(header.variants_offset - header.contigs_offset - contigs.size(), '\0');
+    FILE *outfile = fopen(outplan, "wb");
+    if (NULL == outfile) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outplan);
+        abort();
+    }
+    if (fwrite(&header, sizeof(header), 1, outfile) != 1
+            || fwrite(contigs.data(), 1, contigs.size(), outfile) != contigs.size()
+            || fwrite(padding.data(), 1, padding.size(), outfile) != padding.size()
+            || fwrite(variants.data(), sizeof(spike_plan_variant_t), variants.size(), outfile) != variants.size()
+            || fwrite(alts.data(), 1, alts.size(), outfile) != alts.size()
+            || fclose(outfile) != 0) {
+        fprintf(stderr, "Failed to write the spike plan to the file %s\n", outplan);
+        abort();
+    }
+    fprintf(stderr, "Compiled the %lu variants on %d contigs in %s into the spike plan %s of %lu bytes\n", variants.size(), n_contigs, invcf, outplan, header.file_size);
+    return 0;
+}
+
+void plan_help(int argc, char **argv, int exit_code) {
+    fprintf(stdout, "Usage: %s plan -b <INPUT-BAM> -n <NUMBER-OF-PARTS> -o <OUTPUT-PREFIX>\n", argv[0]);
+    fprintf(stdout, "  This command splits the whole genome followed by the unmapped reads into NUMBER-OF-PARTS parts of about the same compressed size in INPUT-BAM, "
+            "which is estimated from the BAM index without reading any alignment. "
+            "The shards of the k-th part (k = 0, 1, 2, ...) are written to the shard manifest <OUTPUT-PREFIX>.<k>.shards.tsv, "
+            "which can be passed to the -G command-line parameter of one run per node. "
+            "The outputs of the parts are then merged in the order of the parts with the gather command, "
+            "which results in the same reads as the ones of one run over the whole INPUT-BAM.\n");
+    fprintf(stdout, "Optional parameters:\n");
+    fprintf(stdout, " -w The size of the windows whose compressed sizes are looked up in the BAM index, so each part begins and ends at window boundaries [default to %ld].\n", DEFAULT_PLAN_WINDOW_SIZE);
+    exit(exit_code);
+}
+
+// The compressed bytes of the reads overlapping [beg, end) estimated from the chunks of the BAM index, 
+//   which are the chunks of the bins overlapping the interval filtered by the linear index. 
+int64_t bam_idx_interval_bytes(const hts_idx_t *bam_idx, int tid, hts_pos_t beg, hts_pos_t end) {
+    hts_itr_t *itr = sam_itr_queryi(bam_idx, tid, beg, end);
+    if (NULL == itr) { return 0; }
+    int64_t nbytes = 0;
+    for (int i = 0; i < itr->n_off; i++) {
+        nbytes += (int64_t)(itr->off[i].v >> 16) - (int64_t)(itr->off[i].u >> 16);
+    }
+    hts_itr_destroy(itr);
+    return nbytes;
+}
+
+int plan_main(int argc, char **argv) {
+    const char *inbam = NULL;
+    const char *outprefix = NULL;
+    int n_parts = 0;
+    int64_t window_size = DEFAULT_PLAN_WINDOW_SIZE;
+    int opt;
+    while ((opt = getopt(argc, argv, "hb:n:o:w:")) != -1) {
+        switch (opt) {
+            case 'h': plan_help(argc, argv, 0);
+            case 'b': inbam = optarg; break;
+            case 'n': n_parts = atoi(optarg); break;
+            case 'o': outprefix = optarg; break;
+            case 'w': window_size = atoll(optarg); break;
+            default: plan_help(argc, argv, -1);
+        }
+    }
+    if (NULL == inbam || NULL == outprefix) {
+        fprintf(stderr, "The input BAM filename and the output prefix have to be specified on the command line\n");
+        plan_help(argc, argv, -1);
+    }
+    if (n_parts < 1 || window_size < 1) {
+        fprintf(stderr, "The number of parts (%d) and the window size (%ld) have to be at least one\n", n_parts, window_size);
+        plan_help(argc, argv, -1);
+    }
+    samFile *bam_fp = sam_open(inbam, "r");
+    sam_hdr_t *bam_hdr = NULL;
+    if (NULL == bam_fp || NULL == (bam_hdr = sam_hdr_read(bam_fp))) {
+        fprintf(stderr, "Failed to open the BAM file %s for reading\n", inbam);
+        abort();
+    }
+    hts_idx_t *bam_idx = sam_index_load(bam_fp, inbam);
+    if (NULL == bam_idx) {
+        fprintf(stderr, "Failed to load the index of the BAM file %s\n", inbam);
+        abort();
+    }
+    
+    // the windows tiling the genome followed by the shard of the unmapped reads without coordinates
+    std::vector<spike_shard_t> windows;
+    std::vector<int64_t> window_bytes;
+    int64_t n_bytes = 0;
+    uint64_t n_reads = 0;
+    for (int tid = 0; tid < sam_hdr_nref(bam_hdr); tid++) {
+        uint64_t n_mapped = 0;
+        uint64_t n_unmapped = 0;
+        if (hts_idx_get_stat(bam_idx, tid, &n_mapped, &n_unmapped) == 0) { n_reads += n_mapped + n_unmapped; }
+        const hts_pos_t tlen = (hts_pos_t)sam_hdr_tid2len(bam_hdr, tid);
+        for (hts_pos_t beg = 0; beg < tlen; beg += window_size) {
+            spike_shard_t window = {tid, beg, MIN(beg + window_size, tlen), beg, false};
+            windows.push_back(window);
+            window_bytes.push_back(bam_idx_interval_bytes(bam_idx, tid, window.beg, window.end));
+            n_bytes += window_bytes.back();
+        }
+    }
+    // the index has only the number of the unmapped reads without coordinates, so their size is estimated from the average size of the other reads
+    const uint64_t n_nocoor_reads = hts_idx_get_n_no_coor(bam_idx);
+    spike_shard_t nocoor_window = {HTS_IDX_NOCOOR, 0, 0, 0, false};
+    windows.push_back(nocoor_window);
+    window_bytes.push_back((int64_t)((double)n_bytes / MAX(n_reads, (uint64_t)1) * n_nocoor_reads));
+    n_bytes += window_bytes.back();
+    if (0 == n_bytes) {
+        fprintf(stderr, "Warning: the index of the BAM file %s has no chunk, so the parts are balanced by the numbers of bases instead\n", inbam);
+        for (size_t widx = 0; widx < windows.size(); widx++) {
+            window_bytes[widx] = windows[widx].end - windows[widx].beg;
+            n_bytes += window_bytes[widx];
+        }
+    }
+    if ((size_t)n_parts > windows.size()) {
+        fprintf(stderr, "Warning: the %d parts are reduced to the %lu windows of %ld bases\n", n_parts, windows.size(), window_size);
+        n_parts = (int)windows.size();
+    }
+    
+    // The k-th part ends at the window whose middle is closest to k+1 n-th of the bytes, while each part has at least one window. 
+    size_t widx = 0;
+    int64_t n_bytes_before = 0;
+    for (int part_idx = 0; part_idx < n_parts; part_idx++) {
+        const size_t part_beg = widx;
+        const double part_end_bytes = (double)n_bytes * (part_idx + 1) / n_parts;
+        const size_t max_part_end = windows.size() - (n_parts - part_idx - 1);
+        do {
+            n_bytes_before += window_bytes[widx];
+            widx++;
+        } while (widx < max_part_end && (part_idx + 1 == n_parts || n_bytes_before + window_bytes[widx] / 2.0 <= part_end_bytes));
+        std::vector<spike_shard_t> shards;
+        for (size_t widx2 = part_beg; widx2 < widx; widx2++) {
+            if (shards.size() > 0 && shards.back().tid == windows[widx2].tid && HTS_IDX_NOCOOR != windows[widx2].tid) {
+                shards.back().end = windows[widx2].end;
+            } else {
+                shards.push_back(windows[widx2]);
+            }
+        }
+        int64_t part_bytes = 0;
+        for (size_t widx2 = part_beg; widx2 < widx; widx2++) { part_bytes += window_bytes[widx2]; }
+        const std::string outfname = std::string(outprefix) + "." + std::to_string(part_idx) + ".shards.tsv";
+        FILE *outfile = fopen(outfname.c_str(), "w");
+        if (NULL == outfile) {
+            fprintf(stderr, "Failed to open the file %s for writing\n", outfname.c_str());
+            abort();
+        }
+        fprintf(outfile, "#The part %d of %d of the BAM file %s with about %ld compressed bytes\n", part_idx, n_parts, inbam, part_bytes);
+        for (const auto & shard : shards) {
+            fprintf(outfile, "%s\t%ld\t%ld\n", (HTS_IDX_NOCOOR == shard.tid ? "*" : sam_hdr_tid2name(bam_hdr, shard.tid)), shard.beg, shard.end);
+        }
+        if (fclose(outfile) != 0) {
+            fprintf(stderr, "Failed to write the shard manifest %s\n", outfname.c_str());
+            abort();
+        }
+        fprintf(stderr, "Wrote the %lu shards of about %ld compressed bytes to the shard manifest %s\n", shards.size(), part_bytes, outfname.c_str());
+    }
+    hts_idx_destroy(bam_idx);
+    sam_hdr_destroy(bam_hdr);
+    sam_close(bam_fp);
+    return 0;
+}
+
+// The counters of the run report in their order in the report
+const std::vector<std::pair<const char*, int64_t spike_stats_t::*>> SPIKE_RUN_REPORT_COUNTERS = {
+    {"num_kept_reads", &spike_stats_t::num_kept_reads},
+    {"num_kept_snv", &spike_stats_t::num_kept_snv},
+    {"num_kept_mnv", &spike_stats_t::num_kept_mnv},
+    {"num_kept_ins", &spike_stats_t::num_kept_ins},
+    {"num_kept_del", &spike_stats_t::num_kept_del},
+    {"num_skip_reads", &spike_stats_t::num_skip_reads},
+    {"num_skip_cmatches", &spike_stats_t::num_skip_cmatches},
+    {"num_edited_bam_reads", &spike_stats_t::num_edited_bam_reads},
+    {"num_indel_bam_reads", &spike_stats_t::num_indel_bam_reads},
+    {"num_flagged_bam_alns", &spike_stats_t::num_flagged_bam_alns},
+    {"num_passthrough_reads", &spike_stats_t::num_passthrough_reads},
+    {"num_mutated_reads", &spike_stats_t::num_mutated_reads},
+    {"num_rescued_mates", &spike_stats_t::num_rescued_mates},
+    {"num_umi_cache_lookups", &spike_stats_t::num_umi_cache_lookups},
+    {"num_umi_cache_hits", &spike_stats_t::num_umi_cache_hits},
+};
+
+// The run report is a JSON object for catching regressions in throughput and in the fidelity of spiking automatically, 
+//   where the wall time of each stage is summed over the threads running the stage (so it can exceed the wall time of the run). 
+// The run reports of the parts of a run (see the plan command) are merged by the gather command, 
+//   where the wall time, the peak memory, and the input bytes (of the same input BAM file) are the maximum ones and the other fields are summed over the parts. 
+typedef struct {
+    spike_stats_t stats;
+    int64_t wall_ns = 0;
+    double user_cpu_sec = 0;
+    double sys_cpu_sec = 0;
+    int64_t peak_rss_kb = 0;
+    int64_t input_bytes = 0;
+    int64_t output_bytes = 0;
+    int nthreads = 0;
+    size_t n_configs = 0;
+} spike_run_report_t;
+
+void spike_run_report_set_usage(spike_run_report_t &report) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    report.user_cpu_sec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    report.sys_cpu_sec = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    report.peak_rss_kb = usage.ru_maxrss;
+}
+
+void spike_run_report_write(const char *fname, const spike_run_report_t &report) {
+    FILE *file = fopen(fname, "w");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the run report %s for writing\n", fname);
+        abort();
+    }
+    const spike_stats_t &stats = report.stats;
+    const double wall_sec = MAX(report.wall_ns, (int64_t)1) / 1e9;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"program\": \"safemut\",\n");
+    fprintf(file, "  \"version\": \"%s\",\n", FULL_VERSION);
+    fprintf(file, "  \"num_threads\": %d,\n", report.nthreads);
+    fprintf(file, "  \"num_configurations\": %lu,\n", report.n_configs);
+    fprintf(file, "  \"wall_sec\": %.6f,\n", wall_sec);
+    fprintf(file, "  \"user_cpu_sec\": %.6f,\n", report.user_cpu_sec);
+    fprintf(file, "  \"sys_cpu_sec\": %.6f,\n", report.sys_cpu_sec);
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n", report.peak_rss_kb);
+    fprintf(file, "  \"num_input_reads\": %ld,\n", stats.num_input_reads);
+    fprintf(file, "  \"reads_per_sec\": %.3f,\n", stats.num_input_reads / wall_sec);
+    fprintf(file, "  \"input_bytes\": %ld,\n", report.input_bytes);
+    fprintf(file, "  \"input_bytes_per_sec\": %.3f,\n", report.input_bytes / wall_sec);
+    fprintf(file, "  \"output_bytes\": %ld,\n", report.output_bytes);
+    fprintf(file, "  \"output_bytes_per_sec\": %.3f,\n", report.output_bytes / wall_sec);
+    fprintf(file, "  \"max_variant_window\": %ld,\n", stats.max_variant_window);
+    fprintf(file, "  \"stages\": {\n");
+    for (int stage = 0; stage < SPIKE_STAGE_NUM; stage++) {
+        fprintf(file, "    \"%s\": {\"wall_sec\": %.6f, \"cpu_sec\": %.6f}%s\n", SPIKE_STAGE_NAMES[stage], 
+                stats.stage_wall_ns[stage] / 1e9, stats.stage_cpu_ns[stage] / 1e9, (stage + 1 < SPIKE_STAGE_NUM ? "," : ""));
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"counters\": {\n");
+    for (size_t i = 0; i < SPIKE_RUN_REPORT_COUNTERS.size(); i++) {
+        fprintf(file, "    \"%s\": %ld%s\n", SPIKE_RUN_REPORT_COUNTERS[i].first, stats.*SPIKE_RUN_REPORT_COUNTERS[i].second, 
+                (i + 1 < SPIKE_RUN_REPORT_COUNTERS.size() ? "," : ""));
+    }
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to close the run report %s\n", fname);
+        abort();
+    }
+}
+
+// Read the run report written by spike_run_report_write, which has one field per line, 
+//   so the derived fields (such as reads_per_sec) and the unknown fields are skipped. 
+void spike_run_report_read(const char *fname, spike_run_report_t &report) {
+    FILE *file = fopen(fname, "r");
+    if (NULL == file) {
+        fprintf(stderr, "Failed to open the run report %s for reading\n", fname);
+        exit(-1);
+    }
+    spike_stats_t &stats = report.stats;
+    bool is_safemut = false;
+    char line[1024 * 4];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char key[256];
+        char strval[256];
+        double val = 0;
+        double val2 = 0;
+        if (sscanf(line, " \"%255[^\"]\": \"%255[^\"]\"", key, strval) == 2) {
+            if (!strcmp("program", key)) { is_safemut = !strcmp("safemut", strval); }
+            continue;
+        }
+        if (sscanf(line, " \"%255[^\"]\": {\"wall_sec\": %lf, \"cpu_sec\": %lf}", key, &val, &val2) == 3) {
+            for (int stage = 0; stage < SPIKE_STAGE_NUM; stage++) {
+                if (!strcmp(SPIKE_STAGE_NAMES[stage], key)) {
+                    stats.stage_wall_ns[stage] = (int64_t)llround(val * 1e9);
+                    stats.stage_cpu_ns[stage] = (int64_t)llround(val2 * 1e9);
+                }
+            }
+            continue;
+        }
+        if (sscanf(line, " \"%255[^\"]\": %lf", key, &val) != 2) { continue; }
+        if (!strcmp("num_threads", key)) { report.nthreads = (int)val; }
+        else if (!strcmp("num_configurations", key)) { report.n_configs = (size_t)val; }
+        else if (!strcmp("wall_sec", key)) { report.wall_ns = (int64_t)llround(val * 1e9); }
+        else if (!strcmp("user_cpu_sec", key)) { report.user_cpu_sec = val; }
+        else if (!strcmp("sys_cpu_sec", key)) { report.sys_cpu_sec = val; }
+        else if (!strcmp("peak_rss_kb", key)) { report.peak_rss_kb = (int64_t)val; }
+        else if (!strcmp("num_input_reads", key)) { stats.num_input_reads = (int64_t)val; }
+        else if (!strcmp("input_bytes", key)) { report.input_bytes = (int64_t)val; }
+        else if (!strcmp("output_bytes", key)) { report.output_bytes = (int64_t)val; }
+        else if (!strcmp("max_variant_window", key)) { stats.max_variant_window = (int64_t)val; }
+        for (const auto & counter : SPIKE_RUN_REPORT_COUNTERS) {
+            if (!strcmp(counter.first, key)) { stats.*counter.second = (int64_t)val; }
+        }
+    }
+    fclose(file);
+    if (!is_safemut) {
+        fprintf(stderr, "The file %s is not a run report of safemut\n", fname);
+        exit(-1);
+    }
+}
+
+void spike_run_report_merge(spike_run_report_t &report, const spike_run_report_t &other) {
+    spike_stats_add(report.stats, other.stats);
+    report.wall_ns = MAX(report.wall_ns, other.wall_ns);
+    report.user_cpu_sec += other.user_cpu_sec;
+    report.sys_cpu_sec += other.sys_cpu_sec;
+    report.peak_rss_kb = MAX(report.peak_rss_kb, other.peak_rss_kb);
+    report.input_bytes = MAX(report.input_bytes, other.input_bytes);
+    report.output_bytes += other.output_bytes;
+    report.nthreads += other.nthreads;
+    report.n_configs = MAX(report.n_configs, other.n_configs);
+}
+
+void spike_stats_print(const spike_stats_t &stats, bool is_bam_output) {
+    fprintf(stderr, "In total: kept %ld read support, skipped %ld read support"
+            ", and skipped %ld no-variant CMATCH cigars.\n", stats.num_kept_reads, stats.num_skip_reads, stats.num_skip_cmatches);
+    fprintf(stderr, "Passed through %ld reads overlapping no variant and mutated %ld reads\n", stats.num_passthrough_reads, stats.num_mutated_reads);
+    if (stats.num_rescued_mates > 0) {
+        fprintf(stderr, "Rescued %ld mates outside the target regions\n", stats.num_rescued_mates);
+    }
+    fprintf(stderr, "The UMI-family cache was hit by %ld of %ld lookups (%.2f%%)\n", stats.num_umi_cache_hits, stats.num_umi_cache_lookups, 
+            100.0 * stats.num_umi_cache_hits / MAX(stats.num_umi_cache_lookups, (int64_t)1));
+    fprintf(stderr, "Kept %ld snv read support\n", stats.num_kept_snv);
+    fprintf(stderr, "Kept %ld mnv read support\n", stats.num_kept_mnv);
+    fprintf(stderr, "Kept %ld insertion read support\n", stats.num_kept_ins);
+    fprintf(stderr, "Kept %ld deletion read support\n", stats.num_kept_del);
+    if (is_bam_output) {
+        fprintf(stderr, "Edited %ld reads in place and flagged %ld reads with indels and %ld secondary/supplementary alignments in the output BAM\n", 
+                stats.num_edited_bam_reads, stats.num_indel_bam_reads, stats.num_flagged_bam_alns);
+    }
+}
+
+// One row of the variant report, where key is CHROM to CONFIG and fas is REQUESTED_FA and TARGET_FA
+typedef struct {
+    std::string key;
+    std::string fas;
+    uint64_t n_covering_reads;
+    uint64_t n_spiked_reads;
+} spike_variant_report_row_t;
+
+// A variant near the boundary between two parts has one row in each part, which are merged into the row of the first part, 
+//   where the i-th row of a key in a part is merged into the i-th row of the same key in the previous parts (as the same variant can be in the VCF more than once). 
+void gather_variant_reports(FILE *outfile, const std::vector<const char*> &infnames) {
+    std::vector<spike_variant_report_row_t> rows;
+    std::unordered_map<std::string, std::vector<size_t>> key2rowidxs; // the rows of the last part with each key
+    for (const char *infname : infnames) {
+        FILE *infile = fopen(infname, "r");
+        if (NULL == infile) {
+            fprintf(stderr, "Failed to open the variant report %s for reading\n", infname);
+            exit(-1);
+        }
+        std::unordered_map<std::string, std::vector<size_t>> part_key2rowidxs;
+        char line[1024 * 64];
+        int lineno = 0;
+        while (fgets(line, sizeof(line), infile) != NULL) {
+            lineno++;
+            if (1 == lineno) {
+                if (strcmp(SPIKE_VARIANT_REPORT_HEADER, line)) {
+                    fprintf(stderr, "The file %s is not a variant report of safemut\n", infname);
+                    exit(-1);
+                }
+                continue;
+            }
+            std::vector<char*> fields;
+            for (char *field = strtok(line, "\t\n"); field != NULL; field = strtok(NULL, "\t\n")) {
+                fields.push_back(field);
+            }
+            if (fields.size() != 10) {
+                fprintf(stderr, "The line %d of the variant report %s does not have 10 columns\n", lineno, infname);
+                exit(-1);
+            }
+            spike_variant_report_row_t row;
+            row.key = std::string(fields[0]) + "\t" + fields[1] + "\t" + fields[2] + "\t" + fields[3] + "\t" + fields[4];
+            row.fas = std::string(fields[5]) + "\t" + fields[6];
+            row.n_covering_reads = strtoull(fields[7], NULL, 10);
+            row.n_spiked_reads = strtoull(fields[8], NULL, 10);
+            std::vector<size_t> &part_rowidxs = part_key2rowidxs[row.key];
+            const auto it = key2rowidxs.find(row.key);
+            if (it != key2rowidxs.end() && it->second.size() > part_rowidxs.size()) {
+                const size_t rowidx = it->second[part_rowidxs.size()];
+                rows[rowidx].n_covering_reads += row.n_covering_reads;
+                rows[rowidx].n_spiked_reads += row.n_spiked_reads;
+                part_rowidxs.push_back(rowidx);
+            } else {
+                part_rowidxs.push_back(rows.size());
+                rows.push_back(row);
+            }
+        }
+        fclose(infile);
+        for (auto & key_rowidxs : part_key2rowidxs) {
+            key2rowidxs[key_rowidxs.first] = key_rowidxs.second;
+        }
+    }
+    fputs(SPIKE_VARIANT_REPORT_HEADER, outfile);
+    for (const auto & row : rows) {
+        fprintf(outfile, "%s\t%s\t%lu\t%lu\t", row.key.c_str(), row.fas.c_str(), row.n_covering_reads, row.n_spiked_reads);
+        if (row.n_covering_reads > 0) {
+            fprintf(outfile, "%f\n", (double)row.n_spiked_reads / row.n_covering_reads);
+        } else {
+            fprintf(outfile, "NA\n");
+        }
+    }
+}
+
+// The alignments are copied with the header of the first file, so the files have to be of the same input BAM file. 
+void gather_alignments(const char *outfname, const std::vector<const char*> &infnames, const char *reference) {
+    char outmode[16] = "w";
+    if (sam_open_mode(outmode + 1, outfname, NULL) != 0) { strcpy(outmode, "wb"); }
+    samFile *outfp = sam_open(outfname, outmode);
+    if (NULL == outfp) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outfname);
+        abort();
+    }
+    if (reference != NULL && hts_set_opt(outfp, CRAM_OPT_REFERENCE, reference) != 0) {
+        fprintf(stderr, "Failed to set the reference %s for the file %s\n", reference, outfname);
+        abort();
+    }
+    sam_hdr_t *outhdr = NULL;
+    bam1_t *aln = bam_init1();
+    for (const char *infname : infnames) {
+        samFile *infp = sam_open(infname, "r");
+        sam_hdr_t *inhdr = NULL;
+        if (NULL == infp || (reference != NULL && hts_set_opt(infp, CRAM_OPT_REFERENCE, reference) != 0) || NULL == (inhdr = sam_hdr_read(infp))) {
+            fprintf(stderr, "Failed to open the alignment file %s for reading\n", infname);
+            exit(-1);
+        }
+        if (NULL == outhdr) {
+            outhdr = inhdr;
+            if (sam_hdr_write(outfp, outhdr) < 0) {
+                fprintf(stderr, "Failed to write the SAM header to the file %s\n", outfname);
+                abort();
+            }
+        } else if (sam_hdr_nref(inhdr) != sam_hdr_nref(outhdr)) {
+            fprintf(stderr, "The file %s has %d reference sequences but the file %s has %d\n", infname, sam_hdr_nref(inhdr), infnames[0], sam_hdr_nref(outhdr));
+            exit(-1);
+        }
+        int ret = 0;
+        while ((ret = sam_read1(infp, outhdr, aln)) >= 0) {
+            if (sam_write1(outfp, outhdr, aln) < 0) {
+                fprintf(stderr, "Failed to write an alignment to the file %s\n", outfname);
+                abort();
+            }
+        }
+        if (ret < -1) {
+            fprintf(stderr, "Failed to read the alignment file %s\n", infname);
+            abort();
+        }
+        if (inhdr != outhdr) { bam_hdr_destroy(inhdr); }
+        sam_close(infp);
+    }
+    bam_destroy1(aln);
+    bam_hdr_destroy(outhdr);
+    if (sam_close(outfp) != 0) {
+        fprintf(stderr, "Failed to close the file %s\n", outfname);
+        abort();
+    }
+}
+
+// The output FASTQ files are concatenated byte by byte, where the BGZF end-of-file blocks are kept only at the end. 
+void gather_fastqs(FILE *outfile, const std::vector<const char*> &infnames) {
+    bool is_eof_block_found = false;
+    for (const char *infname : infnames) {
+        int64_t n_bytes = file_size(infname);
+        FILE *infile = fopen(infname, "rb");
+        char tail[28];
+        if (NULL == infile) {
+            fprintf(stderr, "Failed to open the file %s for reading\n", infname);
+            exit(-1);
+        }
+        if (n_bytes >= 28 && 0 == fseeko(infile, n_bytes - 28, SEEK_SET) && 1 == fread(tail, 28, 1, infile) && !memcmp(BGZF_EOF_BLOCK, tail, 28)) {
+            n_bytes -= 28;
+            is_eof_block_found = true;
+        }
+        fclose(infile);
+        file_append(outfile, infname, n_bytes);
+    }
+    if (is_eof_block_found) {
+        fwrite(BGZF_EOF_BLOCK, 1, 28, outfile);
+    }
+}
+
+void gather_help(int argc, char **argv, int exit_code) {
+    fprintf(stdout, "Usage: %s gather -o <OUTPUT> <PART-OUTPUT-0> <PART-OUTPUT-1> ...\n", argv[0]);
+    fprintf(stdout, "  This command merges the outputs of the same kind of the parts of the plan command into OUTPUT, where the PART-OUTPUT files have to be in the order of the parts. "
+            "The output FASTQ files are concatenated, the output BAM/CRAM files (if OUTPUT has the .sam, .bam, or .cram extension) are concatenated under the header of PART-OUTPUT-0, "
+            "the rows of the variant reports (-K) of each variant are merged, and the counters of the run reports (-J) are summed and written to stderr in the same format as the one of a run. "
+            "The outputs are then the same as the ones of one run over the whole <INPUT-BAM> (after the decompression of the FASTQ files).\n");
+    fprintf(stdout, "Optional parameters:\n");
+    fprintf(stdout, " -T The reference FASTA file used for decoding and encoding the CRAM files [default to NULL pointer].\n");
+    fprintf(stdout, "Note:\n");
+    fprintf(stdout, "If -P is positive, then the mates in different parts are in the output FASTQ files of the unpaired reads of their parts.\n");
+    exit(exit_code);
+}
+
+int gather_main(int argc, char **argv) {
+    const char *outfname = NULL;
+    const char *reference = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "ho:T:")) != -1) {
+        switch (opt) {
+            case 'h': gather_help(argc, argv, 0);
+            case 'o': outfname = optarg; break;
+            case 'T': reference = optarg; break;
+            default: gather_help(argc, argv, -1);
+        }
+    }
+    if (NULL == outfname || optind >= argc) {
+        fprintf(stderr, "The output filename and at least one part output have to be specified on the command line\n");
+        gather_help(argc, argv, -1);
+    }
+    const std::vector<const char*> infnames(argv + optind, argv + argc);
+    char outmode[16];
+    if (0 == sam_open_mode(outmode, outfname, NULL)) {
+        gather_alignments(outfname, infnames, reference);
+        fprintf(stderr, "Gathered the alignments of the %lu parts into %s\n", infnames.size(), outfname);
+        return 0;
+    }
+    // the kind of the outputs is determined by the first line of the first part
+    char line[1024 * 4] = "";
+    FILE *infile = fopen(infnames[0], "rb");
+    if (NULL == infile) {
+        fprintf(stderr, "Failed to open the file %s for reading\n", infnames[0]);
+        exit(-1);
+    }
+    if (NULL == fgets(line, sizeof(line), infile)) { line[0] = '\0'; }
+    fclose(infile);
+    FILE *outfile = fopen(outfname, "wb");
+    if (NULL == outfile) {
+        fprintf(stderr, "Failed to open the file %s for writing\n", outfname);
+        abort();
+    }
+    if (!strcmp(SPIKE_VARIANT_REPORT_HEADER, line)) {
+        gather_variant_reports(outfile, infnames);
+        fprintf(stderr, "Gathered the variant reports of the %lu parts into %s\n", infnames.size(), outfname);
+    } else if (!strcmp("{\n", line)) {
+        fclose(outfile);
+        outfile = NULL;
+        spike_run_report_t report;
+        for (const char *infname : infnames) {
+            spike_run_report_t part_report;
+            spike_run_report_read(infname, part_report);
+            spike_run_report_merge(report, part_report);
+        }
+        spike_run_report_write(outfname, report);
+        fprintf(stderr, "Gathered the run reports of the %lu parts into %s\n", infnames.size(), outfname);
+        if (report.n_configs > 1) {
+            fprintf(stderr, "The following numbers are summed over all the %lu configurations\n", report.n_configs);
+        }
+        spike_stats_print(report.stats, (report.stats.num_edited_bam_reads > 0 || report.stats.num_indel_bam_reads > 0));
+    } else {
+        gather_fastqs(outfile, infnames);
+        fprintf(stderr, "Gathered the FASTQ files of the %lu parts into %s\n", infnames.size(), outfname);
+    }
+    if (outfile != NULL && fclose(outfile) != 0) {
+        fprintf(stderr, "Failed to close the file %s\n", outfname);
+        abort();
+    }
+    return 0;
+}
+
+// The engine of the library API is the sweep of the reader over the VCF file alone, 
+//   where the reads come from the caller one at a time instead of from the BAM file of the reader. 
+struct spike_engine_t {
+    std::vector<spike_args_t> configs;
+    spike_reader_t reader;
+    spike_batch_t batch; // holds the variants of the reads passed since the last recycling of the batch
+    uint64_t vcf_recs_beg_idx;
+    spike_workspace_t ws;
+    spike_stats_t stats;
+};
+
+void spike_engine_opts_init(spike_engine_opts_t &opts) {
+    opts.invcf = NULL;
+    opts.tagFA = TAG_FA;
+    opts.tagsample = NULL;
+    opts.defallelefrac = DEFAULT_ALLELE_FRAC;
+    opts.powerlaw_exponent = DEFAULT_POWER_LAW_EXPONENT;
+    opts.lognormal_disp = DEFAULT_LOGNORMAL_DISP;
+    opts.randseed = DEFAULT_RANDSEED;
+    opts.randseed_basecall = DEFAULT_RANDSEED;
+    opts.snv_bq_phred = DEFAULT_SNV_BQ_PHRED;
+    opts.ins_bq_phred = DEFAULT_INS_BQ_PHRED;
+    opts.samplehash1 = 0;
+    opts.samplehash2 = 0;
+}
+
+spike_engine_t *spike_engine_init(const spike_engine_opts_t &opts) {
+    spike_engine_t *engine = new spike_engine_t();
+    spike_reader_init(engine->reader, &engine->configs);
+    spike_reader_open_vcf(engine->reader, opts.invcf);
+    const spike_config_t config = {"", opts.defallelefrac, opts.powerlaw_exponent, opts.lognormal_disp, opts.randseed, opts.randseed_basecall};
+    spike_args_t args = {};
+    spike_args_set_config(args, config);
+    args.snv_bq_phred = opts.snv_bq_phred;
+    args.ins_bq_phred = opts.ins_bq_phred;
+    args.tagFA = opts.tagFA;
+    args.is_FA_from_INFO = tagsample_is_INFO(opts.tagsample);
+    args.tag_sample_idx = ((engine->reader.plan.addr != NULL) ? 0 : vcf_hdr_tag_sample_idx(engine->reader.vcf_hdr, opts.tagsample));
+    args.samplehash1 = opts.samplehash1;
+    args.samplehash2 = opts.samplehash2;
+    args.vcf_hdr = engine->reader.vcf_hdr;
+    args.config_idx = 0;
+    spike_args_set_kernel(args);
+    engine->configs.push_back(args);
+    engine->vcf_recs_beg_idx = 0;
+    return engine;
+}
+
+int spike_engine_process(spike_engine_t *engine, const bam1_t *aln, const spike_sink_t &sink) {
+    spike_reader_t &reader = engine->reader;
+    spike_batch_t &batch = engine->batch;
+    const spike_args_t &args = engine->configs[0];
+    // the variants that left the sweep are retired once per batch of reads as if the reads were read by spike_batch_fill
+    if (batch.vcf_ranges.size() >= DEFAULT_BATCH_SIZE) {
+        spike_batch_recycle(batch, args);
+        spike_batch_reclaim(batch, reader);
+        batch.vcf_ranges.clear();
+        batch.vcf_recs.assign(reader.vcf_list.begin(), reader.vcf_list.end());
+        engine->vcf_recs_beg_idx = reader.vcf_list_beg_idx;
+    }
+    engine->stats.num_input_reads++;
+    int spiked = -1;
+    if (0 == (aln->core.flag & (0x4 | 0x900))) {
+        spike_batch_sweep(batch, reader, aln, engine->vcf_recs_beg_idx);
+        const auto *vcf_recs_beg = batch.vcf_recs.data() + batch.vcf_ranges.back().first;
+        const auto *vcf_recs_end = batch.vcf_recs.data() + batch.vcf_ranges.back().second;
+        if (bamrec_is_passthrough(aln, vcf_recs_beg, vcf_recs_end)) {
+            engine->stats.num_passthrough_reads++;
+        } else {
+            spiked = bamrec_spike(aln, vcf_recs_beg, vcf_recs_end, args, engine->stats, engine->ws);
+        }
+    }
+    if (spiked > 0) {
+        sink.consume(sink.data, aln, spiked, engine->ws.newseq.data(), engine->ws.newqual.data(), (int)engine->ws.newseq.size());
+    } else {
+        sink.consume(sink.data, aln, spiked, NULL, NULL, 0);
+    }
+    return spiked;
+}
+
+void spike_engine_summary(const spike_engine_t *engine) {
+    fprintf(stderr, "Processed %ld reads\n", engine->stats.num_input_reads);
+    spike_stats_print(engine->stats, false);
+}
+
+void spike_engine_destroy(spike_engine_t *engine) {
+    spike_batch_recycle(engine->batch, engine->configs[0]);
+    spike_batch_destroy(engine->batch);
+    spike_reader_close(engine->reader);
+    spike_workspace_destroy(engine->ws);
+    delete engine;
+}
+
+#ifndef SAFESIM_NO_MAIN
+void help(int argc, char **argv, int exit_code) {
+    fprintf(stdout, "Program %s version %s (%s)\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH);
+    fprintf(stdout, "  This is a NGS variant simulator that is aware of the molecular-barcodes (also known as unique molecular identifiers (UMIs))\n");
+    
+    fprintf(stdout, "Usage: %s -b <INPUT-BAM> -v <INPUT-VCF> -1 <OUTPUT-R1-FASTQ> -2 <OUTPUT-R2-FASTQ.gz> -0 <OUTPUT-UNPAIRED-FASTQ.GZ>\n", argv[0]);
+    fprintf(stdout, "Usage: %s compile-vcf -v <INPUT-VCF> -o <OUTPUT-SPIKE-PLAN> (see %s compile-vcf -h)\n", argv[0], argv[0]);
+    fprintf(stdout, "  where <INPUT-VCF> can also be the <OUTPUT-SPIKE-PLAN> of compile-vcf.\n");
+    fprintf(stdout, "Usage: %s plan -b <INPUT-BAM> -n <NUMBER-OF-PARTS> -o <OUTPUT-PREFIX> (see %s plan -h)\n", argv[0], argv[0]);
+    fprintf(stdout, "Usage: %s gather -o <OUTPUT> <PART-OUTPUT-0> <PART-OUTPUT-1> ... (see %s gather -h)\n", argv[0], argv[0]);
+    fprintf(stdout, "Optional parameters:\n");
+    fprintf(stdout, " -f Fraction of variant allele (FA) to simulate. "
+            "This value is overriden by the INFO/FA tag (specified by the -F command-line parameter) in the INPUT-VCF. "
+            "Please note that INFO/FA must be defined the header of INPUT-VCF to be effective. "
+            "Otherwise, the value defined by -f is used in the simulation [default to %f].\n", DEFAULT_ALLELE_FRAC);
+    fprintf(stdout, " -p The power-law exponent simulating the over-dispersion of allele fractions in NGS [default to %f] (https://doi.org/10.1093/bib/bbab458). Negative value means that no over-dispersion is simulated. \n", DEFAULT_POWER_LAW_EXPONENT);
+    fprintf(stdout, " -q the log-normal over-dispersion parameter in Phred scale [default to %f] (https://doi.org/10.1093/bib/bbab458). Negative value means that no over-dispersion is simulated. \n", DEFAULT_LOGNORMAL_DISP);
+    fprintf(stdout, " -s The random seed used to simulate allele fractions from read names labeled with UMIs [default to %u].\n", DEFAULT_RANDSEED);
+    fprintf(stdout, " -t The number of worker threads used for spiking variants into reads. "
+            "The output files are always identical to the ones generated with one thread [default to %d].\n", DEFAULT_NTHREADS);
+    fprintf(stdout, " -r The region (for example, chr1:1000001-2000000, chr1, or * for the unmapped reads without coordinates) whose reads are processed using the BAM and VCF indexes, "
+            "where a read belongs to a region if the read starts in the region "
+            "so that the output files of the regions tiling the genome can be concatenated in order [default to the whole genome].\n");
+    fprintf(stdout, " -g The size of the shards into which the region (or the whole genome followed by the unmapped reads) is split using the BAM and VCF indexes. "
+            "If -t is more than one, then each thread processes whole shards, unless -o or -P is set. "
+            "The output files are concatenated in the order of the shards, so they are identical to the ones generated without shards after decompression. "
+            "Zero means no sharding [default to 0].\n");
+    fprintf(stdout, " -G The shard manifest of one part written by the plan command, whose shards are processed instead of the whole genome (and are further split by -g if -g is set), "
+            "so that the parts can be run on different nodes and their outputs merged with the gather command. "
+            "The -r and -G command-line parameters cannot both be set [default to NULL pointer].\n");
+    fprintf(stdout, " -R The BED file of the target regions (for example, the capture panel), where only the reads overlapping the targets are spiked. "
+            "Without -W, the other reads are skipped using the BAM and VCF indexes, except the mates of the reads overlapping the targets, "
+            "which are rescued unchanged (and written after all the reads overlapping the targets) so that no pair is broken. "
+            "-R without -W cannot be combined with -r, -g, or -G [default to NULL pointer].\n");
+    fprintf(stdout, " -W Stream the whole <INPUT-BAM> with -R, so that the reads not overlapping the targets are written unchanged [default to false].\n");
+    fprintf(stdout, " -@ The number of threads in the pool used for BAM/VCF decompression, "
+            "where zero means that decompression is done by the reading thread [default to %d].\n", DEFAULT_NTHREADS_HTS);
+    fprintf(stdout, " -l The compression level of the output FASTQ files [default to %d].\n", DEFAULT_FASTQ_LEVEL);
+    fprintf(stdout, " -O The format of the output FASTQ files, which is either bgzf (blocked gzip) or gz (one gzip member per batch of reads). "
+            "The FASTQ records are compressed by the threads specified by -t, and %s means no compression [default to %s].\n", 
+            FASTQ_FORMAT_NAMES[FASTQ_FORMAT_PLAIN], FASTQ_FORMAT_NAMES[FASTQ_FORMAT_BGZF]);
+    fprintf(stdout, " -u Write uncompressed outputs, which means -O %s for the output FASTQ files and compression level 0 for the output BAM file, "
+            "so that the outputs can be piped into the next tool without any compression round-trip [default to unset].\n", FASTQ_FORMAT_NAMES[FASTQ_FORMAT_PLAIN]);
+
+    
+    fprintf(stdout, " -o The output BAM/CRAM file (with the format inferred from the filename extension) to which all input alignments are copied. "
+            "The reads spiked with only SNVs/MNVs are edited in place with their CIGAR kept and their MD/NM tags updated. "
+            "The reads spiked with indels are kept unedited but flagged with 0x200 (not passing quality controls), and their spiked sequences are written to <OUTPUT-UNPAIRED-FASTQ.GZ>, "
+            "so that only these reads have to be aligned again (as single-end reads, because their mates are not spiked). "
+            "The secondary and supplementary alignments are also flagged with 0x200, as they may disagree with the edited bases of their primary alignments. "
+            "If this parameter is set, then no other read is written to the output FASTQ files [default to NULL pointer].\n");
+    fprintf(stdout, " -T The reference FASTA file used for decoding <INPUT-BAM> and encoding the -o output file in the CRAM format. "
+            "If -o is not set, then only the fields used for spiking are decoded from CRAM [default to NULL pointer].\n");
+    fprintf(stdout, " -V The verbosity of the messages written to stderr, which is 0 (%s), 1 (%s), 2 (%s), 3 (%s, one message per variant), or 4 (%s, one message per read). "
+            "The messages per read are rate-limited (only the 1st, 2nd, 4th, 8th, etc. ones are written) below the trace level [default to %d].\n", 
+            LOG_LEVEL_NAMES[0], LOG_LEVEL_NAMES[1], LOG_LEVEL_NAMES[2], LOG_LEVEL_NAMES[3], LOG_LEVEL_NAMES[4], DEFAULT_LOG_LEVEL);
+    fprintf(stdout, " -P The maximum memory in megabytes used for holding the R1/R2 mates whose other mates are not seen yet. "
+            "If positive, then R1 and R2 are written in the same order, the mates exceeding this memory are spilled to temporary files next to <OUTPUT-R1-FASTQ>, "
+            "and the mates without other mates go to <OUTPUT-UNPAIRED-FASTQ.GZ>. "
+            "Zero means that mates are written as soon as they are seen [default to %d].\n", DEFAULT_MATE_PAIRING_MEM_MB);
+    fprintf(stdout, " -I The interval in seconds between the progress reports with the reads per second, the current position, and the ETA, "
+            "which are estimated from the compressed offset in <INPUT-BAM> (or from the finished shards if the shards are processed in parallel). "
+            "Zero means no progress report [default to %d].\n", DEFAULT_PROGRESS_INTERVAL);
+    fprintf(stdout, " -c The checkpoint file that is replaced every -D seconds while <INPUT-BAM> is swept without the index, which requires <INPUT-BAM> and <INPUT-VCF> to be BGZF-compressed (or <INPUT-VCF> to be a spike plan) "
+            "and all the output files to be FASTQ files (or the variant report) other than the standard output [default to NULL pointer].\n");
+    fprintf(stdout, " -D The interval in seconds between two checkpoints [default to %d].\n", DEFAULT_CHECKPOINT_INTERVAL);
+    fprintf(stdout, " -Y Resume from the checkpoint of -c if it exists, where the command line has to be the same as the one of the interrupted run. "
+            "The output files are then identical to the ones of an uninterrupted run [default to false].\n");
+    fprintf(stdout, " -J The run report in the JSON format with the wall and CPU times of the decode, variant-lookup, mutation, formatting, compression, and write stages, "
+            "the reads and bytes per second, the peak memory, and the maximum number of variants in the sweep [default to NULL pointer].\n");
+    fprintf(stdout, " -K The variant report in the TSV format with the requested allele fraction, the reads covering the variant, "
+            "and the reads spiked with the variant for each variant and configuration [default to NULL pointer].\n");
+    fprintf(stdout, " -M The manifest file of additional configurations that are simulated in the same pass over <INPUT-BAM>. "
+            "Each line consists of an output prefix followed by some of the -f, -p, -q, -s, and -C command-line parameters with their values (for example: sim-s7-f0.05 -s 7 -f 0.05), "
+            "where the parameters not on the line are taken from the command line. "
+            "The outputs of each configuration are <prefix>.R0.fastq.gz, <prefix>.R1.fastq.gz, and <prefix>.R2.fastq.gz "
+            "(or <prefix>.R0.fastq, <prefix>.R1.fastq, and <prefix>.R2.fastq with -O %s or -u). "
+            "This parameter cannot be used with -o or -P [default to NULL pointer].\n", FASTQ_FORMAT_NAMES[FASTQ_FORMAT_PLAIN]);
+    fprintf(stdout, " -x Phred-scale sequencing error rates of simulated SNV variants "
+            "where -2 means zero error and -1 means using sequencer BQ [default to %d].\n", DEFAULT_SNV_BQ_PHRED);
+    
+    fprintf(stdout, " -i The base quality of the inserted bases in the simulated insertion variants. "
+            "[default to %d].\n", DEFAULT_INS_BQ_PHRED);
+    fprintf(stdout, " -A The number of reads used to generate the randomness for simulating the nominator of the allele fraction used with the -p cmd-line param [default to %u].\n", DEFAULT_NITERS1);
+    fprintf(stdout, " -B The number of reads used to generate the randomness for simulating the denominator of the allele fraction used with the -p cmd-line param [default to %u].\n", DEFAULT_NITERS2);
+    fprintf(stdout, " -C The random seed used to simulate basecalling error [default to %u].\n", DEFAULT_RANDSEED);
+    fprintf(stdout, " -H The comma-separated samplehash1 and samplehash2 (which are printed to stderr by each run) used instead of the ones computed from the first reads of <INPUT-BAM> with -A and -B, "
+            "so that the runs over different parts of the same sample can reuse the sample hashes of the whole sample [default to NULL pointer].\n");
+    fprintf(stdout, " -F allele fraction TAG in the VCF file. " "[default to FA].\n");
+    fprintf(stdout, " -S sample name used for the -F command-line parameter. "
+                    "The special values NULL pointer, empty-string, and INFO mean using the INFO column instead of the FORMAT column." "[default to NULL pointer].\n");
+    
+    fprintf(stdout, "Note:\n");
+    fprintf(stdout, "Reads in <OUTPUT-R1-FASTQ> and <OUTPUT-R2-FASTQ> are not in the same order unless -P is positive, so these output FASTQ files have to be sorted using a tool such as fastq-sort before being aligned again, as most aligners such as BWA and Bowtie2 require reads in the R1 and R2 files to be in the same order (This is VERY IMPORTANT!).\n");
+    fprintf(stdout, "<INPUT-BAM> and <INPUT-VCF> both have to be sorted and indexed, where a spike plan needs no index.\n");
+    fprintf(stdout, "The output FASTQ files in both the bgzf and gz formats are multi-member gzip files, which can be read by any tool that reads gzip-compressed files.\n");
+    fprintf(stdout, "The filename - means the standard input for <INPUT-BAM> or <INPUT-VCF> and the standard output for at most one of the output files, "
+            "where the input files cannot be the standard input if -r or -g is set (for example: samtools view -u in.bam | %s -b - -v in.vcf -u -o - -1 r1.fastq -2 r2.fastq | samtools sort -o out.bam).\n", argv[0]);
+    fprintf(stdout, "To detect UMI, this prgram first checks for the MI tag in each alignment record in <INPUT-BAM>. If the MI tag is absent, then the program checks for the string after the number-hash-pound sign (#) in the read name (QNAME).\n");
+    fprintf(stdout, "Each variant record in the INPUT-VCF needs to have only one variant, it cannot be multiallelic.\n");
+    fprintf(stdout, "Currently, the simulation of insertion/deletion variants causes longer/shorter-than-expected lengths of read template sequences due to preservation of alignment start and end positions on the reference genome.\n");
+    fprintf(stdout, "The symbol '#' denotes the start of UMI sequence so that any string before the '#' symbol is discarded.\n");
+    fprintf(stdout, "The symbol '+' in a UMI sequence means that the UMI is a duplex, so the substrings before/after the '+' symbol are respectively the alpha/beta tags.\n");
+    fprintf(stdout, "The BAM tag MI has special meaning as mentioned in the BAM file format specification."
+           "Therefore, for each BAM record, this program first searches for the MI tag. If the MI tag is not found, then this program uses the read name QNAME as the string containing UMI sequence.\n");
+    fprintf(stdout, "The -v command-line parameter without any other comamnd-line parameter means 'print version then exit with zero'.\n");
+    exit(exit_code);
+}
+
+int 
+main(int argc, char **argv) {
+    if (argc > 1 && !strcmp("compile-vcf", argv[1])) {
+        return compile_vcf_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp("plan", argv[1])) {
+        return plan_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && !strcmp("gather", argv[1])) {
+        return gather_main(argc - 1, argv + 1);
+    }
+    
+    int flags, opt;
+    char *inbam = NULL;
+    char *invcf = NULL;
+    char *r0outfq = NULL;
+    char *r1outfq = NULL;
+    char *r2outfq = NULL;
+    char *outbam = NULL;
+    const char *reference = NULL;
+    const char *region = NULL;
+    int64_t shard_size = 0;
+    const char *shard_manifest = NULL;
+    const char *target_bed = NULL;
+    bool is_off_target_kept = false;
+    const char *manifest = NULL;
+    const char *run_report = NULL;
+    const char *variant_report_fname = NULL;
+    const char *checkpoint = NULL;
+    int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    bool is_resumed = false;
+    double defallelefrac = DEFAULT_ALLELE_FRAC;
+    int snv_bq_phred = DEFAULT_SNV_BQ_PHRED;
+    int ins_bq_phred = DEFAULT_INS_BQ_PHRED;
+    uint32_t randseed = DEFAULT_RANDSEED;
+    uint32_t rand_niters1 = DEFAULT_NITERS1;
+    uint32_t rand_niters2 = DEFAULT_NITERS2;
+    const char *samplehashes = NULL;
+    uint32_t samplehash1 = 0;
+    uint32_t samplehash2 = 0;
+    uint32_t randseed_basecall = DEFAULT_RANDSEED;
+    const char *tagFA = TAG_FA;
+    const char *tagsample = NULL;
+    int log_level = DEFAULT_LOG_LEVEL;
+    int progress_interval = DEFAULT_PROGRESS_INTERVAL;
+    double powerlaw_exponent = DEFAULT_POWER_LAW_EXPONENT;
+    double lognormal_disp = DEFAULT_LOGNORMAL_DISP;
+    int nthreads = DEFAULT_NTHREADS;
+    int nthreads_hts = DEFAULT_NTHREADS_HTS;
+    fastq_format_t fastq_format = FASTQ_FORMAT_BGZF;
+    int fastq_level = DEFAULT_FASTQ_LEVEL;
+    int mate_pairing_mem_mb = DEFAULT_MATE_PAIRING_MEM_MB;
+    bool is_uncompressed = false;
+    while ((opt = getopt(argc, argv, "h0:1:2:b:c:f:g:i:l:o:p:q:r:s:t:uv:x:A:B:C:D:F:G:H:I:J:K:L:M:O:P:R:S:T:V:WY@:")) != -1) {
+        switch (opt) {
+            case 'h': help(argc, argv, 0);
+            case '0': r0outfq = optarg; break;
+            case '1': r1outfq = optarg; break;
+            case '2': r2outfq = optarg; break;
+            case 'b': inbam = optarg; break; // required            
+            case 'c': checkpoint = optarg; break;
+            case 'f': defallelefrac = atof(optarg); break;
+            case 'g': shard_size = atoll(optarg); break;
+            case 'G': shard_manifest = optarg; break;
+            case 'i': ins_bq_phred = atof(optarg); break;
+            case 'l': fastq_level = atoi(optarg); break;
+            case 'o': outbam = optarg; break;
+            case 'p': powerlaw_exponent = atof(optarg); break;
+            case 'q': lognormal_disp = atof(optarg); break;
+            case 'r': region = optarg; break;
+            case 's': randseed = atoi(optarg); break;
+            case 't': nthreads = atoi(optarg); break;
+            case 'v': invcf = optarg; break; // required
+            case 'x': snv_bq_phred = atof(optarg); break;
+            case 'A': rand_niters1 = atoi(optarg); break;
+            case 'B': rand_niters2 = atoi(optarg); break;
+            case 'C': randseed_basecall = atoi(optarg); break;
+            case 'D': checkpoint_interval = atoi(optarg); break;
+            case 'F': tagFA = optarg; break;
+            case 'H': 
+                samplehashes = optarg;
+                if (sscanf(optarg, "%u,%u", &samplehash1, &samplehash2) != 2) {
+                    fprintf(stderr, "The sample hashes %s are not two comma-separated unsigned integers\n", optarg);
+                    help(argc, argv, -1);
+                }
+                break;
+            case 'L': log_level = LOG_LEVEL_TRACE; break; // developer debug-mode flag which is not on the cmd-line help
+            case 'I': progress_interval = atoi(optarg); break;
+            case 'J': run_report = optarg; break;
+            case 'K': variant_report_fname = optarg; break;
+            case 'M': manifest = optarg; break;
+            case 'O': 
+                if (!strcmp(FASTQ_FORMAT_NAMES[FASTQ_FORMAT_BGZF], optarg)) { fastq_format = FASTQ_FORMAT_BGZF; }
+                else if (!strcmp(FASTQ_FORMAT_NAMES[FASTQ_FORMAT_GZIP], optarg)) { fastq_format = FASTQ_FORMAT_GZIP; }
+                else if (!strcmp(FASTQ_FORMAT_NAMES[FASTQ_FORMAT_PLAIN], optarg)) { fastq_format = FASTQ_FORMAT_PLAIN; }
+                else { fprintf(stderr, "The output FASTQ format %s is invalid\n", optarg); help(argc, argv, -1); }
+                break;
+            case 'P': mate_pairing_mem_mb = atoi(optarg); break;
+            case 'R': target_bed = optarg; break;
+            case 'S': tagsample = optarg; break;
+            case 'T': reference = optarg; break;
+            case 'V': log_level = atoi(optarg); break;
+            case 'W': is_off_target_kept = true; break;
+            case 'Y': is_resumed = true; break;
+            case 'u': is_uncompressed = true; break;
+            case '@': nthreads_hts = atoi(optarg); break;
+            default: help(argc, argv, -1);
+        }
+    }
+    if (NULL == inbam || NULL == invcf) {
+        fprintf(stderr, "The input BAM and VCF filenames have to be specified on the command line\n");
+        help(argc, argv, -1);
+    }
+    if (!strcmp("-", inbam) && !strcmp("-", invcf)) {
+        fprintf(stderr, "The input BAM and VCF files cannot both be the standard input\n");
+        help(argc, argv, -1);
+    }
+    if ((!strcmp("-", inbam) || !strcmp("-", invcf)) && (region != NULL || shard_size > 0 || shard_manifest != NULL)) {
+        fprintf(stderr, "The -r, -g, and -G command-line parameters require the BAM and VCF indexes, so the input BAM and VCF files cannot be the standard input\n");
+        help(argc, argv, -1);
+    }
+    if (region != NULL && shard_manifest != NULL) {
+        fprintf(stderr, "The -r and -G command-line parameters cannot both be set\n");
+        help(argc, argv, -1);
+    }
+    if (is_off_target_kept && NULL == target_bed) {
+        fprintf(stderr, "The -W command-line parameter requires the target regions of -R\n");
+        help(argc, argv, -1);
+    }
+    if (target_bed != NULL && !is_off_target_kept && (region != NULL || shard_size > 0 || shard_manifest != NULL)) {
+        fprintf(stderr, "The -R command-line parameter without -W cannot be combined with -r, -g, or -G, as the target regions are the shards\n");
+        help(argc, argv, -1);
+    }
+    if (target_bed != NULL && !is_off_target_kept && (!strcmp("-", inbam) || !strcmp("-", invcf))) {
+        fprintf(stderr, "The -R command-line parameter without -W requires the BAM and VCF indexes, so the input BAM and VCF files cannot be the standard input\n");
+        help(argc, argv, -1);
+    }
+    int n_stdout_files = 0;
+    const char *cmdline_outfnames[4] = {r0outfq, r1outfq, r2outfq, outbam};
+    for (const char *outfname : cmdline_outfnames) {
+        n_stdout_files += ((outfname != NULL && !strcmp("-", outfname)) ? 1 : 0);
+    }
+    if (n_stdout_files > 1) {
+        fprintf(stderr, "At most one output file can be the standard output\n");
+        help(argc, argv, -1);
+    }
+    if (is_resumed && NULL == checkpoint) {
+        fprintf(stderr, "The -Y command-line parameter requires the checkpoint of -c\n");
+        help(argc, argv, -1);
+    }
+    if (checkpoint != NULL && (!strcmp("-", inbam) || !strcmp("-", invcf) || n_stdout_files > 0 || outbam != NULL || mate_pairing_mem_mb > 0 
+            || region != NULL || shard_size > 0 || shard_manifest != NULL || (target_bed != NULL && !is_off_target_kept))) {
+        fprintf(stderr, "The checkpoint (-c) cannot be combined with the standard input or output, -o, -P, -r, -g, -G, or -R without -W\n");
+        help(argc, argv, -1);
+    }
+    if (is_uncompressed) { fastq_format = FASTQ_FORMAT_PLAIN; }
+    if ((NULL == r0outfq) && (NULL == r1outfq) && (NULL == r2outfq) && (NULL == outbam) && (NULL == manifest)) {
+        fprintf(stderr, "At least one output FASTQ or BAM file or the manifest has to be specified on the command line\n");
+        help(argc, argv, -1);
+    }
+    if (fastq_level < 0 || fastq_level > 9) {
+        fprintf(stderr, "The compression level (%d) has to be between 0 and 9\n", fastq_level);
+        help(argc, argv, -1);
+    }
+    if (mate_pairing_mem_mb > 0 && (NULL == r1outfq || NULL == r2outfq)) {
+        fprintf(stderr, "Both the R1 and R2 output FASTQ files have to be specified if the -P command-line parameter is positive\n");
+        help(argc, argv, -1);
+    }
+    if (outbam != NULL && NULL == r0outfq) {
+        fprintf(stderr, "Warning: the reads spiked with indels are only flagged in the output BAM file %s because <OUTPUT-UNPAIRED-FASTQ.GZ> is not set\n", outbam);
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "The number of threads (%d) has to be at least one\n", nthreads);
+        help(argc, argv, -1);
+    }
+    if (manifest != NULL && (outbam != NULL || mate_pairing_mem_mb > 0)) {
+        fprintf(stderr, "The manifest cannot be used with the -o command-line parameter or a positive -P command-line parameter\n");
+        help(argc, argv, -1);
+    }
+    const spike_config_t cmdline_config = {"", defallelefrac, powerlaw_exponent, lognormal_disp, randseed, randseed_basecall};
+    std::vector<spike_config_t> manifest_configs;
+    if (manifest != NULL) {
+        manifest_configs = spike_manifest_load(manifest, cmdline_config);
+        if (0 == manifest_configs.size() && (NULL == r0outfq) && (NULL == r1outfq) && (NULL == r2outfq)) {
+            fprintf(stderr, "The manifest file %s has no configuration\n", manifest);
+            exit(-1);
+        }
+    }
+    if (log_level < LOG_LEVEL_ERROR || log_level > LOG_LEVEL_TRACE) {
+        fprintf(stderr, "The verbosity (%d) has to be between %d and %d\n", log_level, LOG_LEVEL_ERROR, LOG_LEVEL_TRACE);
+        exit(-1);
+    }
+    const bool is_FA_from_INFO = tagsample_is_INFO(tagsample);
+    fprintf(stderr, "%s\n=== version ===\n%s\n%s\n%s\n", argv[0], FULL_VERSION, COMMIT_DIFF_SH, GIT_DIFF_FULL);
+    log_sink.verbosity = log_level;
+    log_sink_start();
+    const int64_t run_beg_ns = clock_ns(CLOCK_MONOTONIC);
+    
+    htsThreadPool tpool = {NULL, 0};
+    if (nthreads_hts > 0) {
+        tpool.pool = hts_tpool_init(nthreads_hts);
+        if (NULL == tpool.pool) {
+            fprintf(stderr, "Failed to create a pool of %d threads for compression and decompression\n", nthreads_hts);
+            abort();
+        }
+    }
+    spike_args_t args;
+    std::vector<spike_args_t> configs;
+    spike_reader_t reader;
+    spike_reader_init(reader, &configs);
+    spike_reader_open(reader, inbam, invcf, reference, ((NULL == outbam) ? SPIKE_FASTQ_REQUIRED_FIELDS : 0), &tpool);
+    sam_hdr_t *bam_hdr = reader.bam_hdr;
+    bcf_hdr_t *vcf_hdr = reader.vcf_hdr;
+    int tag_sample_idx = 0;
+    if (reader.plan.addr != NULL) {
+        fprintf(stderr, "The %lu variants are read from the spike plan %s, where -F and -S were applied by compile-vcf\n", reader.plan.header->n_variants, invcf);
+    } else {
+        tag_sample_idx = vcf_hdr_tag_sample_idx(vcf_hdr, tagsample);
+    }
+    if (checkpoint != NULL && (!reader.bam_fp->is_bgzf || (NULL == reader.plan.addr && !reader.vcf_fp->is_bgzf))) {
+        fprintf(stderr, "The checkpoint (-c) requires the BAM file %s and the VCF file %s to be BGZF-compressed (or the VCF file to be a spike plan)\n", inbam, invcf);
+        exit(-1);
+    }
+    
+    target_regions_t targets;
+    if (target_bed != NULL) {
+        target_regions_load(targets, target_bed, bam_hdr);
+        fprintf(stderr, "The %lu merged target regions of %ld bases are read from %s\n", targets.n_intervals, targets.n_bases, target_bed);
+        reader.targets = &targets;
+        reader.is_off_target_kept = is_off_target_kept;
+    }
+    std::vector<spike_shard_t> shards;
+    if (target_bed != NULL && !is_off_target_kept) {
+        spike_reader_load_index(reader, inbam, invcf);
+        shards = spike_shards_make(bam_hdr, NULL, 0, &targets);
+        fprintf(stderr, "The reads overlapping the %lu target regions and their mates are visited using the BAM and VCF indexes\n", shards.size());
+    } else if (shard_manifest != NULL) {
+        spike_reader_load_index(reader, inbam, invcf);
+        shards = spike_shards_split(spike_shard_manifest_load(shard_manifest, bam_hdr), shard_size);
+        fprintf(stderr, "The reads are processed in %lu shards of the shard manifest %s using the BAM and VCF indexes\n", shards.size(), shard_manifest);
+    } else if (region != NULL || shard_size > 0) {
+        spike_reader_load_index(reader, inbam, invcf);
+        shards = spike_shards_make(bam_hdr, region, shard_size, NULL);
+        fprintf(stderr, "The reads are processed in %lu shards using the BAM and VCF indexes\n", shards.size());
+    }
+    
+    // three (R0, R1, and R2) per configuration, where the empty filename means no output
+    std::vector<std::string> outfnames;
+    const bool is_cmdline_config_used = (NULL != r0outfq || NULL != r1outfq || NULL != r2outfq || NULL != outbam);
+    if (is_cmdline_config_used) {
+        outfnames.push_back(r0outfq != NULL ? r0outfq : "");
+        outfnames.push_back(r1outfq != NULL ? r1outfq : "");
+        outfnames.push_back(r2outfq != NULL ? r2outfq : "");
+    }
+    for (const auto & config : manifest_configs) {
+        outfnames.push_back(config.outprefix + ".R0" + FASTQ_FORMAT_EXTENSIONS[fastq_format]);
+        outfnames.push_back(config.outprefix + ".R1" + FASTQ_FORMAT_EXTENSIONS[fastq_format]);
+        outfnames.push_back(config.outprefix + ".R2" + FASTQ_FORMAT_EXTENSIONS[fastq_format]);
+    }
+    // the output files of the interrupted run are truncated at the checkpoint instead
+    const bool is_resuming = (is_resumed && access(checkpoint, F_OK) == 0);
+    std::vector<FILE*> outfiles(outfnames.size(), NULL);
+    for (size_t outidx = 0; outidx < outfnames.size(); outidx++) {
+        if (0 == outfnames[outidx].size()) { continue; }
+        outfiles[outidx] = (("-" == outfnames[outidx]) ? stdout : fopen(outfnames[outidx].c_str(), (is_resuming ? "r+b" : "wb")));
+        if (NULL == outfiles[outidx]) {
+            fprintf(stderr, "Failed to open the file %s for writing\n", outfnames[outidx].c_str());
+            abort();
+        }
+    }
+    samFile *outbam_fp = NULL;
+    if (outbam != NULL) {
+        char outbam_mode[16] = "w";
+        if (sam_open_mode(outbam_mode + 1, outbam, NULL) != 0) { strcpy(outbam_mode, "wb"); }
+        if (is_uncompressed) { strcat(outbam_mode, "0"); }
+        outbam_fp = sam_open(outbam, outbam_mode);
+        if (NULL == outbam_fp) {
+            fprintf(stderr, "Failed to open the file %s for writing\n", outbam);
+            abort();
+        }
+        if (tpool.pool != NULL) {
+            hts_set_opt(outbam_fp, HTS_OPT_THREAD_POOL, &tpool);
+        }
+        if (reference != NULL && hts_set_opt(outbam_fp, CRAM_OPT_REFERENCE, reference) != 0) {
+            fprintf(stderr, "Failed to set the reference %s for the file %s\n", reference, outbam);
+            abort();
+        }
+        if (sam_hdr_write(outbam_fp, bam_hdr) < 0) {
+            fprintf(stderr, "Failed to write the SAM header to the file %s\n", outbam);
+            abort();
+        }
+    }
+    
+    if (samplehashes != NULL) {
+        fprintf(stderr, "The value samplehash1 and samplehash2 are %u and %u from the command line\n", samplehash1, samplehash2);
+    } else {
+        const uint64_t read_cnt = spike_reader_samplehashes(reader, rand_niters1, rand_niters2, samplehash1, samplehash2);
+        fprintf(stderr, "The value samplehash1 and samplehash2 are %u and %u, read_cnt = %lu\n", samplehash1, samplehash2, read_cnt);
+    }
+    
+    spike_args_set_config(args, cmdline_config);
+    args.snv_bq_phred = snv_bq_phred;
+    args.ins_bq_phred = ins_bq_phred;
+    args.tagFA = tagFA;
+    args.is_FA_from_INFO = is_FA_from_INFO;
+    args.tag_sample_idx = tag_sample_idx;
+    args.samplehash1 = samplehash1;
+    args.samplehash2 = samplehash2;
+    args.vcf_hdr = vcf_hdr;
+    args.is_outfile_set[0] = (r0outfq != NULL);
+    args.is_outfile_set[1] = (r1outfq != NULL);
+    args.is_outfile_set[2] = (r2outfq != NULL);
+    args.fastq_format = fastq_format;
+    args.fastq_level = fastq_level;
+    args.is_mate_paired = (mate_pairing_mem_mb > 0);
+    args.is_bam_output = (outbam != NULL);
+    args.is_profiling = (run_report != NULL);
+    spike_progress_t progress;
+    args.progress = ((progress_interval > 0) ? &progress : NULL);
+    spike_variant_report_t variant_report;
+    args.variant_report = NULL;
+    if (variant_report_fname != NULL) {
+        spike_variant_report_open(variant_report, variant_report_fname, bam_hdr, is_resuming);
+        args.variant_report = &variant_report;
+    }
+    spike_args_set_kernel(args);
+    if (is_cmdline_config_used) {
+        args.config_idx = 0;
+        configs.push_back(args);
+        fprintf(stderr, "lnsigma = %f\n", args.lnsigma);
+    }
+    for (const auto & manifest_config : manifest_configs) {
+        spike_args_t config = args;
+        spike_args_set_config(config, manifest_config);
+        for (int outidx = 0; outidx < 3; outidx++) {
+            config.is_outfile_set[outidx] = true;
+        }
+        config.config_idx = (int)configs.size();
+        configs.push_back(config);
+        fprintf(stderr, "lnsigma = %f for the configuration with the output prefix %s\n", config.lnsigma, manifest_config.outprefix.c_str());
+    }
+    
+    mate_pairer_t pairer;
+    pairer.max_bytes = (size_t)mate_pairing_mem_mb * 1024 * 1024;
+    pairer.run_prefix = std::string(r1outfq != NULL ? r1outfq : "") + ".unpaired-mates.";
+    for (int outidx = 0; outidx < 3; outidx++) {
+        pairer.outfiles[outidx] = outfiles[outidx];
+    }
+    
+    reader.is_keeping_all_reads = args.is_bam_output;
+    reader.shards = shards;
+    std::vector<spike_variant_t*> no_vcf_retired;
+    if (reader.shards.size() > 0) {
+        spike_reader_open_shard(reader, no_vcf_retired);
+    }
+    
+    std::vector<spike_writer_t> writers;
+    for (size_t outidx = 0; outidx < outfiles.size(); outidx++) {
+        if (args.is_mate_paired && 2 == outidx) { continue; }
+        spike_writer_t writer = {(int)outidx, outfiles[outidx], ((args.is_mate_paired && 1 == outidx) ? &pairer : NULL), NULL, NULL};
+        writers.push_back(writer);
+    }
+    if (outbam_fp != NULL) {
+        spike_writer_t writer = {-1, NULL, NULL, outbam_fp, bam_hdr};
+        writers.push_back(writer);
+    }
+    
+    std::vector<spike_stats_t> thread_stats(nthreads);
+    spike_checkpointer_t checkpointer;
+    spike_checkpointer_t *checkpointer_ptr = NULL;
+    if (checkpoint != NULL) {
+        checkpointer.fname = checkpoint;
+        checkpointer.interval_ns = (int64_t)checkpoint_interval * 1000 * 1000 * 1000;
+        checkpointer.last_ns = clock_ns(CLOCK_MONOTONIC);
+        checkpointer.inbam = inbam;
+        checkpointer.invcf = invcf;
+        checkpointer.outfiles = outfiles;
+        checkpointer.outfnames = outfnames;
+        checkpointer.outfiles.push_back((args.variant_report != NULL) ? variant_report.file : NULL);
+        checkpointer.outfnames.push_back((args.variant_report != NULL) ? variant_report_fname : "");
+        checkpointer.thread_stats = &thread_stats;
+        checkpointer.n_batches = 0;
+        checkpointer_ptr = &checkpointer;
+        if (is_resuming) {
+            spike_checkpoint_resume(checkpointer, reader);
+            for (size_t outidx = 0; outidx < outfiles.size(); outidx++) {
+                outfiles[outidx] = checkpointer.outfiles[outidx];
+            }
+            for (auto & writer : writers) {
+                if (writer.outidx >= 0) { writer.outfile = outfiles[writer.outidx]; }
+            }
+            if (args.variant_report != NULL) { variant_report.file = checkpointer.outfiles.back(); }
+        } else if (is_resumed) {
+            fprintf(stderr, "The checkpoint %s does not exist, so the run starts from the beginning\n", checkpoint);
+        }
+    }
+    // the rescue shards of mates are known only after all the target shards are swept, so the target shards are swept in order
+    const bool is_shard_parallel = (nthreads > 1 && shards.size() > 1 && !args.is_bam_output && !args.is_mate_paired && (NULL == target_bed || is_off_target_kept));
+    if (args.progress != NULL) {
+        spike_progress_start(progress, bam_hdr, file_size(inbam), (is_shard_parallel ? (int64_t)shards.size() : 0), progress_interval);
+    }
+    if (is_shard_parallel) {
+        spike_shard_queue_t queue;
+        queue.is_shard_done.resize(shards.size(), false);
+        queue.targets = reader.targets;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < nthreads; i++) {
+            threads.push_back(std::thread(spike_shard_queue_work, &queue, &configs, &thread_stats[i], inbam, invcf, reference, &tpool, &shards, &outfnames));
+        }
+        for (size_t shard_idx = 0; shard_idx < shards.size(); shard_idx++) {
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.cond.wait(lock, [&] { return queue.is_shard_done[shard_idx]; });
+            }
+            for (size_t outidx = 0; outidx < outfiles.size(); outidx++) {
+                if (outfiles[outidx] != NULL) {
+                    const std::string tmpfname = spike_shard_tmpfname(outfnames[outidx].c_str(), shard_idx);
+                    file_append(outfiles[outidx], tmpfname.c_str(), -1);
+                    remove(tmpfname.c_str());
+                }
+            }
+        }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    } else if (1 == nthreads) {
+        spike_batch_t batch;
+        spike_workspace_t ws;
+        spike_reader_run(reader, configs, thread_stats[0], ws, batch, writers, checkpointer_ptr);
+        spike_batch_destroy(batch);
+        spike_workspace_destroy(ws);
+    } else {
+        spike_pipeline_t pipeline;
+        std::vector<spike_batch_t> batches(nthreads * 4);
+        for (auto & batch : batches) {
+            pipeline.free_batches.push_back(&batch);
+        }
+        std::vector<std::thread> threads;
+        for (int i = 0; i < nthreads; i++) {
+            threads.push_back(std::thread(spike_pipeline_work, &pipeline, &configs, &thread_stats[i]));
+        }
+        for (auto & writer : writers) {
+            threads.push_back(std::thread(spike_pipeline_write, &pipeline, &configs, &writer));
+        }
+        while (true) {
+            spike_batch_t *batch = NULL;
+            if (spike_checkpoint_is_due(checkpointer_ptr, reader)) {
+                // the checkpoint is taken only after all the batches filled so far are processed and written
+                std::unique_lock<std::mutex> lock(pipeline.mutex);
+                pipeline.cond.wait(lock, [&] { return pipeline.free_batches.size() == batches.size(); });
+                spike_checkpoint_write(checkpointer, reader);
+            }
+            {
+                std::unique_lock<std::mutex> lock(pipeline.mutex);
+                pipeline.cond.wait(lock, [&] { return pipeline.free_batches.size() > 0; });
+                batch = pipeline.free_batches.front();
+                pipeline.free_batches.pop_front();
+            }
+            if (0 == spike_batch_fill(*batch, reader, DEFAULT_BATCH_SIZE)) {
+                spike_batch_recycle(*batch, configs[0]);
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(pipeline.mutex);
+                batch->seqnum = pipeline.n_batches;
+                batch->n_pending_writes = (int)writers.size();
+                pipeline.todo_batches.push_back(batch);
+                pipeline.n_batches++;
+            }
+            if (checkpointer_ptr != NULL) { checkpointer.n_batches++; }
+            pipeline.cond.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(pipeline.mutex);
+            pipeline.is_reading_done = true;
+        }
+        pipeline.cond.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        for (auto & batch : batches) {
+            spike_batch_destroy(batch);
+        }
+    }
+    if (args.is_mate_paired) {
+        mate_pairer_finish(pairer, args);
+    }
+    spike_stats_t stats;
+    for (const auto & stats1 : thread_stats) {
+        spike_stats_add(stats, stats1);
+    }
+    
+    if (outbam_fp != NULL && sam_close(outbam_fp) != 0) {
+        fprintf(stderr, "Failed to close the file %s\n", outbam);
+        abort();
+    }
+    spike_stats_add(stats, reader.stats);
+    for (const auto & writer : writers) {
+        spike_stats_add(stats, writer.stats);
+    }
+    spike_reader_close(reader);
+    if (args.variant_report != NULL && fclose(variant_report.file) != 0) {
+        fprintf(stderr, "Failed to close the variant report %s\n", variant_report_fname);
+        abort();
+    }
+    
+    for (size_t outidx = 0; outidx < outfiles.size(); outidx++) {
+        if (NULL == outfiles[outidx]) { continue; }
+        if (FASTQ_FORMAT_BGZF == fastq_format) {
+            fwrite(BGZF_EOF_BLOCK, 1, 28, outfiles[outidx]);
+        }
+        if (fclose(outfiles[outidx]) != 0) {
+            fprintf(stderr, "Failed to close the file %s\n", outfnames[outidx].c_str());
+            abort();
+        }
+    }
+    if (tpool.pool != NULL) {
+        hts_tpool_destroy(tpool.pool);
+    }
+    
+    if (args.progress != NULL) {
+        spike_progress_stop(progress);
+    }
+    if (checkpoint != NULL) {
+        remove(checkpoint);
+    }
+    log_sink_stop();
+    if (configs.size() > 1) {
+        fprintf(stderr, "The following numbers are summed over all the %lu configurations\n", configs.size());
+    }
+    spike_stats_print(stats, args.is_bam_output);
+    if (run_report != NULL) {
+        int64_t output_bytes = file_size(outbam);
+        for (const auto & outfname : outfnames) {
+            if (outfname.size() > 0) { output_bytes += file_size(outfname.c_str()); }
+        }
+        spike_run_report_t report;
+        report.stats = stats;
+        report.wall_ns = clock_ns(CLOCK_MONOTONIC) - run_beg_ns;
+        report.input_bytes = file_size(inbam);
+        report.output_bytes = output_bytes;
+        report.nthreads = nthreads;
+        report.n_configs = configs.size();
+        spike_run_report_set_usage(report);
+        spike_run_report_write(run_report, report);
+    }
+}
+#endif
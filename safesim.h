@@ -0,0 +1,93 @@
+#ifndef SAFESIM_INCLUDED__
+#define SAFESIM_INCLUDED__
+
+// The in-process API of safemut and safemix for spiking variants into reads and mixing reads inside another program
+//   without writing and parsing any intermediate file.
+// Build libsafesim.a with "make libsafesim.a", include this header, and link with -lsafesim -lhts.
+// The sweep, the spiking and the selection are the ones of the command-line tools, so the same reads are spiked and kept as on the command line.
+
+#include "htslib/sam.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+// the bits returned by spike_engine_process and passed to spike_sink_t for the kinds of variants spiked into a read
+const int SPIKED_SUBSTITUTION = 0x1;
+const int SPIKED_INDEL = 0x2;
+
+// The parameters of one simulation, where each field corresponds to the safemut command-line parameter in the comment.
+typedef struct {
+    const char *invcf; // -v, the coordinate-sorted VCF/BCF file or the spike plan compiled by compile-vcf
+    const char *tagFA; // -F
+    const char *tagsample; // -S
+    double defallelefrac; // -f
+    double powerlaw_exponent; // -p
+    double lognormal_disp; // -q
+    uint32_t randseed; // -s
+    uint32_t randseed_basecall; // -C
+    int snv_bq_phred; // -x
+    int ins_bq_phred; // -i
+    // -H, the sample hashes printed to stderr by each run of safemut, which have to be the ones of the same BAM file to spike the same reads
+    uint32_t samplehash1;
+    uint32_t samplehash2;
+} spike_engine_opts_t;
+
+// The consumer of the reads passed through spike_engine_process, which gets each read without any FASTQ formatting.
+// seq (nucleotides in ACGTN) and qual (Phred scores without the +33 offset) of length len are the spiked sequence in the alignment orientation,
+//   where len differs from aln->core.l_qseq if an indel was spiked.
+// If spiked is zero or negative, then the read is not changed and seq and qual are NULL.
+// The read and the buffers are valid only during the call, so the consumer copies whatever it keeps.
+typedef struct {
+    void *data;
+    void (*consume)(void *data, const bam1_t *aln, int spiked, const char *seq, const char *qual, int len);
+} spike_sink_t;
+
+typedef struct spike_engine_t spike_engine_t;
+
+// Set opts to the defaults of the safemut command line.
+void spike_engine_opts_init(spike_engine_opts_t &opts);
+
+// Open the VCF file of opts, whose reference sequences have to be in the same order as the ones of the BAM file of the reads.
+spike_engine_t *spike_engine_init(const spike_engine_opts_t &opts);
+
+// Spike the read and pass it to the sink, where the reads have to be passed in the coordinate order of the BAM file.
+// Return the SPIKED_* bits of the variants spiked into the read, or -1 if the read overlaps no variant or is unmapped, secondary or supplementary.
+int spike_engine_process(spike_engine_t *engine, const bam1_t *aln, const spike_sink_t &sink);
+
+// Print the numbers of processed and spiked reads to stderr as safemut does at the end of each run.
+void spike_engine_summary(const spike_engine_t *engine);
+
+void spike_engine_destroy(spike_engine_t *engine);
+
+// The parameters of mixing, where each field corresponds to the safemix command-line parameter in the comment.
+typedef struct {
+    double tumor_umi_size; // -d
+    double normal_umi_size; // -e
+    std::vector<double> tumor_fractions; // -f
+    double tumor_quantity; // -i
+    double normal_quantity; // -j
+    uint32_t randseed1; // -r
+    uint32_t randseed2; // -s
+    bool is_umi_only; // -U
+} mix_selector_opts_t;
+
+enum mix_sample_t {
+    MIX_SAMPLE_TUMOR,
+    MIX_SAMPLE_NORMAL,
+};
+
+typedef struct mix_selector_t mix_selector_t;
+
+// Set opts to the defaults of the safemix command line.
+void mix_selector_opts_init(mix_selector_opts_t &opts);
+
+mix_selector_t *mix_selector_init(const mix_selector_opts_t &opts);
+
+// Return true if the read of the tumor or normal sample is kept in the mixture with the tumor fraction at frac_idx of opts.tumor_fractions.
+// The decision depends only on the read, so the reads can be passed in any order and from any number of threads.
+bool mix_selector_keep(const mix_selector_t *selector, mix_sample_t sample, size_t frac_idx, const bam1_t *aln);
+
+void mix_selector_destroy(mix_selector_t *selector);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef TARGET_REGIONS_INCLUDED__
+#define TARGET_REGIONS_INCLUDED__
+
+// The target regions of a capture panel read from a BED file (see -R of safemut and safemix),
+//   which restrict the reads visited with the BAM index to the ones overlapping the targets and their mates.
+
+#include "htslib/hts.h"
+#include "htslib/kstring.h"
+#include "htslib/sam.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+const hts_pos_t TARGET_MATES_MAX_GAP = 1024 * 16; // the mates outside the targets that are at most this far apart are rescued with one index query
+
+// The intervals [beg, end) of each reference sequence (indexed by tid), which are sorted and neither overlap nor touch each other.
+typedef struct {
+    std::vector<std::vector<std::pair<hts_pos_t, hts_pos_t>>> intervals;
+    size_t n_intervals;
+    hts_pos_t n_bases;
+} target_regions_t;
+
+// Sort the intervals and merge the ones overlapping or touching each other. 
+static inline void target_intervals_merge(std::vector<std::pair<hts_pos_t, hts_pos_t>> &intervals) {
+    std::sort(intervals.begin(), intervals.end());
+    size_t n_merged = 0;
+    for (const auto & interval : intervals) {
+        if (n_merged > 0 && interval.first <= intervals[n_merged - 1].second) {
+            intervals[n_merged - 1].second = std::max(intervals[n_merged - 1].second, interval.second);
+        } else {
+            intervals[n_merged++] = interval;
+        }
+    }
+    intervals.resize(n_merged);
+}
+
+// Read the BED file (which can be gzipped) and merge its overlapping and adjacent intervals.
+// The header, track, and browser lines are skipped, and so are the intervals on the sequences not found in bam_hdr (with a warning).
+static inline void target_regions_load(target_regions_t &regions, const char *bedfname, const sam_hdr_t *bam_hdr) {
+    htsFile *bedfile = hts_open(bedfname, "r");
+    if (NULL == bedfile) {
+        fprintf(stderr, "Failed to open the BED file %s for reading\n", bedfname);
+        exit(-1);
+    }
+    regions.intervals.assign(sam_hdr_nref(bam_hdr), std::vector<std::pair<hts_pos_t, hts_pos_t>>());
+    kstring_t line = KS_INITIALIZE;
+    int64_t lineno = 0;
+    int64_t n_skipped = 0;
+    while (hts_getline(bedfile, KS_SEP_LINE, &line) >= 0) {
+        lineno++;
+        if (0 == line.l || '#' == line.s[0] || !strncmp("track", line.s, 5) || !strncmp("browser", line.s, 7)) { continue; }
+        char *tname_end = strchr(line.s, '\t');
+        char *beg_end = NULL;
+        char *end_end = NULL;
+        const hts_pos_t beg = ((tname_end != NULL) ? strtoll(tname_end + 1, &beg_end, 10) : -1);
+        const hts_pos_t end = ((beg_end != NULL && beg_end != tname_end + 1) ? strtoll(beg_end, &end_end, 10) : -1);
+        if (NULL == end_end || end_end == beg_end || beg < 0 || end < beg) {
+            fprintf(stderr, "The line %ld of the BED file %s is not an interval: %s\n", lineno, bedfname, line.s);
+            exit(-1);
+        }
+        *tname_end = '\0';
+        const int tid = sam_hdr_name2tid((sam_hdr_t*)bam_hdr, line.s);
+        if (tid < 0) {
+            n_skipped++;
+            continue;
+        }
+        if (beg < end) { regions.intervals[tid].push_back(std::make_pair(beg, end)); }
+    }
+    free(line.s);
+    hts_close(bedfile);
+    if (n_skipped > 0) {
+        fprintf(stderr, "Warning: %ld intervals of the BED file %s are on the sequences not in the header of the BAM file and are skipped\n", n_skipped, bedfname);
+    }
+    regions.n_intervals = 0;
+    regions.n_bases = 0;
+    for (auto & intervals : regions.intervals) {
+        target_intervals_merge(intervals);
+        regions.n_intervals += intervals.size();
+        for (const auto & interval : intervals) { regions.n_bases += interval.second - interval.first; }
+    }
+    if (0 == regions.n_intervals) {
+        fprintf(stderr, "The BED file %s has no interval on the sequences in the header of the BAM file\n", bedfname);
+        exit(-1);
+    }
+}
+
+static inline bool target_regions_overlap(const target_regions_t &regions, int tid, hts_pos_t beg, hts_pos_t end) {
+    if (tid < 0 || tid >= (int)regions.intervals.size()) { return false; }
+    const auto &intervals = regions.intervals[tid];
+    // the first interval ending after beg
+    const auto it = std::upper_bound(intervals.begin(), intervals.end(), beg, [](hts_pos_t pos, const std::pair<hts_pos_t, hts_pos_t> &interval) {
+        return pos < interval.second;
+    });
+    return (it != intervals.end() && it->first < std::max(end, beg + 1));
+}
+
+// Whether the read is visited as one overlapping the targets, where the unmapped reads placed at the positions of their mates span one base.
+static inline bool target_regions_overlap_read(const target_regions_t &regions, const bam1_t *aln) {
+    return target_regions_overlap(regions, aln->core.tid, aln->core.pos, bam_endpos(aln));
+}
+
+// The mates that are outside the targets but whose other mates overlap the targets, which are rescued so that the pairs remain complete.
+// Only the start of each mate is known from its other mate, so mates starting outside the targets are rescued only if no part of them overlaps the targets.
+typedef struct {
+    std::unordered_set<std::string> qnames;
+    std::vector<std::pair<int, hts_pos_t>> positions;
+} target_mates_t;
+
+// Remember the mate of the primary alignment aln overlapping the targets if the mate may be outside the targets.
+static inline void target_mates_add(target_mates_t &mates, const target_regions_t &regions, const bam1_t *aln) {
+    const auto &core = aln->core;
+    if (0 == (core.flag & 0x1) || 0 != (core.flag & 0x900) || core.mtid < 0 || target_regions_overlap(regions, core.mtid, core.mpos, core.mpos + 1)) { return; }
+    mates.qnames.insert(bam_get_qname(aln));
+    mates.positions.push_back(std::make_pair(core.mtid, core.mpos));
+}
+
+// Whether the read visited in target_mates_intervals is a mate rescued by target_mates_add.
+static inline bool target_mates_is_rescued(const target_mates_t &mates, const target_regions_t &regions, const bam1_t *aln) {
+    return (0 == (aln->core.flag & 0x900)) && !target_regions_overlap_read(regions, aln) && mates.qnames.count(bam_get_qname(aln)) > 0;
+}
+
+// Sort the positions of the mates and merge them into the intervals (of each tid) whose bases are at most max_gap bases apart,
+//   so that the nearby mates are read with one index query.
+static inline std::vector<std::vector<std::pair<hts_pos_t, hts_pos_t>>> target_mates_intervals(target_mates_t &mates, size_t n_targets, hts_pos_t max_gap) {
+    std::vector<std::vector<std::pair<hts_pos_t, hts_pos_t>>> intervals(n_targets);
+    std::sort(mates.positions.begin(), mates.positions.end());
+    for (const auto & position : mates.positions) {
+        auto &intervals1 = intervals[position.first];
+        if (intervals1.size() > 0 && position.second <= intervals1.back().second + max_gap) {
+            intervals1.back().second = std::max(intervals1.back().second, position.second + 1);
+        } else {
+            intervals1.push_back(std::make_pair(position.second, position.second + 1));
+        }
+    }
+    return intervals;
+}
+
+#endif